@@ -5,6 +5,9 @@
 #include <cmath>
 #include <iomanip>
 #include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <numeric>
 #include <naex/geom.h>
 #include <naex/point_field_traits.h>
@@ -14,6 +17,7 @@
 #include <sensor_msgs/point_cloud2_iterator.h>
 #include <sensor_msgs/PointCloud2.h>
 #include <naex/timer.h>
+#include <tuple>
 #include <unordered_set>
 
 namespace naex
@@ -287,74 +291,81 @@ size_t num_points(const sensor_msgs::PointCloud2& cloud)
             elevation_step_(elevation_step),
             height_(height),
             width_(width)
-        {}
+        {
+            update_tables();
+        }
 
-        bool check(const sensor_msgs::PointCloud2& cloud)
+        /// Minimum angular step, half of which is the tolerated residual.
+        Value tolerance() const
         {
-            assert(height_ == cloud.height);
-            assert(width_ == cloud.width);
-            if (cloud.height != height_ || cloud.width != width_)
+            return std::min(std::abs(azimuth_step_), std::abs(elevation_step_)) / 2;
+        }
+
+        /**
+         * Mean angular residual of the model over a regular subset of valid
+         * points, or NaN if there is no valid point. Points with zero range
+         * are not valid.
+         *
+         * Model directions come from per-column and per-row cosine and sine
+         * tables, the residual is evaluated at once over the subset.
+         */
+        Value residual(const sensor_msgs::PointCloud2& cloud, Index max_samples = 256) const
+        {
+            const Index n_points = Index(num_points(cloud));
+            if (n_points == 0 || cloud.height != height_ || cloud.width != width_
+                || cos_az_.size() != width_ || cos_el_.size() != height_)
             {
-                ROS_WARN("Cloud size (%i, %i) inconsistent with model size (%i, %i).",
-                         cloud.height, cloud.width, height_, width_);
+                return std::numeric_limits<Value>::quiet_NaN();
             }
-            std::stringstream az_ss, el_ss;
-            sensor_msgs::PointCloud2ConstIterator<float> x_it(cloud, "x");
-            double residual_sum = 0.;
+            const Index stride = std::max(n_points / std::max(max_samples, Index(1)), Index(1));
+            sensor_msgs::PointCloud2ConstIterator<float> x_begin(cloud, "x");
+            Eigen::Matrix<Value, 3, Eigen::Dynamic> pts(3, n_points / stride + 1);
+            Eigen::Matrix<Value, 3, Eigen::Dynamic> dirs(3, pts.cols());
             Index n = 0;
-
-            for (Index r = 0; r < height_; ++r)
+            for (Index i = stride / 2; i < n_points; i += stride)
             {
-                for (Index c = 0; c < width_; ++c, ++x_it)
-                {
-                    if (!std::isfinite(x_it[0]) || !std::isfinite(x_it[1]) || !std::isfinite(x_it[2]))
-                        continue;
-                    Value r_model, c_model;
-                    project(x_it[0], x_it[1], x_it[2], r_model, c_model);
-
-                    if (r == std::round(r_model) && c == std::round(c_model))
-                    {
-                        continue;
-                    }
-
-                    Vec3 pt(x_it[0], x_it[1], x_it[2]);
-                    pt.normalize();
-                    Vec3 pt_model(0., 0., 0.);
-                    unproject(Value(r), Value(c), pt_model(0), pt_model(1), pt_model(2));
-                    Value residual = std::acos(pt.dot(pt_model));
-                    if (std::isfinite(residual))
-                    {
-                        residual_sum += residual;
-                        ++n;
-                    }
+                const auto x = x_begin + i;
+                if (!std::isfinite(x[0]) || !std::isfinite(x[1]) || !std::isfinite(x[2]))
                     continue;
-
-                    if (residual <= std::min(std::abs(azimuth_step_), std::abs(elevation_step_)) / 2.f)
-                    {
-                        continue;
-                    }
-
-                    ROS_WARN("Model direction [%.3f, %.3f, %.3f] "
-                             "inconsistent with data [%.3f, %.3f, %.3f], "
-                             "residual %.3f [deg].",
-                             pt_model(0), pt_model(1), pt_model(2),
-                             pt.x(), pt.y(), pt.z(),
-                             residual);
-                }
+                // Zero range has no direction.
+                if (x[0] * x[0] + x[1] * x[1] + x[2] * x[2] == 0.f)
+                    continue;
+                const Index r = i / width_;
+                const Index c = i % width_;
+                pts.col(n) << x[0], x[1], x[2];
+                dirs.col(n) << cos_el_[r] * cos_az_[c], cos_el_[r] * sin_az_[c], sin_el_[r];
+                ++n;
             }
-            double mean_residual = residual_sum / n;
-            if (mean_residual > std::min(std::abs(azimuth_step_), std::abs(elevation_step_)) / 2.)
+            if (n == 0)
             {
-                ROS_WARN("Mean angular error: %.3f [deg].", degrees(residual_sum / n));
+                return std::numeric_limits<Value>::quiet_NaN();
             }
-            else
+            const auto cos_residual = (pts.leftCols(n).array() * dirs.leftCols(n).array()).colwise().sum()
+                                      / pts.leftCols(n).colwise().norm().array();
+            return cos_residual.min(Value(1)).max(Value(-1)).acos().mean();
+        }
+
+        /// Check that the model conforms to a subset of cloud points.
+        bool check(const sensor_msgs::PointCloud2& cloud, Index max_samples = 1024) const
+        {
+            if (cloud.height != height_ || cloud.width != width_)
+            {
+                ROS_DEBUG("Cloud size (%i, %i) inconsistent with model size (%i, %i).",
+                          cloud.height, cloud.width, height_, width_);
+                return false;
+            }
+            const Value mean_residual = residual(cloud, max_samples);
+            if (!(mean_residual <= tolerance()))
             {
-                ROS_DEBUG("Mean angular error: %.3f [deg].", residual_sum / n);
+                ROS_DEBUG("Mean angular error %.3f > %.3f [deg].",
+                          degrees(mean_residual), degrees(tolerance()));
+                return false;
             }
+            ROS_DEBUG("Mean angular error: %.3f [deg].", degrees(mean_residual));
             return true;
         }
 
-        void print_model_summary()
+        void print_model_summary() const
         {
             std::stringstream az_ss, el_ss;
             for (Index r = 0; r < height_; r += height_ / 8)
@@ -438,6 +449,7 @@ size_t num_points(const sensor_msgs::PointCloud2& cloud)
                       azimuth_1 - azimuth_0, int(c0), int(c1),
                       t.seconds_elapsed());
 
+            update_tables();
             // Check that the whole cloud conforms to the estimated parameters.
 //            assert(check(cloud));
             return true;
@@ -522,6 +534,7 @@ size_t num_points(const sensor_msgs::PointCloud2& cloud)
 
             height_ = cloud.height;
             width_ = cloud.width;
+            update_tables();
 
             ROS_DEBUG("Robust fit [deg]: "
                       "azimuth [%.1f, %.1f], step %.3f (from %lu models), "
@@ -536,13 +549,134 @@ size_t num_points(const sensor_msgs::PointCloud2& cloud)
             return true;
         }
 
+        /**
+         * Fit the model from a deterministic sparse grid of rows and columns.
+         *
+         * Azimuth steps are estimated from neighboring samples within sampled
+         * rows, elevation steps within sampled columns, and the median models
+         * are validated on a subset of points.
+         */
+        bool fit_sampled(const sensor_msgs::PointCloud2& cloud,
+                         Index num_rows = 16, Index num_cols = 32, Index max_samples = 256)
+        {
+            Timer t;
+            if (cloud.height < 2 || cloud.width < 2)
+            {
+                return false;
+            }
+            const Index height = cloud.height;
+            const Index width = cloud.width;
+            const Index row_stride = std::max(height / std::max(num_rows, Index(1)), Index(1));
+            const Index col_stride = std::max(width / std::max(num_cols, Index(1)), Index(1));
+            sensor_msgs::PointCloud2ConstIterator<float> x_begin(cloud, "x");
+
+            // Spherical coordinates of the sampled grid, NaN if invalid or at zero range.
+            std::vector<Index> rows, cols;
+            for (Index r = row_stride / 2; r < height; r += row_stride)
+                rows.push_back(r);
+            for (Index c = col_stride / 2; c < width; c += col_stride)
+                cols.push_back(c);
+            std::vector<Value> az(rows.size() * cols.size(), std::numeric_limits<Value>::quiet_NaN());
+            std::vector<Value> el(az.size(), std::numeric_limits<Value>::quiet_NaN());
+            for (Index i = 0; i < rows.size(); ++i)
+            {
+                for (Index j = 0; j < cols.size(); ++j)
+                {
+                    const auto x = x_begin + (rows[i] * width + cols[j]);
+                    if (!std::isfinite(x[0]) || !std::isfinite(x[1]) || !std::isfinite(x[2]))
+                        continue;
+                    if (x[0] * x[0] + x[1] * x[1] + x[2] * x[2] == 0.f)
+                        continue;
+                    az[i * cols.size() + j] = azimuth(x[0], x[1]);
+                    el[i * cols.size() + j] = elevation(x[0], x[1], x[2]);
+                }
+            }
+
+            // Models (start, step) from pairs of consecutive valid samples.
+            typedef std::pair<Value, Value> Model;
+            std::vector<Model> az_models, el_models;
+            for (Index i = 0; i < rows.size(); ++i)
+            {
+                Index j0 = INVALID_INDEX;
+                for (Index j = 0; j < cols.size(); ++j)
+                {
+                    if (!std::isfinite(az[i * cols.size() + j]))
+                        continue;
+                    if (j0 != INVALID_INDEX)
+                    {
+                        Value diff = az[i * cols.size() + j] - az[i * cols.size() + j0];
+                        // Azimuth wraps around within a full revolution.
+                        if (diff > Value(M_PI))
+                            diff -= Value(2 * M_PI);
+                        else if (diff < -Value(M_PI))
+                            diff += Value(2 * M_PI);
+                        const Value step = diff / (int(cols[j]) - int(cols[j0]));
+                        az_models.push_back({az[i * cols.size() + j0] - cols[j0] * step, step});
+                    }
+                    j0 = j;
+                }
+            }
+            for (Index j = 0; j < cols.size(); ++j)
+            {
+                Index i0 = INVALID_INDEX;
+                for (Index i = 0; i < rows.size(); ++i)
+                {
+                    if (!std::isfinite(el[i * cols.size() + j]))
+                        continue;
+                    if (i0 != INVALID_INDEX)
+                    {
+                        const Value step = (el[i * cols.size() + j] - el[i0 * cols.size() + j])
+                                           / (int(rows[i]) - int(rows[i0]));
+                        el_models.push_back({el[i0 * cols.size() + j] - rows[i0] * step, step});
+                    }
+                    i0 = i;
+                }
+            }
+            if (az_models.empty() || el_models.empty())
+            {
+                return false;
+            }
+
+            // Get median step models.
+            const auto comp = [](const Model& a, const Model& b) { return a.second < b.second; };
+            auto az_median = az_models.begin() + az_models.size() / 2;
+            std::nth_element(az_models.begin(), az_median, az_models.end(), comp);
+            auto el_median = el_models.begin() + el_models.size() / 2;
+            std::nth_element(el_models.begin(), el_median, el_models.end(), comp);
+
+            // Keep azimuth of the first column within [-pi, pi].
+            const Value az_start = std::atan2(std::sin(az_median->first), std::cos(az_median->first));
+            SphericalProjection model(az_start, az_median->second,
+                                      el_median->first, el_median->second,
+                                      cloud.height, cloud.width);
+            const Value mean_residual = model.residual(cloud, max_samples);
+            if (!(mean_residual <= model.tolerance()))
+            {
+                ROS_DEBUG("Sampled fit rejected, mean angular error %.3f > %.3f [deg] (%.6f s).",
+                          degrees(mean_residual), degrees(model.tolerance()), t.seconds_elapsed());
+                return false;
+            }
+            *this = std::move(model);
+
+            ROS_DEBUG("Sampled fit [deg]: "
+                      "azimuth [%.1f, %.1f], step %.3f (from %lu models), "
+                      "elevation [%.1f, %.1f], step %.3f (from %lu models), "
+                      "mean angular error %.3f (%.6f s).",
+                      degrees(azimuth_start_), degrees(azimuth_start_ + (width_ - 1) * azimuth_step_),
+                      degrees(azimuth_step_), az_models.size(),
+                      degrees(elevation_start_), degrees(elevation_start_ + (height_ - 1) * elevation_step_),
+                      degrees(elevation_step_), el_models.size(),
+                      degrees(mean_residual), t.seconds_elapsed());
+            return true;
+        }
+
         bool fit(const sensor_msgs::PointCloud2& cloud)
         {
-            return fit_robust(cloud);
+            return fit_sampled(cloud) || fit_robust(cloud);
         }
 
         template<typename T>
-        inline void unproject(const T& r, const T& c, T& x, T& y, T& z)
+        inline void unproject(const T& r, const T& c, T& x, T& y, T& z) const
         {
             const T azimuth = azimuth_start_ + c * azimuth_step_;
             const T elevation = elevation_start_ + r * elevation_step_;
@@ -550,7 +684,7 @@ size_t num_points(const sensor_msgs::PointCloud2& cloud)
         }
 
         template<typename T>
-        void project(const T x, const T y, const T z, T& r, T& c)
+        void project(const T x, const T y, const T z, T& r, T& c) const
         {
             T azimuth, elevation, radius;
             cartesian_to_spherical(x, y, z, azimuth, elevation, radius);
@@ -559,7 +693,7 @@ size_t num_points(const sensor_msgs::PointCloud2& cloud)
         }
 
         template<typename PointIt, typename ProjIt>
-        void project(PointIt x_begin, PointIt x_end, ProjIt u_begin)
+        void project(PointIt x_begin, PointIt x_end, ProjIt u_begin) const
         {
             for (; x_begin < x_end; ++x_begin, ++u_begin)
             {
@@ -578,6 +712,92 @@ size_t num_points(const sensor_msgs::PointCloud2& cloud)
         // Cloud 2D grid size.
         uint32_t height_;
         uint32_t width_;
+
+    protected:
+        void update_tables()
+        {
+            cos_az_.resize(width_);
+            sin_az_.resize(width_);
+            for (Index c = 0; c < width_; ++c)
+            {
+                cos_az_[c] = std::cos(azimuth_start_ + c * azimuth_step_);
+                sin_az_[c] = std::sin(azimuth_start_ + c * azimuth_step_);
+            }
+            cos_el_.resize(height_);
+            sin_el_.resize(height_);
+            for (Index r = 0; r < height_; ++r)
+            {
+                cos_el_[r] = std::cos(elevation_start_ + r * elevation_step_);
+                sin_el_[r] = std::sin(elevation_start_ + r * elevation_step_);
+            }
+        }
+
+        // Direction tables for columns and rows.
+        std::vector<Value> cos_az_;
+        std::vector<Value> sin_az_;
+        std::vector<Value> cos_el_;
+        std::vector<Value> sin_el_;
+    };
+
+    /**
+     * Spherical projection models cached per sensor frame and cloud size.
+     *
+     * A cached model is only validated on a small subset of each cloud and
+     * refit if it does not match, e.g., after a sensor configuration change.
+     * Safe to use from multiple threads.
+     */
+    class SphericalProjectionCache
+    {
+    public:
+        typedef std::shared_ptr<const SphericalProjection> ModelPtr;
+
+        /// Get a model conforming to the cloud, null if fitting fails.
+        ModelPtr get(const sensor_msgs::PointCloud2& cloud)
+        {
+            Timer t;
+            const Key key(cloud.header.frame_id, cloud.height, cloud.width);
+            ModelPtr cached;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                const auto it = models_.find(key);
+                if (it != models_.end())
+                    cached = it->second;
+            }
+            if (cached && cached->check(cloud, max_check_samples_))
+            {
+                return cached;
+            }
+            auto model = std::make_shared<SphericalProjection>();
+            if (!model->fit(cloud))
+            {
+                return nullptr;
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                models_[key] = model;
+            }
+            ROS_INFO("Spherical model for %s %u-by-%u cloud %s: "
+                     "elevation step %.3f, azimuth step %.3f [deg] (%.6f s).",
+                     cloud.header.frame_id.c_str(), cloud.height, cloud.width,
+                     cached ? "refit" : "fit",
+                     degrees(model->elevation_step_), degrees(model->azimuth_step_),
+                     t.seconds_elapsed());
+            return model;
+        }
+
+        void clear()
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            models_.clear();
+        }
+
+        // Number of points validating a cached model.
+        Index max_check_samples_ = 64;
+
+    protected:
+        typedef std::tuple<std::string, uint32_t, uint32_t> Key;
+        std::mutex mutex_;
+        std::map<Key, ModelPtr> models_;
     };
 
 void copy_cloud_metadata(const sensor_msgs::PointCloud2& input,
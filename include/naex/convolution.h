@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <complex>
+#include <cstddef>
+#include <Eigen/Core>
+#include <unsupported/Eigen/FFT>
+#include <vector>
+
+namespace naex
+{
+
+/// Smallest size not lower than n with prime factors 2, 3 and 5 only,
+/// for which the FFT is efficient.
+inline int next_fast_size(int n)
+{
+    for (int m = std::max(n, 1); ; ++m)
+    {
+        int r = m;
+        for (int f: {2, 3, 5})
+        {
+            while (r % f == 0)
+            {
+                r /= f;
+            }
+        }
+        if (r == 1)
+        {
+            return m;
+        }
+    }
+}
+
+/**
+ * Dense 3D grid of values, with x-major (z contiguous) storage.
+ */
+template<typename T>
+class Grid3
+{
+public:
+    Grid3()
+    {}
+    Grid3(int nx, int ny, int nz, T value = T(0)):
+        nx_(nx), ny_(ny), nz_(nz),
+        data_(size_t(nx) * ny * nz, value)
+    {}
+
+    inline size_t index(int x, int y, int z) const
+    {
+        return (size_t(x) * ny_ + y) * nz_ + z;
+    }
+    inline T& operator()(int x, int y, int z)
+    {
+        return data_[index(x, y, z)];
+    }
+    inline const T& operator()(int x, int y, int z) const
+    {
+        return data_[index(x, y, z)];
+    }
+    size_t size() const
+    {
+        return data_.size();
+    }
+
+    int nx_{0};
+    int ny_{0};
+    int nz_{0};
+    std::vector<T> data_{};
+};
+
+/**
+ * In-place 3D FFT computed as 1D transforms along each axis.
+ * Inverse transform is scaled, so that inverse(forward(x)) == x.
+ */
+template<typename T>
+void fft_3d(Grid3<std::complex<T>>& grid, bool inverse = false)
+{
+    typedef std::complex<T> C;
+    const int n[3] = {grid.nx_, grid.ny_, grid.nz_};
+    // Element strides along x, y and z axes.
+    const size_t stride[3] = {size_t(grid.ny_) * grid.nz_, size_t(grid.nz_), 1};
+    for (int axis = 0; axis < 3; ++axis)
+    {
+        const int a1 = (axis + 1) % 3;
+        const int a2 = (axis + 2) % 3;
+        const int n_lines = n[a1] * n[a2];
+        #pragma omp parallel
+        {
+            // FFT objects cache plans and are not meant to be shared.
+            Eigen::FFT<T> fft;
+            std::vector<C> line(n[axis]);
+            std::vector<C> out(n[axis]);
+            #pragma omp for schedule(static)
+            for (int l = 0; l < n_lines; ++l)
+            {
+                const size_t start = (l / n[a2]) * stride[a1] + (l % n[a2]) * stride[a2];
+                for (int i = 0; i < n[axis]; ++i)
+                {
+                    line[i] = grid.data_[start + i * stride[axis]];
+                }
+                if (inverse)
+                {
+                    fft.inv(out.data(), line.data(), n[axis]);
+                }
+                else
+                {
+                    fft.fwd(out.data(), line.data(), n[axis]);
+                }
+                for (int i = 0; i < n[axis]; ++i)
+                {
+                    grid.data_[start + i * stride[axis]] = out[i];
+                }
+            }
+        }
+    }
+}
+
+/// Number of cells of the padded grid used by convolve_fft.
+inline size_t convolve_fft_cells(int nx, int ny, int nz, int r)
+{
+    return size_t(next_fast_size(nx + r)) * size_t(next_fast_size(ny + r)) * size_t(next_fast_size(nz + r));
+}
+
+/**
+ * Linear convolution of a 3D grid with a symmetric kernel given for offsets
+ * within [-r, r] along each axis, computed via FFT.
+ *
+ * @param input Input grid.
+ * @param kernel Kernel function of integer offsets (dx, dy, dz).
+ * @param r Kernel radius in cells.
+ * @return Output grid of input size.
+ */
+template<typename T, typename K>
+Grid3<T> convolve_fft(const Grid3<T>& input, K kernel, int r)
+{
+    typedef std::complex<T> C;
+    // Pad to avoid circular wrap-around in the valid region. Input is at
+    // [0, n), kernel offsets within [-r, r] wrap into padding [n, n + r).
+    const int nx = next_fast_size(input.nx_ + r);
+    const int ny = next_fast_size(input.ny_ + r);
+    const int nz = next_fast_size(input.nz_ + r);
+
+    Grid3<C> f(nx, ny, nz);
+    for (int x = 0; x < input.nx_; ++x)
+        for (int y = 0; y < input.ny_; ++y)
+            for (int z = 0; z < input.nz_; ++z)
+                f(x, y, z) = input(x, y, z);
+
+    // Negative offsets wrap around.
+    Grid3<C> g(nx, ny, nz);
+    for (int dx = -r; dx <= r; ++dx)
+        for (int dy = -r; dy <= r; ++dy)
+            for (int dz = -r; dz <= r; ++dz)
+                g((dx + nx) % nx, (dy + ny) % ny, (dz + nz) % nz) = kernel(dx, dy, dz);
+
+    fft_3d(f);
+    fft_3d(g);
+    for (size_t i = 0; i < f.size(); ++i)
+    {
+        f.data_[i] *= g.data_[i];
+    }
+    fft_3d(f, true);
+
+    Grid3<T> output(input.nx_, input.ny_, input.nz_);
+    for (int x = 0; x < input.nx_; ++x)
+        for (int y = 0; y < input.ny_; ++y)
+            for (int z = 0; z < input.nz_; ++z)
+                output(x, y, z) = f(x, y, z).real();
+    return output;
+}
+
+}  // namespace naex
@@ -0,0 +1,277 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <naex/nearest_neighbors.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <naex/voxel_filter.h>
+#include <ros/ros.h>
+#include <unordered_map>
+#include <vector>
+
+namespace naex
+{
+
+/**
+ * Incrementally maintained goal candidates for exploration.
+ *
+ * Candidates are rewarding map points, e.g., traversable points next to
+ * edges which are not covered yet, as given by the predicate. These are
+ * clustered in voxels and each cluster is represented by its point with
+ * most edge neighbors. Goal selection then scores only the cluster
+ * representatives instead of all map points.
+ *
+ * Points are checked once their labels or coverage change. Points which
+ * stopped being candidates otherwise, e.g., when removed from the map,
+ * are dropped from their clusters lazily, on goal selection.
+ *
+ * Thread-safe, selection may run from concurrent planning requests while
+ * candidates are updated under exclusive map lock.
+ */
+template<typename P>
+class GoalCandidates
+{
+public:
+    typedef std::function<bool(const P&)> Predicate;
+    typedef std::mutex Mutex;
+    typedef std::lock_guard<Mutex> Lock;
+
+    class Cluster
+    {
+    public:
+        std::vector<Index> indices_{};
+        Index representative_{invalid_index<Index>()};
+        // Representative needs to be chosen again.
+        bool dirty_{true};
+    };
+
+    GoalCandidates()
+    {}
+    GoalCandidates(Value cluster_size, Predicate predicate):
+        cluster_size_(cluster_size),
+        predicate_(predicate)
+    {}
+
+    /// Set cluster size and predicate, dropping all candidates.
+    void reset(Value cluster_size, Predicate predicate)
+    {
+        Lock lock(mutex_);
+        cluster_size_ = cluster_size;
+        predicate_ = predicate;
+        clusters_.clear();
+        point_cluster_.clear();
+    }
+
+    void clear()
+    {
+        Lock lock(mutex_);
+        clusters_.clear();
+        point_cluster_.clear();
+    }
+
+    size_t size() const
+    {
+        Lock lock(mutex_);
+        return point_cluster_.size();
+    }
+
+    size_t num_clusters() const
+    {
+        Lock lock(mutex_);
+        return clusters_.size();
+    }
+
+    /// Add new candidates and drop points which are no longer candidates.
+    template<typename C>
+    void update(const std::vector<P>& points, const C& indices)
+    {
+        Lock lock(mutex_);
+        if (!predicate_)
+        {
+            return;
+        }
+        for (const auto i: indices)
+        {
+            if (i < 0 || i >= Index(points.size()))
+            {
+                continue;
+            }
+            const bool candidate = predicate_(points[i]);
+            const auto it = point_cluster_.find(i);
+            if (candidate && it == point_cluster_.end())
+            {
+                Voxel<int> v;
+                if (!v.from<Value>(points[i].position_, cluster_size_))
+                {
+                    continue;
+                }
+                auto& cluster = clusters_[v];
+                cluster.indices_.push_back(i);
+                cluster.dirty_ = true;
+                point_cluster_.emplace(i, v);
+            }
+            else if (candidate)
+            {
+                // Number of edge neighbors may have changed.
+                clusters_[it->second].dirty_ = true;
+            }
+            else if (it != point_cluster_.end())
+            {
+                const auto cluster_it = clusters_.find(it->second);
+                erase(cluster_it->second, i);
+                point_cluster_.erase(it);
+                if (cluster_it->second.indices_.empty())
+                {
+                    clusters_.erase(cluster_it);
+                }
+            }
+        }
+    }
+
+    /// Apply map index remap after compaction or reordering.
+    void remap(const std::vector<Index>& remap)
+    {
+        Lock lock(mutex_);
+        std::unordered_map<Index, Voxel<int>> point_cluster;
+        point_cluster.reserve(point_cluster_.size());
+        for (auto it = clusters_.begin(); it != clusters_.end();)
+        {
+            auto& cluster = it->second;
+            for (auto& i: cluster.indices_)
+            {
+                i = i < Index(remap.size()) ? remap[i] : invalid_index<Index>();
+                if (!invalid_index(i))
+                {
+                    point_cluster.emplace(i, it->first);
+                }
+            }
+            cluster.indices_.erase(std::remove_if(cluster.indices_.begin(), cluster.indices_.end(),
+                                                  [](Index i) { return invalid_index(i); }),
+                                   cluster.indices_.end());
+            cluster.representative_ = invalid_index<Index>();
+            cluster.dirty_ = true;
+            if (cluster.indices_.empty())
+            {
+                it = clusters_.erase(it);
+            }
+            else
+            {
+                ++it;
+            }
+        }
+        point_cluster_.swap(point_cluster);
+    }
+
+    /**
+     * Select cluster representative with the lowest score, skipping
+     * representatives with NaN or infinite score.
+     *
+     * Returns invalid index if there is no such representative.
+     */
+    Index select(const std::vector<P>& points, const std::function<Value(Index)>& score)
+    {
+        Lock lock(mutex_);
+        Timer t;
+        Index best = invalid_index<Index>();
+        Value best_score = std::numeric_limits<Value>::infinity();
+        size_t n_scored = 0;
+        for (auto it = clusters_.begin(); it != clusters_.end();)
+        {
+            auto& cluster = it->second;
+            if (cluster.dirty_ || cluster.representative_ >= Index(points.size())
+                || !predicate_(points[cluster.representative_]))
+            {
+                repair(points, cluster);
+            }
+            if (cluster.indices_.empty())
+            {
+                it = clusters_.erase(it);
+                continue;
+            }
+            const Value s = score(cluster.representative_);
+            ++n_scored;
+            if (s < best_score)
+            {
+                best = cluster.representative_;
+                best_score = s;
+            }
+            ++it;
+        }
+        ROS_DEBUG("%lu / %lu goal candidates scored (%.3f s).",
+                  n_scored, point_cluster_.size(), t.seconds_elapsed());
+        return best;
+    }
+
+    /// Visit current cluster representatives.
+    template<typename F>
+    void for_each_representative(F f) const
+    {
+        Lock lock(mutex_);
+        for (const auto& kv: clusters_)
+        {
+            if (!invalid_index(kv.second.representative_))
+            {
+                f(kv.second.representative_);
+            }
+        }
+    }
+
+protected:
+    static void erase(Cluster& cluster, Index i)
+    {
+        const auto it = std::find(cluster.indices_.begin(), cluster.indices_.end(), i);
+        if (it != cluster.indices_.end())
+        {
+            std::swap(*it, cluster.indices_.back());
+            cluster.indices_.pop_back();
+        }
+        if (cluster.representative_ == i)
+        {
+            cluster.representative_ = invalid_index<Index>();
+        }
+        cluster.dirty_ = true;
+    }
+
+    /// Drop points which are no longer candidates, choose representative.
+    void repair(const std::vector<P>& points, Cluster& cluster)
+    {
+        auto& indices = cluster.indices_;
+        for (size_t j = 0; j < indices.size();)
+        {
+            const auto i = indices[j];
+            if (i < Index(points.size()) && predicate_(points[i]))
+            {
+                ++j;
+                continue;
+            }
+            point_cluster_.erase(i);
+            indices[j] = indices.back();
+            indices.pop_back();
+        }
+        cluster.representative_ = invalid_index<Index>();
+        for (const auto i: indices)
+        {
+            if (invalid_index(cluster.representative_)
+                || points[i].num_edge_neighbors_ > points[cluster.representative_].num_edge_neighbors_
+                || (points[i].num_edge_neighbors_ == points[cluster.representative_].num_edge_neighbors_
+                    && i < cluster.representative_))
+            {
+                cluster.representative_ = i;
+            }
+        }
+        cluster.dirty_ = false;
+    }
+
+    mutable Mutex mutex_;
+    Value cluster_size_{1.0};
+    Predicate predicate_{};
+    VoxelMap<int, Cluster> clusters_{};
+    // Cluster of each candidate point.
+    std::unordered_map<Index, Voxel<int>> point_cluster_{};
+};
+
+}  // namespace naex
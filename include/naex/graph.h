@@ -6,17 +6,19 @@
 #define NAEX_GRAPH_H
 
 #include <naex/map.h>
+#include <naex/timer.h>
+#include <vector>
 
 using namespace naex;
 
 namespace boost
 {
-template<>
-struct graph_traits<naex::Graph>
+template<Index K>
+struct graph_traits<naex::GraphK<K>>
 {
     typedef Vertex vertex_descriptor;
     typedef Vertex vertices_size_type;
-    typedef Edge edge_descriptor;
+    typedef OutEdge edge_descriptor;
     typedef Edge edges_size_type;
 
     typedef directed_tag directed_category;
@@ -26,49 +28,56 @@ struct graph_traits<naex::Graph>
 
     typedef bidirectional_traversal_tag traversal_category;
     typedef VertexIter vertex_iterator;
-    typedef EdgeIter out_edge_iterator;
+    typedef OutEdgeIter out_edge_iterator;
 };
 
-inline Vertex num_vertices(const Graph& g)
+template<Index K>
+inline Vertex num_vertices(const GraphK<K>& g)
 {
     return g.num_vertices();
 }
 
-inline std::pair<VertexIter, VertexIter> vertices(const Graph& g)
+template<Index K>
+inline std::pair<VertexIter, VertexIter> vertices(const GraphK<K>& g)
 {
     return g.vertices();
 }
 
-inline Vertex source(Edge e, const Graph& g)
+template<Index K>
+inline Vertex source(const OutEdge& e, const GraphK<K>& g)
 {
     return g.source(e);
 }
 
-inline Vertex target(Edge e, const Graph& g)
+template<Index K>
+inline Vertex target(const OutEdge& e, const GraphK<K>& g)
 {
     return g.target(e);
 }
 
-inline std::pair<EdgeIter, EdgeIter> out_edges(Vertex u, const Graph& g)
+template<Index K>
+inline std::pair<OutEdgeIter, OutEdgeIter> out_edges(Vertex u, const GraphK<K>& g)
 {
     return g.out_edges(u);
 }
 
-inline Edge out_degree(Vertex u, const Graph& g)
+template<Index K>
+inline Edge out_degree(Vertex u, const GraphK<K>& g)
 {
     return g.out_degree(u);
 }
 
-template<>
-class property_traits<EdgeCosts>
+template<Index K>
+class property_traits<EdgeCostsK<K>>
 {
 public:
-    typedef Edge key_type;
+    typedef OutEdge key_type;
     typedef Cost value_type;
     typedef readable_property_map_tag category;
 };
 
-inline Cost get(const EdgeCosts& map, const Edge& key)
+template<Index K>
+inline Cost get(const EdgeCostsK<K>& map, const OutEdge& key)
 {
     return map[key];
 }
@@ -80,4 +89,49 @@ inline Cost get(const EdgeCosts& map, const Edge& key)
 // #include <boost/graph/dijkstra_shortest_paths.hpp>
 #include <boost/graph/dijkstra_shortest_paths_no_color_map.hpp>
 
+namespace naex
+{
+
+/// Thrown from the search visitor to stop the search at the deadline.
+class SearchDeadline
+{};
+
+/**
+ * Dijkstra visitor marking settled vertices, i.e., those with final path
+ * costs and predecessors, and stopping the search once the deadline passes.
+ * Time is checked only every few settled vertices.
+ */
+class DeadlineVisitor: public boost::default_dijkstra_visitor
+{
+public:
+    static const size_t CHECK_PERIOD = 256;
+
+    DeadlineVisitor(const Timer& timer, double deadline, std::vector<uint8_t>& settled, size_t& num_settled):
+        timer_(timer),
+        deadline_(deadline),
+        settled_(settled),
+        num_settled_(num_settled)
+    {}
+
+    template<typename G>
+    void examine_vertex(Vertex u, const G&)
+    {
+        settled_[u] = 1;
+        ++num_settled_;
+        if (num_settled_ % CHECK_PERIOD == 0 && timer_.seconds_elapsed() >= deadline_)
+        {
+            throw SearchDeadline();
+        }
+    }
+
+private:
+    // Visitors are passed by value, the state is kept outside.
+    const Timer& timer_;
+    double deadline_;
+    std::vector<uint8_t>& settled_;
+    size_t& num_settled_;
+};
+
+}  // namespace naex
+
 #endif //NAEX_GRAPH_H
@@ -156,6 +156,48 @@ private:
 typedef ValueIterator<Vertex> VertexIter;
 typedef ValueIterator<Edge> EdgeIter;
 
+/**
+ * Iterator over out-edges of a single vertex, yielding edge descriptors
+ * with the source vertex.
+ */
+class OutEdgeIter
+{
+public:
+    OutEdgeIter(const OutEdge& edge):
+        edge_(edge)
+    {
+    }
+    OutEdgeIter &
+    operator++()
+    {
+        edge_.edge_++;
+        return *this;
+    }
+    OutEdgeIter &
+    operator--()
+    {
+        edge_.edge_--;
+        return *this;
+    }
+    bool
+    operator==(const OutEdgeIter &other) const
+    {
+        return edge_ == other.edge_;
+    }
+    bool
+    operator!=(const OutEdgeIter &other) const
+    {
+        return edge_ != other.edge_;
+    }
+    const OutEdge &
+    operator*() const
+    {
+        return edge_;
+    }
+private:
+    OutEdge edge_;
+};
+
 }  // namespace naex
 
 #endif //NAEX_ITERATORS_H
@@ -3,30 +3,51 @@
 
 #include <cstddef>
 #include <cmath>
+#include <functional>
 #include <mutex>
 #include <naex/buffer.h>
 #include <naex/clouds.h>
 #include <naex/geom.h>
 #include <naex/iterators.h>
+#include <naex/morton.h>
 #include <naex/nearest_neighbors.h>
+#include <naex/shared_recursive_mutex.h>
 #include <naex/timer.h>
 #include <naex/types.h>
 #include <ros/ros.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <shared_mutex>
 //#include <set>
+#include <unordered_map>
 #include <unordered_set>
 
 namespace naex
 {
-class Map
+/**
+ * Point map with nearest neighbor graph.
+ * @tparam K Maximum neighborhood size, bounding the kNN query. Neighbor
+ *     loops run over the actual neighbor count of each point.
+ */
+template<Index K>
+class MapK
 {
 public:
+    typedef NeighborhoodK<K> Neighborhood;
     typedef std::recursive_mutex Mutex;
     typedef std::lock_guard<Mutex> Lock;
+    // Cloud lock is exclusive for map updates, shared views are read-only.
+    typedef SharedRecursiveMutex CloudMutex;
+    typedef std::lock_guard<CloudMutex> CloudLock;
+    typedef std::shared_lock<CloudMutex> ViewLock;
+    // Called with old-to-new index remap after compaction, removed points
+    // are mapped to invalid index.
+    typedef std::function<void(const std::vector<Index>&)> RemapListener;
+    // Called with points whose labels were updated.
+    typedef std::function<void(const std::vector<Index>&)> UpdateListener;
 
     static const size_t DEFAULT_CAPACITY = 10000000;
 
-    Map()
+    MapK()
     {
 //        dirty_indices_.reser
         updated_indices_.reserve(10000);
@@ -47,22 +68,6 @@ public:
         return res;
     }
 
-    flann::Matrix<int> neighbor_matrix()
-    {
-        if (cloud_.empty()) {
-            return flann::Matrix<int>();
-        }
-        // TODO: Inconsistency between boost graph (Index = uint32) and flann (int).
-//        return flann::Matrix<int>(reinterpret_cast<int*>(cloud_[0].neighbors_),
-//                                  graph_.size(),
-//                                  3,
-//                                  sizeof(Point));
-        return flann::Matrix<int>(reinterpret_cast<int*>(graph_[0].neighbors_),
-                                  graph_.size(),
-                                  Neighborhood::K_NEIGHBORS,
-                                  sizeof(Neighborhood));
-    }
-
     Value* position(size_t i)
     {
         return &cloud_[i].position_[0];
@@ -118,12 +123,16 @@ public:
         return cost > 0;
     }
 
-    inline Cost compute_edge_cost(const Edge& e)
+    /// Cost of edge e from vertex v0, edges do not store their source.
+    inline Cost compute_edge_cost(const Vertex& v0, const Edge& e) const
     {
-        const auto v0 = source(e);
-        const auto v1_index = target_index(e);
-        const auto v1 = target(e);
+        const auto& adj = adjacency_[e];
+        const auto v1 = adj.target_;
 
+        if (!valid_neighbor(v1, adj.distance_))
+        {
+            return std::numeric_limits<Cost>::infinity();
+        }
         if (v0 == v1)
         {
             ROS_WARN_THROTTLE(1.0, "Graph loop at vertex %i.", v0);
@@ -133,8 +142,7 @@ public:
         {
             return std::numeric_limits<Cost>::infinity();
         }
-//        Cost d = std::sqrt(cloud_[v0].distances_[v1_index]);
-        Cost c = graph_[v0].distances_[v1_index];
+        Cost c = adj.distance_;
         if (c > 3 * points_min_dist_)
         {
             return std::numeric_limits<Cost>::infinity();
@@ -160,9 +168,11 @@ public:
             c *= 1 + std::max(Value(0),
                               1 - cloud_[v1].dist_to_obstacle_ / (2 * clearance_radius_));
         }
-        // Penalize by edge and obstacles points nearby.
-        c *= 1 + Value(cloud_[v1].num_edge_neighbors_) / Neighborhood::K_NEIGHBORS;
-        c *= 1 + Value(cloud_[v1].num_obstacle_neighbors_) / Neighborhood::K_NEIGHBORS;
+        // Penalize by ratios of edge and obstacle points nearby, relative to
+        // actual neighbors, so that costs do not depend on neighborhood size.
+        const Value num_neighbors = Value(std::max(graph_[v1].neighbor_count_, Index(1)));
+        c *= 1 + Value(cloud_[v1].num_edge_neighbors_) / num_neighbors;
+        c *= 1 + Value(cloud_[v1].num_obstacle_neighbors_) / num_neighbors;
         // TODO: Add soft margins around other actors.
         // Would need current position of other actors.
 //        c *= std::isfinite(cloud_[v1].dist_to_other_actors_)
@@ -172,12 +182,40 @@ public:
         return c;
     }
 
-    inline Cost edge_cost(const Edge& e) const
+    /**
+     * Edge cost for search. With lazy edge costs, invalidated (NaN) costs
+     * are computed on first access and memoized. Concurrent searches may
+     * compute the same cost, stores are atomic and idempotent.
+     */
+    inline Cost edge_cost(const OutEdge& e) const
     {
-        const auto v0 = source(e);
-        const auto v1_index = target_index(e);
-        const auto& stored = graph_[v0].costs_[v1_index];
-        return valid_cost(stored) ? stored : std::numeric_limits<Value>::infinity();
+        auto& stored = const_cast<Value&>(adjacency_[e.edge_].cost_);
+        Value cost;
+        __atomic_load(&stored, &cost, __ATOMIC_RELAXED);
+        if (lazy_edge_costs_ && std::isnan(cost))
+        {
+            cost = compute_edge_cost(e.source_, e.edge_);
+            if (!valid_cost(cost))
+            {
+                cost = std::numeric_limits<Value>::infinity();
+            }
+            __atomic_store(&stored, &cost, __ATOMIC_RELAXED);
+        }
+        return valid_cost(cost) ? cost : std::numeric_limits<Value>::infinity();
+    }
+
+    /// Mark edge costs of given vertices for recomputation.
+    template<typename It>
+    void invalidate_edge_costs(It begin, It end)
+    {
+        for (It it = begin; it != end; ++it)
+        {
+            const auto& neigh = graph_[*it];
+            for (Index e = neigh.neighbor_offset_; e < neigh.neighbor_offset_ + neigh.neighbor_count_; ++e)
+            {
+                adjacency_[e].cost_ = std::numeric_limits<Value>::quiet_NaN();
+            }
+        }
     }
 
     void update_index()
@@ -186,7 +224,7 @@ public:
         // TODO: Update only dirty points.
         if (!empty())
         {
-            Lock cloud_lock(cloud_mutex_);
+            CloudLock cloud_lock(cloud_mutex_);
             Lock index_lock(index_mutex_);
 //                index_ = std::make_shared<flann::Index<flann::L2_3D<Elem>>>(points_, flann::KDTreeSingleIndexParams());
             index_ = std::make_shared<flann::Index<flann::L2_3D<Value>>>(
@@ -223,71 +261,88 @@ public:
         // NB: It should be stable iteration order.
         Timer t;
 
-        std::vector<Neighborhood> dirty_cloud;
-
-        for (It it = begin; it != end; ++it)
-        {
-            dirty_cloud.push_back(graph_[*it]);
-        }
-
-        if (dirty_cloud.empty())
+        const std::vector<Index> indices(begin, end);
+        if (indices.empty())
         {
             ROS_DEBUG("Graph up to date, no points to update (%.3f s).",
                      t.seconds_elapsed());
             return;
         }
+        const auto n = Index(indices.size());
+        // Neighbors beyond used distance are not stored.
+        const Value radius = std::min(neighborhood_search_radius_, max_neighbor_distance());
+        const Value radius_2 = radius * radius;
 
-        flann::Matrix<Value> positions(dirty_cloud[0].position_,
-                                       dirty_cloud.size(),
-                                       3,
-                                       sizeof(Neighborhood));
-        flann::Matrix<Index> neighbors(dirty_cloud[0].neighbors_,
-                                       dirty_cloud.size(),
-                                       Neighborhood::K_NEIGHBORS,
-                                       sizeof(Neighborhood));
-        flann::Matrix<Value> distances(dirty_cloud[0].distances_,
-                                       dirty_cloud.size(),
-                                       Neighborhood::K_NEIGHBORS,
-                                       sizeof(Neighborhood));
-
-        t.reset();
+        CloudLock cloud_lock(cloud_mutex_);
+        Lock index_lock(index_mutex_);
+        // Compact query positions, so that whole neighborhoods are not copied.
+        Buffer<Value> positions(3 * indices.size());
+        for (Index i = 0; i < n; ++i)
+        {
+            std::copy(cloud_[indices[i]].position_, cloud_[indices[i]].position_ + 3,
+                      positions.begin() + 3 * i);
+        }
         flann::SearchParams params;
         params.checks = 64;
-        params.cores = 0;
-        params.max_neighbors = Neighborhood::K_NEIGHBORS;
+        params.cores = 1;
         params.sorted = true;
+        // Static schedule splits queries among threads deterministically.
+        // The radius bound is applied afterwards as radius search with max K
+        // is not reliable. Valid neighbors are kept first, in sorted order.
+        Buffer<int> nn(size_t(n) * K);
+        Buffer<Value> dist(size_t(n) * K);
+        std::vector<Index> counts(size_t(n), 0);
+        #pragma omp parallel for schedule(static, 64)
+        for (Index i = 0; i < n; ++i)
         {
-            Lock cloud_lock(cloud_mutex_);
-            Lock index_lock(index_mutex_);
-            index_->knnSearch(positions, neighbors, distances,
-                              Neighborhood::K_NEIGHBORS, params);
-            // FIXME: Radius search with max K seems to result in errors.
-//            index_->radiusSearch(positions, neighbors, distances,
-//                                 neighborhood_radius_, params);
-        }
-//        ROS_INFO("Search complete (%.3f s).", t.seconds_elapsed());
-        // Propagate NN info into the main graph.
-        auto point_it = dirty_cloud.begin();
-        for (It it = begin; it != end; ++it, ++point_it)
-        {
-            std::copy((*point_it).neighbors_,
-                      (*point_it).neighbors_ + Neighborhood::K_NEIGHBORS,
-                      graph_[*it].neighbors_);
-//            std::copy((*point_it).distances_,
-//                      (*point_it).distances_ + Neighborhood::K_NEIGHBORS,
-//                      graph_[*it].distances_);
-            std::transform((*point_it).distances_,
-                           (*point_it).distances_ + Neighborhood::K_NEIGHBORS,
-                           graph_[*it].distances_,
-                           [](const Value x) -> Value { return std::sqrt(x); });
-            // Invalidate computed edge costs to enforce recomputation.
-            std::fill(graph_[*it].costs_,
-                      graph_[*it].costs_ + Neighborhood::K_NEIGHBORS,
-                      std::numeric_limits<Value>::quiet_NaN());
-        }
-
-        ROS_DEBUG("Neighborhood updated at %lu / %lu pts (%.3f s).",
-                  dirty_cloud.size(), cloud_.size(), t.seconds_elapsed());
+            flann::Matrix<Value> query(positions.begin() + 3 * i, 1, 3);
+            flann::Matrix<int> neighbors(nn.begin() + size_t(i) * K, 1, K);
+            flann::Matrix<Value> distances(dist.begin() + size_t(i) * K, 1, K);
+            index_->knnSearch(query, neighbors, distances, K, params);
+            Index count = 0;
+            for (Index j = 0; j < K; ++j)
+            {
+                if (neighbors[0][j] < 0 || neighbors[0][j] >= Index(cloud_.size())
+                    || !(distances[0][j] <= radius_2))
+                {
+                    continue;
+                }
+                neighbors[0][count] = neighbors[0][j];
+                distances[0][count] = std::sqrt(distances[0][j]);
+                ++count;
+            }
+            counts[i] = count;
+        }
+        // Neighborhoods which grew are moved to the end of the adjacency.
+        for (Index i = 0; i < n; ++i)
+        {
+            reserve_neighbors(indices[i], counts[i]);
+        }
+        #pragma omp parallel for schedule(static, 64)
+        for (Index i = 0; i < n; ++i)
+        {
+            const auto v = indices[i];
+            auto& neigh = graph_[v];
+            neigh.neighbor_count_ = counts[i];
+            for (Index j = 0; j < counts[i]; ++j)
+            {
+                auto& adj = adjacency_[neigh.neighbor_offset_ + j];
+                adj.target_ = nn.begin()[size_t(i) * K + j];
+                adj.distance_ = dist.begin()[size_t(i) * K + j];
+                // Invalidate computed edge costs to enforce recomputation.
+                adj.cost_ = std::numeric_limits<Value>::quiet_NaN();
+            }
+        }
+        // Reclaim slots of moved neighborhoods if these prevail.
+        if (Value(adjacency_.size() - num_reserved_neighbors_)
+                > max_unused_adjacency_ratio_ * Value(num_reserved_neighbors_))
+        {
+            rebuild_adjacency([](Index v) { return v; });
+        }
+
+        ROS_DEBUG("Neighborhood updated at %lu / %lu pts, %lu / %lu adjacency slots used (%.3f s).",
+                  indices.size(), cloud_.size(), num_reserved_neighbors_, adjacency_.size(),
+                  t.seconds_elapsed());
         // TODO: Update features and labels.
     }
 
@@ -299,16 +354,10 @@ public:
         for (It it = begin; it != end; ++it)
         {
             ++n;
-            const auto v0 = *it;
-            Index e0 = v0 * Neighborhood::K_NEIGHBORS;
-//            Index e1 = (v0 + 1) * Neighborhood::K_NEIGHBORS;
-//            for (Index e = e0, i = 0; e < e1; ++e, ++v1)
-//            {
-//                graph_[v0].costs_[v1] =  edge_cost(e);
-//            }
-            for (Index i = 0, e = e0; i < Neighborhood::K_NEIGHBORS; ++i, ++e)
+            const auto& neigh = graph_[*it];
+            for (Index e = neigh.neighbor_offset_; e < neigh.neighbor_offset_ + neigh.neighbor_count_; ++e)
             {
-                graph_[v0].costs_[i] = compute_edge_cost(e);
+                adjacency_[e].cost_ = compute_edge_cost(*it, e);
             }
         }
         ROS_INFO("Edge costs computed for %lu vertices (%.3f s).", n, t.seconds_elapsed());
@@ -320,8 +369,8 @@ public:
     }
     inline Edge num_edges() const
     {
-        // TODO: Compute true number based on valid neighbors.
-        return num_vertices() * Neighborhood::K_NEIGHBORS;
+        // Edges are indexed by adjacency slots, some of which are unused.
+        return Edge(adjacency_.size());
     }
     inline std::pair<VertexIter, VertexIter> vertices() const
     {
@@ -329,42 +378,327 @@ public:
     }
     inline std::pair<EdgeIter, EdgeIter> out_edges(const Vertex& u) const
     {
-        // TODO: Limit to valid edges here or just by costs?
         // Skip the first neighbor - the vertex itself.
-        return { u * Neighborhood::K_NEIGHBORS + 1, (u + 1) * Neighborhood::K_NEIGHBORS };
+        const auto& neigh = graph_[u];
+        return { neigh.neighbor_offset_ + 1,
+                 neigh.neighbor_offset_ + std::max(neigh.neighbor_count_, Index(1)) };
     }
     inline Edge out_degree(const Vertex& u) const
     {
-        // TODO: Compute true number based on valid neighbors.
-//        return num_edges();
-        return Neighborhood::K_NEIGHBORS - 1;
+        return std::max(graph_[u].neighbor_count_, Index(1)) - 1;
     }
-    inline Vertex source(const Edge& e) const
+    inline Vertex target_index(const Vertex& u, const Edge& e) const
     {
-//        return e / num_edges();
-        return e / Neighborhood::K_NEIGHBORS;
+        return e - graph_[u].neighbor_offset_;
     }
-    inline Vertex target_index(const Edge& e) const
+    inline Vertex target(const Edge& e) const
     {
-//        return e % num_edges();
-        return e % Neighborhood::K_NEIGHBORS;
+        return adjacency_[e].target_;
     }
-    inline Vertex target(const Edge& e) const
+
+    /// Maximum distance of neighbors used in features, labels and edge costs.
+    Value max_neighbor_distance() const
+    {
+        return std::max(std::max(neighborhood_radius_, clearance_radius_), 3 * points_min_dist_);
+    }
+
+    /// Reserve adjacency slots for given number of neighbors of a vertex.
+    void reserve_neighbors(Index v, Index count)
+    {
+        auto& neigh = graph_[v];
+        if (count <= neigh.neighbor_capacity_)
+        {
+            return;
+        }
+        num_reserved_neighbors_ += size_t(count - neigh.neighbor_capacity_);
+        neigh.neighbor_offset_ = Index(adjacency_.size());
+        neigh.neighbor_capacity_ = count;
+        adjacency_.resize(adjacency_.size() + size_t(count));
+    }
+
+    /**
+     * Copy neighborhoods into a new adjacency without unused slots, in
+     * vertex order. Neighbors are mapped to new indices, these mapped to
+     * invalid index are dropped.
+     */
+    template<typename F>
+    void rebuild_adjacency(F remap)
+    {
+        Timer t;
+        std::vector<Neighbor> adjacency;
+        adjacency.reserve(num_reserved_neighbors_);
+        for (Index v = 0; v < Index(graph_.size()); ++v)
+        {
+            auto& neigh = graph_[v];
+            const auto offset = Index(adjacency.size());
+            for (Index e = neigh.neighbor_offset_; e < neigh.neighbor_offset_ + neigh.neighbor_count_; ++e)
+            {
+                const auto target = remap(adjacency_[e].target_);
+                if (invalid_index(target))
+                {
+                    continue;
+                }
+                adjacency.push_back(adjacency_[e]);
+                adjacency.back().target_ = target;
+            }
+            neigh.neighbor_offset_ = offset;
+            neigh.neighbor_count_ = Index(adjacency.size()) - offset;
+            neigh.neighbor_capacity_ = neigh.neighbor_count_;
+        }
+        ROS_DEBUG("Adjacency rebuilt from %lu to %lu slots (%.3f s).",
+                  adjacency_.size(), adjacency.size(), t.seconds_elapsed());
+        adjacency_.swap(adjacency);
+        num_reserved_neighbors_ = adjacency_.size();
+    }
+
+    void clear_graph()
+    {
+        CloudLock cloud_lock(cloud_mutex_);
+        graph_.clear();
+        adjacency_.clear();
+        num_reserved_neighbors_ = 0;
+    }
+
+    /// Point properties read by labels and edge costs of other points.
+    class DependencyState
     {
-        return graph_[source(e)].neighbors_[target_index(e)];
+    public:
+        DependencyState()
+        {}
+        DependencyState(const Point& pt):
+            flags_(uint8_t(pt.flags_ & (STATIC | EDGE | HORIZONTAL | TRAVERSABLE))),
+            normal_{pt.normal_[0], pt.normal_[1], pt.normal_[2]},
+            dist_to_obstacle_(pt.dist_to_obstacle_),
+            num_edge_neighbors_(pt.num_edge_neighbors_),
+            num_obstacle_neighbors_(pt.num_obstacle_neighbors_)
+        {}
+        /// Changed flag used in features of neighbors.
+        bool static_changed(const Point& pt) const
+        {
+            return (flags_ ^ pt.flags_) & STATIC;
+        }
+        /// Changed flags used in labels of neighbors.
+        bool labels_changed(const Point& pt) const
+        {
+            return (flags_ ^ pt.flags_) & (STATIC | EDGE | HORIZONTAL);
+        }
+        /// Changed inputs of costs of incoming edges.
+        bool costs_changed(const Point& pt) const
+        {
+            return ((flags_ ^ pt.flags_) & (STATIC | EDGE | HORIZONTAL | TRAVERSABLE))
+                || !same(normal_[0], pt.normal_[0])
+                || !same(normal_[1], pt.normal_[1])
+                || !same(normal_[2], pt.normal_[2])
+                || !same(dist_to_obstacle_, pt.dist_to_obstacle_)
+                || num_edge_neighbors_ != pt.num_edge_neighbors_
+                || num_obstacle_neighbors_ != pt.num_obstacle_neighbors_;
+        }
+    protected:
+        static bool same(Value a, Value b)
+        {
+            return a == b || (std::isnan(a) && std::isnan(b));
+        }
+        uint8_t flags_{0};
+        Value normal_[3]{};
+        Value dist_to_obstacle_{0};
+        uint8_t num_edge_neighbors_{0};
+        uint8_t num_obstacle_neighbors_{0};
+    };
+
+    /**
+     * Find edges e from other points u to given points, up to given
+     * distance, as pairs (u, e). Edges from excluded points are skipped.
+     */
+    template<typename C>
+    std::vector<std::pair<Index, Edge>> reverse_edges(const std::vector<Index>& targets,
+                                                      Value radius,
+                                                      const C& exclude)
+    {
+        std::vector<std::pair<Index, Edge>> edges;
+        if (targets.empty() || !index_)
+        {
+            return edges;
+        }
+        Buffer<Value> positions(3 * targets.size());
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            std::copy(cloud_[targets[i]].position_, cloud_[targets[i]].position_ + 3,
+                      positions.begin() + 3 * i);
+        }
+        // Edges are not symmetric, candidates are all points within radius.
+        RadiusQuery<Value> q(*index_, flann::Matrix<Value>(positions.begin(), targets.size(), 3), radius);
+        for (size_t i = 0; i < targets.size(); ++i)
+        {
+            const auto v = targets[i];
+            for (const auto u: q.nn_[i])
+            {
+                if (u == v || u < 0 || u >= Index(cloud_.size()) || exclude.count(u))
+                {
+                    continue;
+                }
+                const auto& neigh = graph_[u];
+                for (Index e = neigh.neighbor_offset_; e < neigh.neighbor_offset_ + neigh.neighbor_count_; ++e)
+                {
+                    if (adjacency_[e].target_ == v && adjacency_[e].distance_ <= radius)
+                    {
+                        edges.emplace_back(u, e);
+                        break;
+                    }
+                }
+            }
+        }
+        return edges;
     }
 
+    /**
+     * Update neighborhoods, features, labels and edge costs of dirty points.
+     *
+     * With dependency tracking, changes are further propagated over reverse
+     * edges to clean points, but only where derived quantities actually
+     * changed: features of points with a neighbor whose static flag changed,
+     * labels of points with a neighbor whose edge, horizontal or static flag
+     * changed, repeatedly while these flags change, and costs of edges to
+     * points whose labels, normals or obstacle statistics changed.
+     */
     void update_dirty()
     {
+        CloudLock cloud_lock(cloud_mutex_);
+        Lock index_lock(index_mutex_);
         Lock lock(dirty_mutex_);
         Timer t;
 
-        update_neighborhood(dirty_indices_.begin(), dirty_indices_.end());
-        compute_features(dirty_indices_.begin(), dirty_indices_.end());
-        compute_labels(dirty_indices_.begin(), dirty_indices_.end());
-        compute_edge_costs(dirty_indices_.begin(), dirty_indices_.end());
+        const std::vector<Index> dirty(dirty_indices_.begin(), dirty_indices_.end());
+        if (!track_dependencies_)
+        {
+            update_neighborhood(dirty.begin(), dirty.end());
+            compute_features(dirty.begin(), dirty.end());
+            compute_labels(dirty.begin(), dirty.end());
+            if (lazy_edge_costs_)
+                invalidate_edge_costs(dirty.begin(), dirty.end());
+            else
+                compute_edge_costs(dirty.begin(), dirty.end());
+            static_changed_indices_.clear();
+            for (const auto& listener: update_listeners_)
+            {
+                listener(dirty);
+            }
+            ROS_DEBUG("%lu points updated (%.3f s).", dirty.size(), t.seconds_elapsed());
+            return;
+        }
+
+        // States before the update, for all points which may change.
+        std::unordered_map<Index, DependencyState> before;
+        before.reserve(2 * dirty.size());
+        for (const auto v: dirty)
+        {
+            before.emplace(v, cloud_[v]);
+        }
+        update_neighborhood(dirty.begin(), dirty.end());
+        compute_features(dirty.begin(), dirty.end());
+        compute_labels(dirty.begin(), dirty.end());
+
+        Timer t_deps;
+        // Recompute features of clean points depending on changed static
+        // flags and relabel points depending on changed flags, until these
+        // flags stop changing. Relabeled points include dirty points labeled
+        // before their neighbors within the same pass. Static flags of dirty
+        // points were changed before their states were stored.
+        std::vector<Index> labels_changed;
+        for (const auto v: dirty)
+        {
+            if (before.at(v).labels_changed(cloud_[v]) || static_changed_indices_.count(v))
+            {
+                labels_changed.push_back(v);
+            }
+        }
+        // States before the last pass, for points which may have changed.
+        std::unordered_map<Index, DependencyState> last(before);
+        std::unordered_set<Index> relabeled;
+        size_t n_refeatured = 0;
+        while (!labels_changed.empty())
+        {
+            std::vector<Index> static_changed;
+            for (const auto v: labels_changed)
+            {
+                if (last.at(v).static_changed(cloud_[v]) || static_changed_indices_.count(v))
+                {
+                    static_changed.push_back(v);
+                }
+            }
+            static_changed_indices_.clear();
+            // Features read static flags of neighbors up to clearance radius.
+            std::vector<Index> refeature;
+            for (const auto& e: reverse_edges(static_changed, clearance_radius_, dirty_indices_))
+            {
+                refeature.push_back(e.first);
+            }
+            std::sort(refeature.begin(), refeature.end());
+            refeature.erase(std::unique(refeature.begin(), refeature.end()), refeature.end());
+            std::vector<Index> relabel(refeature);
+            for (const auto& e: reverse_edges(labels_changed, neighborhood_radius_, std::unordered_set<Index>()))
+            {
+                relabel.push_back(e.first);
+            }
+            std::sort(relabel.begin(), relabel.end());
+            relabel.erase(std::unique(relabel.begin(), relabel.end()), relabel.end());
+
+            last.clear();
+            for (const auto v: relabel)
+            {
+                last.emplace(v, cloud_[v]);
+                before.emplace(v, cloud_[v]);
+                relabeled.insert(v);
+            }
+            compute_features(refeature.begin(), refeature.end());
+            compute_labels(relabel.begin(), relabel.end());
+            n_refeatured += refeature.size();
 
-        ROS_DEBUG("%lu points updated (%.3f s).", dirty_indices_.size(), t.seconds_elapsed());
+            labels_changed.clear();
+            for (const auto v: relabel)
+            {
+                if (last.at(v).labels_changed(cloud_[v]))
+                {
+                    labels_changed.push_back(v);
+                }
+            }
+        }
+        if (lazy_edge_costs_)
+            invalidate_edge_costs(dirty.begin(), dirty.end());
+        else
+            compute_edge_costs(dirty.begin(), dirty.end());
+
+        // Recompute only edges from clean points to changed points, edges
+        // longer than that have infinite cost regardless of their targets.
+        std::vector<Index> costs_changed;
+        for (const auto& state: before)
+        {
+            if (state.second.costs_changed(cloud_[state.first]))
+            {
+                costs_changed.push_back(state.first);
+            }
+        }
+        std::sort(costs_changed.begin(), costs_changed.end());
+        const auto edges = reverse_edges(costs_changed, 3 * points_min_dist_, dirty_indices_);
+        for (const auto& e: edges)
+        {
+            adjacency_[e.second].cost_ = lazy_edge_costs_
+                ? std::numeric_limits<Value>::quiet_NaN()
+                : compute_edge_cost(e.first, e.second);
+        }
+        if (!update_listeners_.empty())
+        {
+            std::vector<Index> updated(dirty);
+            updated.insert(updated.end(), relabeled.begin(), relabeled.end());
+            for (const auto& listener: update_listeners_)
+            {
+                listener(updated);
+            }
+        }
+
+        ROS_DEBUG("%lu points updated, %lu points relabeled, %lu features recomputed, "
+                  "%lu incoming edges recomputed (%.3f s, dependencies %.3f s).",
+                  dirty.size(), relabeled.size(), n_refeatured, edges.size(),
+                  t.seconds_elapsed(), t_deps.seconds_elapsed());
     }
 
     void clear_updated()
@@ -380,6 +714,7 @@ public:
         Lock lock(dirty_mutex_);
         const auto n = dirty_indices_.size();
         dirty_indices_.clear();
+        static_changed_indices_.clear();
         ROS_DEBUG("%lu dirty indices cleared.", n);
     }
 
@@ -411,21 +746,17 @@ public:
             Mat3 cov = Mat3::Zero();
             cloud_[v0].normal_support_ = 0;
             // First neighbor is the point itself.
-            for (Index j = 0; j < Neighborhood::K_NEIGHBORS; ++j)
+            const auto& neigh = graph_[v0];
+            for (Index e = neigh.neighbor_offset_; e < neigh.neighbor_offset_ + neigh.neighbor_count_; ++e)
             {
-                if (!valid_neighbor(graph_[v0].neighbors_[j], graph_[v0].distances_[j]))
-                {
-                    continue;
-                }
-
-                Index v1 = graph_[v0].neighbors_[j];
+                const Index v1 = adjacency_[e].target_;
 
                 // Disregard empty points.
                 if (!(cloud_[v1].flags_ & STATIC))
                 {
                     continue;
                 }
-                if (graph_[v0].distances_[j] <= clearance_radius_) {
+                if (adjacency_[e].distance_ <= clearance_radius_) {
                     mean += ConstVec3Map(cloud_[v1].position_);
 //                    Vec3 pc = (ConstVec3Map(cloud_[v1].position_) - mean);
                     Vec3 pc = (ConstVec3Map(cloud_[v1].position_) - ConstVec3Map(cloud_[v0].position_));
@@ -518,16 +849,13 @@ public:
             cloud_[v0].num_obstacle_pts_ = 0;
             Index n_cylinder_pts = 0;
 
-            for (Vertex j = 0; j < Neighborhood::K_NEIGHBORS; ++j)
+            const auto& neigh = graph_[v0];
+            for (Index e = neigh.neighbor_offset_; e < neigh.neighbor_offset_ + neigh.neighbor_count_; ++e)
             {
-                const auto v1 = graph_[v0].neighbors_[j];
-                // Disregard invalid neighbors.
-                if (!valid_neighbor(v1, graph_[v0].distances_[j]))
-                {
-                    continue;
-                }
+                const auto v1 = adjacency_[e].target_;
+                const auto d = adjacency_[e].distance_;
                 // Disregard distant neighbors.
-                if (graph_[v0].distances_[j] > neighborhood_radius_)
+                if (d > neighborhood_radius_)
                 {
                     continue;
                 }
@@ -553,11 +881,11 @@ public:
                 // Hard constraint can be removed with min_dist_to_obstacle_.
                 if (!(cloud_[v1].flags_ & HORIZONTAL))
                 {
-                    if (graph_[v0].distances_[j] <= min_dist_to_obstacle_)
+                    if (d <= min_dist_to_obstacle_)
                     {
                         cloud_[v0].flags_ &= ~TRAVERSABLE;
                     }
-                    cloud_[v0].dist_to_obstacle_ = std::min(graph_[v0].distances_[j], cloud_[v0].dist_to_obstacle_);
+                    cloud_[v0].dist_to_obstacle_ = std::min(d, cloud_[v0].dist_to_obstacle_);
                 }
 
                 Vec3Map p0(cloud_[v0].position_);
@@ -614,8 +942,8 @@ public:
 //    std::vector<Index> nearby_indices(const flann::Matrix<Value>& origin, Value radius)
     std::vector<Index> nearby_indices(Value* origin, Value radius)
     {
-        Lock cloud_lock(cloud_mutex_);
-        Lock index_lock(index_mutex_);
+        // Index is modified only under exclusive cloud lock.
+        ViewLock view_lock(cloud_mutex_);
         RadiusQuery<Value> q(*index_, flann::Matrix<Value>(origin, 1, 3), radius);
         // TODO: Is this enough to move it?
         return q.nn_[0];
@@ -667,7 +995,7 @@ public:
         ROS_INFO("%lu sensor rays and index created (%.6f s).", n_pts, t_part.seconds_elapsed());
 
         // Find closest map points to sensor origin.
-        Lock cloud_lock(cloud_mutex_);
+        CloudLock cloud_lock(cloud_mutex_);
         Lock index_lock(index_mutex_);
         Lock dirty_lock(dirty_mutex_);
         t_part.reset();
@@ -804,6 +1132,7 @@ public:
                 {
                     cloud_[i].flags_ &= ~STATIC;
                     dirty_indices_.insert(i);
+                    static_changed_indices_.insert(i);
                     ++n_modified;
                 }
             }
@@ -813,6 +1142,7 @@ public:
                 {
                     cloud_[i].flags_ |= STATIC;
                     dirty_indices_.insert(i);
+                    static_changed_indices_.insert(i);
                     ++n_modified;
                 }
             }
@@ -823,6 +1153,273 @@ public:
         ROS_INFO("Occupancy updated (%.3f s).", t.seconds_elapsed());
     }
 
+    /// Remove a static point from the map, keeping its slot.
+    void remove_point(Index i)
+    {
+        cloud_[i].flags_ &= ~STATIC;
+        // TODO: Change position to NaN to remove it from visualization?
+//        cloud_[i].position_[0] = std::numeric_limits<Value>::quiet_NaN();
+//        cloud_[i].position_[1] = std::numeric_limits<Value>::quiet_NaN();
+//        cloud_[i].position_[2] = std::numeric_limits<Value>::quiet_NaN();
+        // Don't update the point we remove.
+        dirty_indices_.erase(i);
+        // TODO: Add neighborhood to dirty.
+        const auto& neigh = graph_[i];
+        for (Index e = neigh.neighbor_offset_; e < neigh.neighbor_offset_ + neigh.neighbor_count_; ++e)
+        {
+            const auto j = adjacency_[e].target_;
+            // Don't add removed points.
+            if (!(cloud_[j].flags_ & STATIC))
+            {
+                continue;
+            }
+            dirty_indices_.insert(j);
+        }
+        index_->removePoint(i);
+        updated_indices_.push_back(i);
+    }
+
+    size_t num_removed() const
+    {
+        CloudLock cloud_lock(cloud_mutex_);
+        size_t n = 0;
+        for (const auto& pt: cloud_)
+        {
+            if (!(pt.flags_ & STATIC))
+            {
+                ++n;
+            }
+        }
+        return n;
+    }
+
+    /// Points kept by compaction and reordering: static ones and removed
+    /// ones still pending in updated indices.
+    std::vector<bool> kept_points() const
+    {
+        std::vector<bool> keep(cloud_.size(), false);
+        for (size_t i = 0; i < cloud_.size(); ++i)
+        {
+            keep[i] = cloud_[i].flags_ & STATIC;
+        }
+        for (const auto i: updated_indices_)
+        {
+            keep[i] = true;
+        }
+        return keep;
+    }
+
+    /**
+     * Move points to new indices, order lists old indices in the new order,
+     * other points are dropped. Neighbor lists, dirty and updated indices
+     * are remapped, the index is rebuilt and remap listeners are notified.
+     * Must be called with all map locks held.
+     *
+     * Returns old-to-new index remap.
+     */
+    std::vector<Index> apply_order(const std::vector<Index>& order)
+    {
+        const auto n = Index(cloud_.size());
+        const auto m = Index(order.size());
+        std::vector<Index> remap(n, invalid_index<Index>());
+        for (Index i = 0; i < m; ++i)
+        {
+            remap[order[i]] = i;
+        }
+        // Move points in place. Dropped points are squeezed out first,
+        // keeping the order, then cycles of the permutation are followed.
+        std::vector<Index> squeezed(n, invalid_index<Index>());
+        Index k = 0;
+        for (Index i = 0; i < n; ++i)
+        {
+            if (invalid_index(remap[i]))
+            {
+                continue;
+            }
+            if (k != i)
+            {
+                cloud_[k] = cloud_[i];
+                graph_[k] = graph_[i];
+            }
+            squeezed[i] = k++;
+        }
+        cloud_.resize(m);
+        graph_.resize(m);
+        std::vector<bool> done(m, false);
+        for (Index i = 0; i < m; ++i)
+        {
+            if (done[i] || squeezed[order[i]] == i)
+            {
+                continue;
+            }
+            const Point point = cloud_[i];
+            const Neighborhood neigh = graph_[i];
+            Index j = i;
+            for (Index src = squeezed[order[j]]; src != i; j = src, src = squeezed[order[j]])
+            {
+                cloud_[j] = cloud_[src];
+                graph_[j] = graph_[src];
+                done[j] = true;
+            }
+            cloud_[j] = point;
+            graph_[j] = neigh;
+            done[j] = true;
+        }
+
+        // Drop removed neighbors, keeping valid ones sorted.
+        rebuild_adjacency([&remap, n](Index i)
+                          {
+                              return i < n ? remap[i] : invalid_index<Index>();
+                          });
+
+        for (auto& i: updated_indices_)
+        {
+            i = remap[i];
+        }
+        std::unordered_set<Index> dirty;
+        dirty.reserve(dirty_indices_.size());
+        for (const auto i: dirty_indices_)
+        {
+            if (!invalid_index(remap[i]))
+            {
+                dirty.insert(remap[i]);
+            }
+        }
+        dirty_indices_.swap(dirty);
+        std::unordered_set<Index> static_changed;
+        for (const auto i: static_changed_indices_)
+        {
+            if (!invalid_index(remap[i]))
+            {
+                static_changed.insert(remap[i]);
+            }
+        }
+        static_changed_indices_.swap(static_changed);
+
+        update_index();
+        // Removed points kept for updates are not searchable.
+        for (Index i = 0; i < m; ++i)
+        {
+            if (!(cloud_[i].flags_ & STATIC))
+            {
+                index_->removePoint(i);
+            }
+        }
+        for (const auto& listener: remap_listeners_)
+        {
+            listener(remap);
+        }
+        return remap;
+    }
+
+    /**
+     * Reclaim slots of removed points if these make at least given ratio of
+     * the map. Points are moved to lower indices keeping their order.
+     * Removed points still pending in updated indices are kept.
+     *
+     * Returns number of reclaimed slots.
+     */
+    size_t compact(Value min_removed_ratio = 0.0)
+    {
+        Timer t;
+        CloudLock cloud_lock(cloud_mutex_);
+        Lock index_lock(index_mutex_);
+        Lock updated_lock(updated_mutex_);
+        Lock dirty_lock(dirty_mutex_);
+        const auto n = Index(cloud_.size());
+        const auto keep = kept_points();
+        const auto n_keep = Index(std::count(keep.begin(), keep.end(), true));
+        if (n_keep == n || n_keep == 0 || n - n_keep < min_removed_ratio * n)
+        {
+            return 0;
+        }
+        std::vector<Index> order;
+        order.reserve(n_keep);
+        for (Index i = 0; i < n; ++i)
+        {
+            if (keep[i])
+            {
+                order.push_back(i);
+            }
+        }
+        apply_order(order);
+        ROS_INFO("Map compacted from %lu to %lu points (%.3f s).",
+                 size_t(n), size_t(n_keep), t.seconds_elapsed());
+        return size_t(n - n_keep);
+    }
+
+    /**
+     * Reorder points along Morton curve over cells of given size, so that
+     * points near in space are also near in memory, and reclaim slots of
+     * removed points as in compaction.
+     *
+     * Returns number of points which changed their index.
+     */
+    size_t reorder(Value cell_size)
+    {
+        Timer t;
+        CloudLock cloud_lock(cloud_mutex_);
+        Lock index_lock(index_mutex_);
+        Lock updated_lock(updated_mutex_);
+        Lock dirty_lock(dirty_mutex_);
+        const auto n = Index(cloud_.size());
+        const auto keep = kept_points();
+        Vec3 min = Vec3::Constant(std::numeric_limits<Value>::infinity());
+        for (Index i = 0; i < n; ++i)
+        {
+            if (keep[i])
+            {
+                min = min.cwiseMin(ConstVec3Map(cloud_[i].position_));
+            }
+        }
+        std::vector<std::pair<uint64_t, Index>> keys;
+        keys.reserve(n);
+        for (Index i = 0; i < n; ++i)
+        {
+            if (!keep[i])
+            {
+                continue;
+            }
+            const Vec3 cell = ((ConstVec3Map(cloud_[i].position_) - min) / cell_size).array().floor();
+            uint32_t c[3];
+            for (int j = 0; j < 3; ++j)
+            {
+                // Points beyond 2^21 cells from the corner share the last ones.
+                c[j] = uint32_t(std::min(std::max(cell(j), Value(0)), Value(0x1fffff)));
+            }
+            keys.emplace_back(morton_code(c[0], c[1], c[2]), i);
+        }
+        std::sort(keys.begin(), keys.end());
+        std::vector<Index> order;
+        order.reserve(keys.size());
+        size_t n_moved = 0;
+        for (const auto& key: keys)
+        {
+            n_moved += size_t(key.second != Index(order.size()));
+            order.push_back(key.second);
+        }
+        if (n_moved == 0 && Index(order.size()) == n)
+        {
+            return 0;
+        }
+        apply_order(order);
+        ROS_INFO("Map with %lu points reordered to %lu points, %lu moved (%.3f s).",
+                 size_t(n), order.size(), n_moved, t.seconds_elapsed());
+        return n_moved;
+    }
+
+    void add_remap_listener(const RemapListener& listener)
+    {
+        CloudLock cloud_lock(cloud_mutex_);
+        remap_listeners_.push_back(listener);
+    }
+
+    void add_update_listener(const UpdateListener& listener)
+    {
+        CloudLock cloud_lock(cloud_mutex_);
+        update_listeners_.push_back(listener);
+    }
+
     void update_occupancy_projection(const sensor_msgs::PointCloud2& cloud,
                                      const geometry_msgs::Transform& cloud_to_map_tf)
     {
@@ -844,19 +1441,20 @@ public:
         }
 
         t_part.reset();
-        SphericalProjection model;
-        if (!model.fit(cloud))
+        const auto model_ptr = projections_.get(cloud);
+        if (!model_ptr)
         {
             ROS_WARN("Could not fit cloud model (%.6f s).", t_part.seconds_elapsed());
             return;
         }
+        const SphericalProjection& model = *model_ptr;
 
         sensor_msgs::PointCloud2ConstIterator<float> x_begin(cloud, "x");
         Eigen::Isometry3f cloud_to_map(tf2::transformToEigen(cloud_to_map_tf));
         Eigen::Isometry3f map_to_cloud = cloud_to_map.inverse(Eigen::Isometry);
 
         // Find closest map points to sensor origin.
-        Lock cloud_lock(cloud_mutex_);
+        CloudLock cloud_lock(cloud_mutex_);
         Lock index_lock(index_mutex_);
         t_part.reset();
         Vec3 origin = cloud_to_map.translation();
@@ -964,25 +1562,7 @@ public:
             {
                 if (cloud_[i].flags_ & STATIC)
                 {
-                    cloud_[i].flags_ &= ~STATIC;
-                    // TODO: Change position to NaN to remove it from visualization?
-//                    cloud_[i].position_[0] = std::numeric_limits<Value>::quiet_NaN();
-//                    cloud_[i].position_[1] = std::numeric_limits<Value>::quiet_NaN();
-//                    cloud_[i].position_[2] = std::numeric_limits<Value>::quiet_NaN();
-                    // Don't update the point we remove.
-                    dirty_indices_.erase(i);
-                    // TODO: Add neighborhood to dirty.
-                    for (const auto j: graph_[i].neighbors_)
-                    {
-                        // Don't add removed points.
-                        if (!(cloud_[j].flags_ & STATIC))
-                        {
-                            continue;
-                        }
-                        dirty_indices_.insert(j);
-                    }
-                    index_->removePoint(i);
-                    updated_indices_.push_back(i);
+                    remove_point(i);
                     ++n_modified;
                 }
             }
@@ -1176,7 +1756,7 @@ public:
     {
 //        ROS_INFO("Point size: %lu bytes.", sizeof(Point));
 //        ROS_INFO("Neighborhood size: %lu bytes.", sizeof(Neighborhood));
-        Lock cloud_lock(cloud_mutex_);
+        CloudLock cloud_lock(cloud_mutex_);
         assert(cloud_.empty());
         Lock index_lock(index_mutex_);
         Lock dirty_lock(dirty_mutex_);
@@ -1230,7 +1810,7 @@ public:
 
         // Find NN distance within current map.
 //        Lock index_lock(index_mutex_);
-        Lock cloud_lock(cloud_mutex_);
+        CloudLock cloud_lock(cloud_mutex_);
         Lock index_lock(index_mutex_);
         Query<Elem> q(*index_, points, Neighborhood::K_NEIGHBORS, neighborhood_radius_);
         ROS_DEBUG("Got neighbors for %lu points (%.3f s).",
@@ -1304,6 +1884,60 @@ public:
                  t.seconds_elapsed());
     }
 
+    /// Remove static map points nearest to given points, within radius.
+    size_t remove_near(const flann::Matrix<Elem>& points, Value radius)
+    {
+        Timer t;
+        if (empty() || points.rows == 0)
+        {
+            return 0;
+        }
+        CloudLock cloud_lock(cloud_mutex_);
+        Lock index_lock(index_mutex_);
+        Lock updated_lock(updated_mutex_);
+        Lock dirty_lock(dirty_mutex_);
+        Query<Elem> q(*index_, points, 1);
+        size_t n = 0;
+        for (Index i = 0; i < points.rows; ++i)
+        {
+            const auto v = q.nn_[i][0];
+            if (!valid_neighbor(v, q.dist_[i][0]) || q.dist_[i][0] > radius * radius)
+            {
+                continue;
+            }
+            if (!(cloud_[v].flags_ & STATIC))
+            {
+                continue;
+            }
+            remove_point(v);
+            ++n;
+        }
+        ROS_INFO("%lu / %lu points removed from map (%.3f s).",
+                 n, size_t(points.rows), t.seconds_elapsed());
+        return n;
+    }
+
+    /// Merge coverage of given points into nearest map points within radius.
+    void merge_coverage(const flann::Matrix<Elem>& points, const Value* coverage, Value radius)
+    {
+        if (empty() || points.rows == 0)
+        {
+            return;
+        }
+        CloudLock cloud_lock(cloud_mutex_);
+        Lock index_lock(index_mutex_);
+        Query<Elem> q(*index_, points, 1);
+        for (Index i = 0; i < points.rows; ++i)
+        {
+            const auto v = q.nn_[i][0];
+            if (!valid_neighbor(v, q.dist_[i][0]) || q.dist_[i][0] > radius * radius)
+            {
+                continue;
+            }
+            cloud_[v].coverage_ = std::max(cloud_[v].coverage_, coverage[i]);
+        }
+    }
+
     void initialize_cloud(sensor_msgs::PointCloud2& cloud)
     {
         cloud.point_step = uint32_t(offsetof(Point, position_));
@@ -1394,7 +2028,7 @@ public:
     {
         initialize_cloud(cloud);
         sensor_msgs::PointCloud2Modifier modifier(cloud);
-        Lock cloud_lock(cloud_mutex_);
+        CloudLock cloud_lock(cloud_mutex_);
         modifier.resize(cloud_.size());
 //        std::copy(&cloud_.front(), &cloud_.back(), &cloud.data.front());
 //        std::copy(cloud_.begin(), cloud_.end(), cloud.data.begin());
@@ -1419,7 +2053,7 @@ public:
 //            const auto from = reinterpret_cast<uint8_t*>(&cloud_[*it]);
 //            std::copy(from, from + cloud.point_step, out);
 //        }
-        Lock cloud_lock(cloud_mutex_);
+        CloudLock cloud_lock(cloud_mutex_);
         for (auto it = indices.begin(); it != indices.end(); ++it, out += cloud.point_step)
         {
             const auto from = reinterpret_cast<uint8_t*>(&cloud_[*it]);
@@ -1461,30 +2095,36 @@ public:
 
     size_t capacity() const
     {
-        Lock cloud_lock(cloud_mutex_);
+        CloudLock cloud_lock(cloud_mutex_);
         return cloud_.capacity();
     }
 
     size_t size() const
     {
-        // TODO: Lock? Make thread safe?
-        Lock cloud_lock(cloud_mutex_);
+        ViewLock view_lock(cloud_mutex_);
         return cloud_.size();
     }
 
     bool empty() const
     {
-        Lock cloud_lock(cloud_mutex_);
+        ViewLock view_lock(cloud_mutex_);
         return cloud_.empty();
     }
 
     // Lock mutexes in this sequence
     // cloud_mutex_, index_mutex_, dirty_mutex_.
     // to avoid deadlocks.
+    // Shared cloud lock gives a read-only view of the map, including the
+    // index, which can be used by concurrent planning requests.
 
-    mutable Mutex cloud_mutex_;
+    mutable CloudMutex cloud_mutex_;
     std::vector<Point> cloud_{};
     std::vector<Neighborhood> graph_{};
+    // Neighbors of all points, in ranges given by neighborhoods. Edges are
+    // indexed by adjacency slots.
+    std::vector<Neighbor> adjacency_{};
+    // Number of slots reserved by neighborhoods, others are unused.
+    size_t num_reserved_neighbors_{0};
 
     mutable Mutex index_mutex_;
     std::shared_ptr<flann::Index<flann::L2_3D<Value>>> index_;
@@ -1495,6 +2135,16 @@ public:
     mutable Mutex dirty_mutex_;
 //    std::set<Index> dirty_indices_;
     std::unordered_set<Index> dirty_indices_{};
+    // Dirty points whose static flag changed since they were last updated.
+    std::unordered_set<Index> static_changed_indices_{};
+
+    // Notified about index changes after compaction, under all map locks.
+    std::vector<RemapListener> remap_listeners_{};
+    // Notified about points with updated labels, under cloud, index and dirty locks.
+    std::vector<UpdateListener> update_listeners_{};
+
+    // Sensor models for projecting map points into organized input clouds.
+    SphericalProjectionCache projections_{};
 
     // Map parameters
     float points_min_dist_{0.2};
@@ -1507,6 +2157,17 @@ public:
     // Graph
 //    int neighbor
     float neighborhood_radius_{0.6};
+    // Neighbors found by kNN search beyond this distance are invalidated.
+    float neighborhood_search_radius_{std::numeric_limits<float>::infinity()};
+    // Adjacency is rebuilt once unused slots, left behind by grown
+    // neighborhoods, exceed this ratio of reserved slots. Rebuilding is linear
+    // in the adjacency size, the ratio trades memory for its frequency.
+    float max_unused_adjacency_ratio_{1.0};
+    // Propagate changes of dirty points to features, labels and edge costs of
+    // clean points. Opt-in, it adds radius queries to each map update.
+    bool track_dependencies_{false};
+    // Compute edge costs on first access in search instead of in updates.
+    bool lazy_edge_costs_{false};
 //    float traversable_radius_;
     // Traversability
     float edge_min_centroid_offset_{0.5};
@@ -1526,58 +2187,69 @@ public:
 };
 
 /** https://www.boost.org/doc/libs/1_75_0/libs/graph/doc/adjacency_list.html */
-class Graph
+template<Index K>
+class GraphK
 {
 public:
-    Graph(const Map& map):
+    typedef MapK<K> Map;
+    GraphK(const Map& map):
         map_(map)
     {}
     inline Vertex num_vertices() const
     {
         return map_.num_vertices();
     }
-    /** Returns the number of edges in the graph g. */
+    /**
+     * Returns the number of edges in the graph g, summed over actual
+     * neighborhoods. Linear in the number of vertices.
+     */
     inline Edge num_edges() const
     {
-        // TODO: Compute true number based on valid neighbors.
-        return map_.num_edges();
+        Edge n = 0;
+        for (Vertex v = 0; v < num_vertices(); ++v)
+        {
+            n += out_degree(v);
+        }
+        return n;
     }
     inline std::pair<VertexIter, VertexIter> vertices() const
     {
         return map_.vertices();
     }
-    inline std::pair<EdgeIter, EdgeIter> out_edges(const Vertex& u) const
+    /** Edges to actual neighbors, invalid ones have infinite costs. */
+    inline std::pair<OutEdgeIter, OutEdgeIter> out_edges(const Vertex& u) const
     {
-        // TODO: Limit to valid edges here or just by costs?
-        return map_.out_edges(u);
+        const auto edges = map_.out_edges(u);
+        return { OutEdge(u, *edges.first), OutEdge(u, *edges.second) };
     }
     inline Edge out_degree(const Vertex& u) const
     {
-        // TODO: Compute true number based on valid neighbors.
         return map_.out_degree(u);
     }
-    inline Vertex source(const Edge& e) const
+    inline Vertex source(const OutEdge& e) const
     {
-        return map_.source(e);
+        return e.source_;
     }
-    inline Vertex target_index(const Edge& e) const
+    inline Vertex target_index(const OutEdge& e) const
     {
-        return map_.target_index(e);
+        return map_.target_index(e.source_, e.edge_);
     }
-    inline Vertex target(const Edge& e) const
+    inline Vertex target(const OutEdge& e) const
     {
-        return map_.target(e);
+        return map_.target(e.edge_);
     }
     const Map& map_;
 };
 
-class EdgeCosts
+template<Index K>
+class EdgeCostsK
 {
 public:
-    EdgeCosts(const Map& map):
+    typedef MapK<K> Map;
+    EdgeCostsK(const Map& map):
         map_(map)
     {}
-    inline Cost operator[](const Edge& e) const
+    inline Cost operator[](const OutEdge& e) const
     {
         return map_.edge_cost(e);
     }
@@ -1585,6 +2257,10 @@ private:
     const Map& map_;
 };
 
+typedef MapK<DEFAULT_K_NEIGHBORS> Map;
+typedef GraphK<DEFAULT_K_NEIGHBORS> Graph;
+typedef EdgeCostsK<DEFAULT_K_NEIGHBORS> EdgeCosts;
+
 }  // namespace naex
 
 #endif  // NAEX_MAP_H
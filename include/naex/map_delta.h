@@ -0,0 +1,240 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <lz4.h>
+#include <naex/types.h>
+#include <sstream>
+#include <string>
+#include <vector>
+
+namespace naex
+{
+
+/// Optional point fields carried in map deltas.
+enum MapDeltaFields
+{
+    DELTA_COVERAGE = 1 << 0
+};
+
+/// Parse whitespace or comma separated field names.
+inline uint16_t parse_map_delta_fields(std::string names)
+{
+    std::replace(names.begin(), names.end(), ',', ' ');
+    std::stringstream ss(names);
+    std::string name;
+    uint16_t fields = 0;
+    while (ss >> name)
+    {
+        if (name == "coverage")
+        {
+            fields |= DELTA_COVERAGE;
+        }
+    }
+    return fields;
+}
+
+/**
+ * Changed map points with selected fields.
+ *
+ * Positions and flags are always present, removed points are those
+ * without STATIC flag.
+ */
+class MapDelta
+{
+public:
+    size_t size() const
+    {
+        return flags_.size();
+    }
+
+    void clear()
+    {
+        positions_.clear();
+        flags_.clear();
+        coverage_.clear();
+    }
+
+    template<typename P>
+    void push_back(const P& point)
+    {
+        positions_.insert(positions_.end(), point.position_, point.position_ + 3);
+        flags_.push_back(point.flags_);
+        if (fields_ & DELTA_COVERAGE)
+        {
+            coverage_.push_back(point.coverage_);
+        }
+    }
+
+    std::string sender_{};
+    uint32_t seq_{0};
+    uint16_t fields_{0};
+    // Quantization step of positions in meters.
+    float resolution_{0.01f};
+    std::vector<Value> positions_{};
+    std::vector<uint8_t> flags_{};
+    std::vector<Value> coverage_{};
+};
+
+/**
+ * Serialization of map deltas.
+ *
+ * Message starts with a fixed uncompressed header and sender name,
+ * followed by the LZ4-compressed body. Body stores fields as separate
+ * arrays (x, y, z, flags, ...), which compresses better than interleaved
+ * points. Positions are quantized to int32 multiples of resolution,
+ * coverage to uint8.
+ * Native (little-endian) byte order is assumed on both ends.
+ */
+class MapDeltaCodec
+{
+public:
+    static constexpr const char* MAGIC = "NXMD";
+    static const uint16_t VERSION = 1;
+
+    static void encode(const MapDelta& delta, std::vector<uint8_t>& data)
+    {
+        const uint32_t n = uint32_t(delta.size());
+        std::vector<uint8_t> body;
+        body.reserve(n * 16);
+        for (int k = 0; k < 3; ++k)
+        {
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                const auto q = std::lround(delta.positions_[3 * i + k] / delta.resolution_);
+                append(body, int32_t(std::max<long>(std::min<long>(q, std::numeric_limits<int32_t>::max()),
+                                                    std::numeric_limits<int32_t>::min())));
+            }
+        }
+        body.insert(body.end(), delta.flags_.begin(), delta.flags_.end());
+        if (delta.fields_ & DELTA_COVERAGE)
+        {
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                append(body, uint8_t(std::lround(std::min(std::max(delta.coverage_[i], Value(0)), Value(1)) * 255)));
+            }
+        }
+
+        data.clear();
+        data.insert(data.end(), MAGIC, MAGIC + 4);
+        append(data, uint16_t(VERSION));
+        append(data, delta.fields_);
+        append(data, delta.seq_);
+        append(data, n);
+        append(data, delta.resolution_);
+        append(data, uint32_t(body.size()));
+        append(data, uint16_t(delta.sender_.size()));
+        data.insert(data.end(), delta.sender_.begin(), delta.sender_.end());
+        const size_t header_size = data.size();
+        data.resize(header_size + LZ4_compressBound(int(body.size())));
+        const int compressed = LZ4_compress_default(reinterpret_cast<const char*>(body.data()),
+                                                    reinterpret_cast<char*>(data.data() + header_size),
+                                                    int(body.size()),
+                                                    int(data.size() - header_size));
+        data.resize(header_size + size_t(std::max(compressed, 0)));
+    }
+
+    /// Decode map delta, return false for invalid or incompatible data.
+    static bool decode(const std::vector<uint8_t>& data, MapDelta& delta)
+    {
+        size_t pos = 0;
+        if (data.size() < 4 || std::strncmp(reinterpret_cast<const char*>(data.data()), MAGIC, 4) != 0)
+        {
+            return false;
+        }
+        pos += 4;
+        uint16_t version = 0;
+        uint32_t n = 0;
+        uint32_t body_size = 0;
+        uint16_t sender_size = 0;
+        if (!read(data, pos, version) || version != VERSION
+            || !read(data, pos, delta.fields_)
+            || !read(data, pos, delta.seq_)
+            || !read(data, pos, n)
+            || !read(data, pos, delta.resolution_)
+            || !read(data, pos, body_size)
+            || !read(data, pos, sender_size)
+            || pos + sender_size > data.size())
+        {
+            return false;
+        }
+        delta.sender_.assign(reinterpret_cast<const char*>(data.data() + pos), sender_size);
+        pos += sender_size;
+
+        size_t expected_size = size_t(n) * (3 * sizeof(int32_t) + 1);
+        if (delta.fields_ & DELTA_COVERAGE)
+        {
+            expected_size += n;
+        }
+        if (body_size != expected_size)
+        {
+            return false;
+        }
+        // LZ4 cannot expand data more than 255 times, reject the size before
+        // allocating the body, it comes from the network.
+        if (size_t(body_size) > 255 * (data.size() - pos)
+            || size_t(body_size) > size_t(std::numeric_limits<int>::max()))
+        {
+            return false;
+        }
+        std::vector<uint8_t> body(body_size);
+        const int decompressed = LZ4_decompress_safe(reinterpret_cast<const char*>(data.data() + pos),
+                                                     reinterpret_cast<char*>(body.data()),
+                                                     int(data.size() - pos),
+                                                     int(body.size()));
+        if (decompressed != int(body_size))
+        {
+            return false;
+        }
+
+        delta.clear();
+        delta.positions_.resize(3 * n);
+        const uint8_t* it = body.data();
+        for (int k = 0; k < 3; ++k)
+        {
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                int32_t q;
+                std::memcpy(&q, it, sizeof(q));
+                it += sizeof(q);
+                delta.positions_[3 * i + k] = q * delta.resolution_;
+            }
+        }
+        delta.flags_.assign(it, it + n);
+        it += n;
+        if (delta.fields_ & DELTA_COVERAGE)
+        {
+            delta.coverage_.resize(n);
+            for (uint32_t i = 0; i < n; ++i)
+            {
+                delta.coverage_[i] = Value(*it++) / 255;
+            }
+        }
+        return true;
+    }
+
+protected:
+    template<typename T>
+    static void append(std::vector<uint8_t>& data, const T& value)
+    {
+        const auto bytes = reinterpret_cast<const uint8_t*>(&value);
+        data.insert(data.end(), bytes, bytes + sizeof(T));
+    }
+
+    template<typename T>
+    static bool read(const std::vector<uint8_t>& data, size_t& pos, T& value)
+    {
+        if (pos + sizeof(T) > data.size())
+        {
+            return false;
+        }
+        std::memcpy(&value, data.data() + pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+};
+
+}  // namespace naex
@@ -0,0 +1,479 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <functional>
+#include <limits>
+#include <mutex>
+#include <naex/map.h>
+#include <naex/map_delta.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <naex/voxel_filter.h>
+#include <queue>
+#include <ros/ros.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace naex
+{
+
+/// Coarse description of a map tile, kept also while the tile is evicted.
+class TileSummary
+{
+public:
+    enum State
+    {
+        RESIDENT,
+        EVICTED,
+        LOADING
+    };
+
+    State state_{RESIDENT};
+    Vec3 centroid_{Vec3::Zero()};
+    uint32_t num_points_{0};
+    uint32_t num_traversable_{0};
+    Value mean_coverage_{0.0};
+};
+
+/**
+ * Spatial paging of distant map regions.
+ *
+ * Map is partitioned into cubic tiles. Static points of tiles farther than
+ * evict distance from all focus positions (robots and the last planned goal)
+ * are written to a tile file and removed from the map. Evicted tiles closer
+ * than load distance are read back in background and merged into the map
+ * on the next update. Tile files store positions, flags and coverage in the
+ * map delta format, features and labels are recomputed once merged.
+ *
+ * Evicted tiles keep a coarse summary, which is used to estimate distances
+ * through evicted parts of the map.
+ *
+ * Slots of removed points are reclaimed by map compaction.
+ */
+class MapPager
+{
+public:
+    typedef std::mutex Mutex;
+    typedef std::lock_guard<Mutex> Lock;
+
+    MapPager()
+    {}
+    ~MapPager()
+    {
+        stop();
+    }
+
+    bool enabled() const
+    {
+        return !dir_.empty();
+    }
+
+    void start()
+    {
+        if (worker_.joinable())
+        {
+            return;
+        }
+        stop_ = false;
+        worker_ = std::thread(&MapPager::run, this);
+    }
+
+    void stop()
+    {
+        {
+            Lock lock(tasks_mutex_);
+            stop_ = true;
+        }
+        tasks_cv_.notify_all();
+        if (worker_.joinable())
+        {
+            worker_.join();
+        }
+    }
+
+    Voxel<int> tile(const Value* position) const
+    {
+        Voxel<int> key;
+        key.from<Value>(position, tile_size_);
+        return key;
+    }
+
+    /// Distance from position to the nearest point of a tile.
+    Value tile_distance(const Voxel<int>& key, const Vec3& position) const
+    {
+        Vec3 lo(key.x_ * tile_size_, key.y_ * tile_size_, key.z_ * tile_size_);
+        Vec3 hi = lo + Vec3::Constant(tile_size_);
+        return (position.cwiseMax(lo).cwiseMin(hi) - position).norm();
+    }
+
+    /// Set robot positions used to decide which tiles stay resident.
+    void set_positions(const std::vector<Vec3>& positions)
+    {
+        Lock lock(mutex_);
+        positions_ = positions;
+    }
+
+    /// Set the planned goal, tiles around it are kept or loaded as well.
+    void set_goal(const Vec3& goal)
+    {
+        Lock lock(mutex_);
+        goal_ = goal;
+        has_goal_ = true;
+    }
+
+    bool evicted(const Value* position)
+    {
+        Lock lock(mutex_);
+        const auto it = summaries_.find(tile(position));
+        return it != summaries_.end() && it->second.state_ != TileSummary::RESIDENT;
+    }
+
+    /**
+     * Merge loaded tiles, evict distant tiles and request loading of nearby
+     * evicted ones.
+     *
+     * Removed and added points are reported in map updated indices.
+     */
+    template<typename M>
+    void update(M& map)
+    {
+        Timer t;
+        // Map is locked first, as when planning.
+        typename M::CloudLock cloud_lock(map.cloud_mutex_);
+        typename M::Lock index_lock(map.index_mutex_);
+        typename M::Lock updated_lock(map.updated_mutex_);
+        typename M::Lock dirty_lock(map.dirty_mutex_);
+        Lock lock(mutex_);
+        std::vector<Vec3> focus = positions_;
+        if (has_goal_)
+        {
+            focus.push_back(goal_);
+        }
+        if (focus.empty())
+        {
+            return;
+        }
+        const auto min_distance = [this, &focus](const Voxel<int>& key)
+        {
+            Value d = std::numeric_limits<Value>::infinity();
+            for (const auto& p: focus)
+            {
+                d = std::min(d, tile_distance(key, p));
+            }
+            return d;
+        };
+
+        const size_t n_loaded = merge_loaded(map);
+
+        // Group static points by tiles.
+        VoxelMap<int, std::vector<Index>> tiles;
+        for (Index i = 0; i < Index(map.cloud_.size()); ++i)
+        {
+            if (!(map.cloud_[i].flags_ & STATIC))
+            {
+                continue;
+            }
+            Voxel<int> key;
+            if (!key.from<Value>(map.cloud_[i].position_, tile_size_))
+            {
+                continue;
+            }
+            tiles[key].push_back(i);
+        }
+
+        size_t n_evicted = 0;
+        size_t n_points_evicted = 0;
+        for (const auto& kv: tiles)
+        {
+            auto& summary = summaries_[kv.first];
+            // Keep summary of evicted tiles until these are loaded back.
+            if (summary.state_ != TileSummary::RESIDENT)
+            {
+                continue;
+            }
+            summarize(map, kv.second, summary);
+            if (min_distance(kv.first) > evict_distance_)
+            {
+                evict(map, kv.first, kv.second);
+                ++n_evicted;
+                n_points_evicted += kv.second.size();
+            }
+        }
+
+        size_t n_requested = 0;
+        for (auto& kv: summaries_)
+        {
+            if (kv.second.state_ == TileSummary::EVICTED && min_distance(kv.first) < load_distance_)
+            {
+                load(kv.first);
+                ++n_requested;
+            }
+        }
+        ROS_INFO("Map paging: %lu tiles resident, %lu tiles (%lu points) evicted, "
+                 "%lu loaded, %lu requested (%.3f s).",
+                 tiles.size(), n_evicted, n_points_evicted, n_loaded, n_requested, t.seconds_elapsed());
+    }
+
+    /**
+     * Coarse distance from tile centroids to the goal over tiles with
+     * traversable points, both resident and evicted.
+     * Tiles are connected to their 26 neighbors.
+     */
+    VoxelMap<int, Value> coarse_distances(const Vec3& goal)
+    {
+        typedef std::pair<Value, Voxel<int>> Item;
+        struct Greater
+        {
+            bool operator()(const Item& a, const Item& b) const
+            {
+                return a.first > b.first;
+            }
+        };
+        Lock lock(mutex_);
+        VoxelMap<int, Value> dist;
+        const auto goal_key = tile(goal.data());
+        const auto goal_it = summaries_.find(goal_key);
+        if (goal_it == summaries_.end())
+        {
+            return dist;
+        }
+        std::priority_queue<Item, std::vector<Item>, Greater> queue;
+        dist[goal_key] = (goal_it->second.centroid_ - goal).norm();
+        queue.emplace(dist[goal_key], goal_key);
+        while (!queue.empty())
+        {
+            const auto item = queue.top();
+            queue.pop();
+            if (item.first > dist[item.second])
+            {
+                continue;
+            }
+            const auto& u = summaries_[item.second];
+            for (int dx = -1; dx <= 1; ++dx)
+            {
+                for (int dy = -1; dy <= 1; ++dy)
+                {
+                    for (int dz = -1; dz <= 1; ++dz)
+                    {
+                        const Voxel<int> key(item.second.x_ + dx, item.second.y_ + dy, item.second.z_ + dz);
+                        const auto it = summaries_.find(key);
+                        if (it == summaries_.end() || it->second.num_traversable_ == 0)
+                        {
+                            continue;
+                        }
+                        const Value d = item.first + (it->second.centroid_ - u.centroid_).norm();
+                        const auto dist_it = dist.find(key);
+                        if (dist_it == dist.end() || d < dist_it->second)
+                        {
+                            dist[key] = d;
+                            queue.emplace(d, key);
+                        }
+                    }
+                }
+            }
+        }
+        return dist;
+    }
+
+    /// Estimated distance from position to goal through tile summaries.
+    Value coarse_distance(const VoxelMap<int, Value>& dist, const Value* position)
+    {
+        const auto key = tile(position);
+        const auto it = dist.find(key);
+        if (it == dist.end())
+        {
+            return std::numeric_limits<Value>::infinity();
+        }
+        Lock lock(mutex_);
+        return it->second + (ConstVec3Map(position) - summaries_[key].centroid_).norm();
+    }
+
+    // Directory of tile files, paging is disabled if empty.
+    std::string dir_{};
+    Value tile_size_{20.0};
+    // Tiles farther from all focus positions are evicted.
+    Value evict_distance_{150.0};
+    // Evicted tiles closer to any focus position are loaded back.
+    Value load_distance_{100.0};
+
+protected:
+    std::string tile_path(const Voxel<int>& key) const
+    {
+        std::stringstream ss;
+        ss << dir_ << "/tile_" << key.x_ << "_" << key.y_ << "_" << key.z_ << ".bin";
+        return ss.str();
+    }
+
+    template<typename M>
+    void summarize(const M& map, const std::vector<Index>& indices, TileSummary& summary)
+    {
+        summary.centroid_.setZero();
+        summary.num_points_ = uint32_t(indices.size());
+        summary.num_traversable_ = 0;
+        summary.mean_coverage_ = 0;
+        for (const auto i: indices)
+        {
+            const auto& pt = map.cloud_[i];
+            summary.centroid_ += ConstVec3Map(pt.position_);
+            summary.mean_coverage_ += pt.coverage_;
+            if (pt.flags_ & TRAVERSABLE)
+            {
+                ++summary.num_traversable_;
+            }
+        }
+        if (!indices.empty())
+        {
+            summary.centroid_ /= Value(indices.size());
+            summary.mean_coverage_ /= Value(indices.size());
+        }
+    }
+
+    template<typename M>
+    void evict(M& map, const Voxel<int>& key, const std::vector<Index>& indices)
+    {
+        auto data = std::make_shared<std::vector<uint8_t>>();
+        MapDelta tile_points;
+        tile_points.fields_ = DELTA_COVERAGE;
+        tile_points.resolution_ = resolution_;
+        for (const auto i: indices)
+        {
+            tile_points.push_back(map.cloud_[i]);
+        }
+        MapDeltaCodec::encode(tile_points, *data);
+        for (const auto i: indices)
+        {
+            map.remove_point(i);
+        }
+        summaries_[key].state_ = TileSummary::EVICTED;
+        const auto path = tile_path(key);
+        push_task([path, data]()
+        {
+            const std::string tmp_path = path + ".tmp";
+            FILE* file = std::fopen(tmp_path.c_str(), "wb");
+            bool ok = file && std::fwrite(data->data(), data->size(), 1, file) == 1;
+            ok = (file && std::fclose(file) == 0) && ok;
+            if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+            {
+                ROS_ERROR("Could not write map tile %s.", path.c_str());
+            }
+        });
+    }
+
+    void load(const Voxel<int>& key)
+    {
+        summaries_[key].state_ = TileSummary::LOADING;
+        const auto path = tile_path(key);
+        // Tasks run in order, so the tile is read after it has been written.
+        push_task([this, key, path]()
+        {
+            Timer t;
+            std::vector<uint8_t> data;
+            FILE* file = std::fopen(path.c_str(), "rb");
+            if (file)
+            {
+                std::fseek(file, 0, SEEK_END);
+                data.resize(size_t(std::max(std::ftell(file), 0L)));
+                std::fseek(file, 0, SEEK_SET);
+                if (!data.empty() && std::fread(data.data(), data.size(), 1, file) != 1)
+                {
+                    data.clear();
+                }
+                std::fclose(file);
+            }
+            MapDelta tile_points;
+            if (!MapDeltaCodec::decode(data, tile_points))
+            {
+                ROS_ERROR("Could not read map tile %s.", path.c_str());
+            }
+            ROS_DEBUG("Map tile %s with %lu points read (%.3f s).",
+                      path.c_str(), tile_points.size(), t.seconds_elapsed());
+            Lock lock(loaded_mutex_);
+            loaded_.emplace_back(key, std::move(tile_points));
+        });
+    }
+
+    template<typename M>
+    size_t merge_loaded(M& map)
+    {
+        std::vector<std::pair<Voxel<int>, MapDelta>> loaded;
+        {
+            Lock lock(loaded_mutex_);
+            loaded.swap(loaded_);
+        }
+        Vec3 origin(0, 0, 0);
+        flann::Matrix<Elem> origin_mat(origin.data(), 1, 3);
+        for (auto& kv: loaded)
+        {
+            summaries_[kv.first].state_ = TileSummary::RESIDENT;
+            auto& tile_points = kv.second;
+            if (tile_points.size() == 0)
+            {
+                continue;
+            }
+            flann::Matrix<Elem> points(tile_points.positions_.data(), tile_points.size(), 3);
+            map.merge(points, origin_mat);
+            map.merge_coverage(points, tile_points.coverage_.data(), map.points_min_dist_);
+        }
+        if (!loaded.empty())
+        {
+            map.update_dirty();
+            map.clear_dirty();
+        }
+        return loaded.size();
+    }
+
+    void push_task(std::function<void()> task)
+    {
+        {
+            Lock lock(tasks_mutex_);
+            tasks_.push_back(std::move(task));
+        }
+        tasks_cv_.notify_one();
+    }
+
+    void run()
+    {
+        while (true)
+        {
+            std::function<void()> task;
+            {
+                std::unique_lock<Mutex> lock(tasks_mutex_);
+                tasks_cv_.wait(lock, [this]() { return stop_ || !tasks_.empty(); });
+                // Finish pending writes before stopping.
+                if (tasks_.empty())
+                {
+                    return;
+                }
+                task = std::move(tasks_.front());
+                tasks_.pop_front();
+            }
+            task();
+        }
+    }
+
+    // Quantization step of stored positions.
+    Value resolution_{0.001};
+
+    Mutex mutex_;
+    std::vector<Vec3> positions_{};
+    Vec3 goal_{Vec3::Zero()};
+    bool has_goal_{false};
+    VoxelMap<int, TileSummary> summaries_{};
+
+    Mutex loaded_mutex_;
+    std::vector<std::pair<Voxel<int>, MapDelta>> loaded_{};
+
+    Mutex tasks_mutex_;
+    std::condition_variable tasks_cv_;
+    std::deque<std::function<void()>> tasks_{};
+    bool stop_{false};
+    std::thread worker_{};
+};
+
+}  // namespace naex
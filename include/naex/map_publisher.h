@@ -0,0 +1,297 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <boost/make_shared.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <mutex>
+#include <naex/clouds.h>
+#include <naex/map.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <ros/ros.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace naex
+{
+
+/**
+ * Publishes the map from a dedicated thread.
+ *
+ * A persistent buffer with selected point fields is kept and only ranges
+ * of points marked as changed are copied into it from the map, under the
+ * map cloud lock. Building and sending messages is done outside the map
+ * locks, at most at the given rate and only if there are subscribers.
+ * Marks accumulate while nobody listens.
+ */
+template<typename M>
+class MapPublisher
+{
+public:
+    typedef std::mutex Mutex;
+    typedef std::lock_guard<Mutex> Lock;
+
+    MapPublisher(M& map):
+        map_(map)
+    {}
+    ~MapPublisher()
+    {
+        stop();
+    }
+
+    /// Start publishing selected fields, all map fields if empty.
+    void start(const ros::Publisher& pub, const std::string& frame,
+               const std::vector<std::string>& field_names, double rate)
+    {
+        stop();
+        pub_ = pub;
+        frame_ = frame;
+        rate_ = rate;
+        select_fields(field_names);
+        mark_all();
+        stop_ = false;
+        thread_ = std::thread(&MapPublisher::run, this);
+    }
+
+    void stop()
+    {
+        {
+            Lock lock(mutex_);
+            stop_ = true;
+        }
+        cv_.notify_all();
+        if (thread_.joinable())
+        {
+            thread_.join();
+        }
+    }
+
+    /// Mark points as changed.
+    template<typename C>
+    void mark(const C& indices)
+    {
+        Lock lock(mutex_);
+        if (all_marked_)
+        {
+            return;
+        }
+        marked_.insert(marked_.end(), indices.begin(), indices.end());
+        // Whole map is cheaper to patch than a long list of indices.
+        if (marked_.size() > size_t(buffer_points_ / 2))
+        {
+            all_marked_ = true;
+            marked_.clear();
+        }
+    }
+
+    /// Mark all points as changed, e.g., after planning or compaction.
+    void mark_all()
+    {
+        Lock lock(mutex_);
+        all_marked_ = true;
+        marked_.clear();
+    }
+
+    /// Parse whitespace or comma separated field names.
+    static std::vector<std::string> parse_fields(std::string names)
+    {
+        std::replace(names.begin(), names.end(), ',', ' ');
+        std::stringstream ss(names);
+        std::vector<std::string> fields;
+        std::string name;
+        while (ss >> name)
+        {
+            fields.push_back(name);
+        }
+        return fields;
+    }
+
+protected:
+    class FieldCopy
+    {
+    public:
+        uint32_t src_offset_;
+        uint32_t dst_offset_;
+        uint32_t size_;
+    };
+
+    void select_fields(const std::vector<std::string>& field_names)
+    {
+        sensor_msgs::PointCloud2 all;
+        map_.initialize_cloud(all);
+        fields_.clear();
+        copies_.clear();
+        point_step_ = 0;
+        for (const auto& field: all.fields)
+        {
+            if (!field_names.empty()
+                && std::find(field_names.begin(), field_names.end(), field.name) == field_names.end())
+            {
+                continue;
+            }
+            const auto size = uint32_t(field.count * sensor_msgs::sizeOfPointField(field.datatype));
+            // Merge fields adjacent in both the map and the message.
+            if (!copies_.empty()
+                && copies_.back().src_offset_ + copies_.back().size_ == field.offset)
+            {
+                copies_.back().size_ += size;
+            }
+            else
+            {
+                copies_.push_back({field.offset, point_step_, size});
+            }
+            fields_.push_back(field);
+            fields_.back().offset = point_step_;
+            point_step_ += size;
+        }
+        // Keep the whole point if all fields are selected.
+        if (field_names.empty())
+        {
+            fields_ = all.fields;
+            point_step_ = all.point_step;
+            copies_.assign(1, {0, 0, uint32_t(sizeof(Point))});
+        }
+        ROS_INFO("Publishing %lu map fields, %u bytes per point.", fields_.size(), point_step_);
+    }
+
+    /// Copy marked points from the map into the buffer.
+    size_t patch()
+    {
+        typename M::CloudLock cloud_lock(map_.cloud_mutex_);
+        std::vector<Index> marked;
+        bool all_marked = false;
+        {
+            Lock lock(mutex_);
+            marked.swap(marked_);
+            std::swap(all_marked, all_marked_);
+        }
+        const auto n = Index(map_.cloud_.size());
+        const Index n_prev = buffer_points_;
+        if (n != n_prev)
+        {
+            buffer_.resize(size_t(n) * point_step_);
+            buffer_points_ = n;
+        }
+        if (!all_marked && n > n_prev)
+        {
+            copy_range(n_prev, n);
+        }
+        if (all_marked)
+        {
+            copy_range(0, n);
+            return size_t(n);
+        }
+        std::sort(marked.begin(), marked.end());
+        marked.erase(std::unique(marked.begin(), marked.end()), marked.end());
+        // Copy contiguous runs of marked points at once.
+        size_t i = 0;
+        while (i < marked.size())
+        {
+            size_t j = i + 1;
+            while (j < marked.size() && marked[j] == marked[j - 1] + 1)
+            {
+                ++j;
+            }
+            const Index begin = marked[i];
+            const Index end = std::min(marked[j - 1] + 1, n);
+            if (begin < end)
+            {
+                copy_range(begin, end);
+            }
+            i = j;
+        }
+        return marked.size();
+    }
+
+    void copy_range(Index begin, Index end)
+    {
+        const auto src = reinterpret_cast<const uint8_t*>(map_.cloud_.data());
+        if (point_step_ == sizeof(Point))
+        {
+            std::memcpy(buffer_.data() + size_t(begin) * point_step_,
+                        src + size_t(begin) * sizeof(Point),
+                        size_t(end - begin) * sizeof(Point));
+            return;
+        }
+        for (Index i = begin; i < end; ++i)
+        {
+            const auto from = src + size_t(i) * sizeof(Point);
+            const auto to = buffer_.data() + size_t(i) * point_step_;
+            for (const auto& c: copies_)
+            {
+                std::memcpy(to + c.dst_offset_, from + c.src_offset_, c.size_);
+            }
+        }
+    }
+
+    void publish(size_t n_patched, double t_patch)
+    {
+        Timer t;
+        auto cloud = boost::make_shared<sensor_msgs::PointCloud2>();
+        cloud->header.frame_id = frame_;
+        cloud->header.stamp = ros::Time::now();
+        cloud->fields = fields_;
+        cloud->point_step = point_step_;
+        cloud->height = 1;
+        cloud->width = uint32_t(buffer_points_.load());
+        cloud->row_step = cloud->width * cloud->point_step;
+        cloud->is_bigendian = bigendian();
+        cloud->is_dense = false;
+        cloud->data = buffer_;
+        pub_.publish(cloud);
+        ROS_DEBUG("Map with %u points published on %s, %lu points patched (%.3f s), sent (%.3f s).",
+                  cloud->width, pub_.getTopic().c_str(), n_patched, t_patch, t.seconds_elapsed());
+    }
+
+    void run()
+    {
+        const auto period = std::chrono::duration<double>(1.0 / std::max(rate_, 1e-3));
+        while (true)
+        {
+            {
+                std::unique_lock<Mutex> lock(mutex_);
+                if (cv_.wait_for(lock, period, [this]() { return stop_; }))
+                {
+                    return;
+                }
+            }
+            if (pub_.getNumSubscribers() == 0 || map_.empty())
+            {
+                continue;
+            }
+            Timer t;
+            const auto n_patched = patch();
+            publish(n_patched, t.seconds_elapsed());
+        }
+    }
+
+    M& map_;
+    ros::Publisher pub_{};
+    std::string frame_{};
+    double rate_{1.0};
+
+    // Message layout and copies from map points.
+    std::vector<sensor_msgs::PointField> fields_{};
+    std::vector<FieldCopy> copies_{};
+    uint32_t point_step_{0};
+
+    // Buffer is accessed only from the publishing thread.
+    std::vector<uint8_t> buffer_{};
+    std::atomic<Index> buffer_points_{0};
+
+    Mutex mutex_;
+    std::condition_variable cv_;
+    std::vector<Index> marked_{};
+    bool all_marked_{true};
+    bool stop_{false};
+    std::thread thread_{};
+};
+
+}  // namespace naex
@@ -0,0 +1,342 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <naex/map.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <naex/voxel_filter.h>
+#include <ros/ros.h>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+
+namespace naex
+{
+
+/**
+ * Binary map snapshot layout.
+ *
+ * Header is followed by page-aligned sections with raw Point, Neighborhood
+ * and Neighbor arrays and dirty point indices, so that a memory-mapped file can be copied into the
+ * map in bulk without parsing. Sizes of the structures and the number of
+ * neighbors are stored to reject snapshots from incompatible builds.
+ * The spatial index is stored next to the snapshot, with .index suffix.
+ */
+class MapSnapshotHeader
+{
+public:
+    static constexpr const char* MAGIC = "NAEXMAP";
+    static const uint32_t VERSION = 3;
+    static const uint64_t ALIGNMENT = 4096;
+
+    static uint64_t align(uint64_t offset)
+    {
+        return (offset + ALIGNMENT - 1) / ALIGNMENT * ALIGNMENT;
+    }
+
+    MapSnapshotHeader()
+    {
+        std::strncpy(magic_, MAGIC, sizeof(magic_));
+    }
+
+    template<typename N>
+    void set_neighborhood()
+    {
+        neighborhood_size_ = sizeof(N);
+        k_neighbors_ = uint32_t(N::K_NEIGHBORS);
+    }
+
+    template<typename N>
+    bool compatible() const
+    {
+        return std::strncmp(magic_, MAGIC, sizeof(magic_)) == 0
+            && version_ == VERSION
+            && point_size_ == sizeof(Point)
+            && neighborhood_size_ == sizeof(N)
+            && neighbor_size_ == sizeof(Neighbor)
+            && k_neighbors_ == uint32_t(N::K_NEIGHBORS);
+    }
+
+    char magic_[8] = {0};
+    uint32_t version_{VERSION};
+    uint32_t point_size_{sizeof(Point)};
+    uint32_t neighborhood_size_{0};
+    uint32_t neighbor_size_{sizeof(Neighbor)};
+    uint32_t k_neighbors_{0};
+    uint64_t num_points_{0};
+    uint64_t num_neighbors_{0};
+    uint64_t num_dirty_{0};
+    uint64_t points_offset_{0};
+    uint64_t graph_offset_{0};
+    uint64_t adjacency_offset_{0};
+    uint64_t dirty_offset_{0};
+    uint64_t file_size_{0};
+};
+
+inline std::string snapshot_index_path(const std::string& path)
+{
+    return path + ".index";
+}
+
+/// Write point, neighborhood and adjacency arrays and dirty indices into
+/// a snapshot file. The file is written under a temporary name and renamed
+/// once complete.
+template<typename N>
+bool write_map_snapshot(const std::string& path,
+                        const std::vector<Point>& cloud,
+                        const std::vector<N>& graph,
+                        const std::vector<Neighbor>& adjacency,
+                        const std::vector<Index>& dirty)
+{
+    assert(cloud.size() == graph.size());
+    MapSnapshotHeader header;
+    header.set_neighborhood<N>();
+    header.num_points_ = cloud.size();
+    header.num_neighbors_ = adjacency.size();
+    header.num_dirty_ = dirty.size();
+    header.points_offset_ = MapSnapshotHeader::align(sizeof(MapSnapshotHeader));
+    header.graph_offset_ = MapSnapshotHeader::align(header.points_offset_ + cloud.size() * sizeof(Point));
+    header.adjacency_offset_ = MapSnapshotHeader::align(header.graph_offset_ + graph.size() * sizeof(N));
+    header.dirty_offset_ = MapSnapshotHeader::align(header.adjacency_offset_ + adjacency.size() * sizeof(Neighbor));
+    header.file_size_ = header.dirty_offset_ + dirty.size() * sizeof(Index);
+
+    const std::string tmp_path = path + ".tmp";
+    FILE* file = std::fopen(tmp_path.c_str(), "wb");
+    if (!file)
+    {
+        ROS_ERROR("Could not open map snapshot %s for writing.", tmp_path.c_str());
+        return false;
+    }
+    const auto write_at = [file](uint64_t offset, const void* data, size_t size)
+    {
+        return std::fseek(file, long(offset), SEEK_SET) == 0
+            && (size == 0 || std::fwrite(data, size, 1, file) == 1);
+    };
+    bool ok = write_at(0, &header, sizeof(header))
+        && write_at(header.points_offset_, cloud.data(), cloud.size() * sizeof(Point))
+        && write_at(header.graph_offset_, graph.data(), graph.size() * sizeof(N))
+        && write_at(header.adjacency_offset_, adjacency.data(), adjacency.size() * sizeof(Neighbor))
+        && write_at(header.dirty_offset_, dirty.data(), dirty.size() * sizeof(Index));
+    ok = (std::fclose(file) == 0) && ok;
+    if (!ok || std::rename(tmp_path.c_str(), path.c_str()) != 0)
+    {
+        ROS_ERROR("Could not write map snapshot %s.", path.c_str());
+        std::remove(tmp_path.c_str());
+        return false;
+    }
+    return true;
+}
+
+/// Save map snapshot, blocking until written.
+template<typename M>
+bool save_map_snapshot(M& map, const std::string& path)
+{
+    Timer t;
+    typename M::CloudLock cloud_lock(map.cloud_mutex_);
+    typename M::Lock index_lock(map.index_mutex_);
+    typename M::Lock dirty_lock(map.dirty_mutex_);
+    const std::vector<Index> dirty(map.dirty_indices_.begin(), map.dirty_indices_.end());
+    if (!write_map_snapshot(path, map.cloud_, map.graph_, map.adjacency_, dirty))
+    {
+        return false;
+    }
+    if (map.index_)
+    {
+        map.index_->save(snapshot_index_path(path));
+    }
+    ROS_INFO("Map snapshot with %lu points saved to %s (%.3f s).",
+             map.cloud_.size(), path.c_str(), t.seconds_elapsed());
+    return true;
+}
+
+/// Load map snapshot, replacing current map content.
+/// The stored spatial index is used if it matches the map, otherwise
+/// the index is rebuilt. Neighborhoods, features and labels are used as
+/// stored, without updating the points, points which were dirty when saved
+/// are marked dirty again. Update listeners are notified about all loaded
+/// points.
+template<typename M>
+bool load_map_snapshot(M& map, const std::string& path)
+{
+    Timer t;
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+    {
+        ROS_INFO("No map snapshot at %s.", path.c_str());
+        return false;
+    }
+    struct stat st;
+    if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(MapSnapshotHeader))
+    {
+        ROS_ERROR("Invalid map snapshot %s.", path.c_str());
+        ::close(fd);
+        return false;
+    }
+    void* data = ::mmap(nullptr, size_t(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (data == MAP_FAILED)
+    {
+        ROS_ERROR("Could not map snapshot %s into memory.", path.c_str());
+        return false;
+    }
+    const auto bytes = static_cast<const uint8_t*>(data);
+    MapSnapshotHeader header;
+    std::memcpy(&header, bytes, sizeof(header));
+    if (!header.compatible<typename M::Neighborhood>() || header.file_size_ != uint64_t(st.st_size))
+    {
+        ROS_ERROR("Map snapshot %s is incompatible (version %u, point size %u, neighborhood size %u, "
+                  "neighbor size %u, %u neighbors).",
+                  path.c_str(), header.version_, header.point_size_, header.neighborhood_size_,
+                  header.neighbor_size_, header.k_neighbors_);
+        ::munmap(data, size_t(st.st_size));
+        return false;
+    }
+
+    typename M::CloudLock cloud_lock(map.cloud_mutex_);
+    typename M::Lock index_lock(map.index_mutex_);
+    typename M::Lock updated_lock(map.updated_mutex_);
+    typename M::Lock dirty_lock(map.dirty_mutex_);
+    const auto points = reinterpret_cast<const Point*>(bytes + header.points_offset_);
+    const auto neighborhoods = reinterpret_cast<const typename M::Neighborhood*>(bytes + header.graph_offset_);
+    const auto neighbors = reinterpret_cast<const Neighbor*>(bytes + header.adjacency_offset_);
+    const auto dirty = reinterpret_cast<const Index*>(bytes + header.dirty_offset_);
+    map.cloud_.assign(points, points + header.num_points_);
+    map.graph_.assign(neighborhoods, neighborhoods + header.num_points_);
+    map.adjacency_.assign(neighbors, neighbors + header.num_neighbors_);
+    map.num_reserved_neighbors_ = 0;
+    for (const auto& neigh: map.graph_)
+    {
+        map.num_reserved_neighbors_ += size_t(neigh.neighbor_capacity_);
+    }
+    map.clear_dirty();
+    for (uint64_t i = 0; i < header.num_dirty_; ++i)
+    {
+        if (dirty[i] >= 0 && uint64_t(dirty[i]) < header.num_points_)
+        {
+            map.dirty_indices_.insert(dirty[i]);
+        }
+    }
+    ::munmap(data, size_t(st.st_size));
+    map.clear_updated();
+    std::vector<Index> loaded;
+    index_range(map.cloud_.size(), loaded);
+    for (const auto& listener: map.update_listeners_)
+    {
+        listener(loaded);
+    }
+    ROS_INFO("Map snapshot with %lu points loaded from %s (%.3f s).",
+             map.cloud_.size(), path.c_str(), t.seconds_elapsed());
+
+    if (map.cloud_.empty())
+    {
+        map.index_.reset();
+        return true;
+    }
+    try
+    {
+        map.index_ = std::make_shared<FlannIndex>(map.position_matrix(),
+                                                  flann::SavedIndexParams(snapshot_index_path(path)));
+        ROS_INFO("Index with %lu points loaded (%.3f s).", map.index_->size(), t.seconds_elapsed());
+    }
+    catch (const std::exception& ex)
+    {
+        ROS_WARN("Could not load index of map snapshot %s, rebuilding: %s.", path.c_str(), ex.what());
+        map.update_index();
+        // Removed points are not searchable.
+        for (Index i = 0; i < Index(map.cloud_.size()); ++i)
+        {
+            if (!(map.cloud_[i].flags_ & STATIC))
+            {
+                map.index_->removePoint(i);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * Saves map snapshots in background.
+ *
+ * Map content and index are captured while the map is locked, writing the
+ * snapshot runs in a separate thread. A save requested while the previous
+ * one is still being written is skipped.
+ */
+class MapSnapshotWriter
+{
+public:
+    ~MapSnapshotWriter()
+    {
+        wait();
+    }
+
+    bool busy() const
+    {
+        return busy_;
+    }
+
+    void wait()
+    {
+        if (thread_.joinable())
+        {
+            thread_.join();
+        }
+    }
+
+    template<typename M>
+    bool save(M& map, const std::string& path)
+    {
+        if (busy_)
+        {
+            ROS_WARN("Previous map snapshot still being written, skipping.");
+            return false;
+        }
+        wait();
+        Timer t;
+        auto cloud = std::make_shared<std::vector<Point>>();
+        auto graph = std::make_shared<std::vector<typename M::Neighborhood>>();
+        auto adjacency = std::make_shared<std::vector<Neighbor>>();
+        auto dirty = std::make_shared<std::vector<Index>>();
+        const std::string index_tmp_path = snapshot_index_path(path) + ".tmp";
+        {
+            typename M::CloudLock cloud_lock(map.cloud_mutex_);
+            typename M::Lock index_lock(map.index_mutex_);
+            typename M::Lock dirty_lock(map.dirty_mutex_);
+            *cloud = map.cloud_;
+            *graph = map.graph_;
+            *adjacency = map.adjacency_;
+            dirty->assign(map.dirty_indices_.begin(), map.dirty_indices_.end());
+            if (map.index_)
+            {
+                map.index_->save(index_tmp_path);
+            }
+        }
+        ROS_INFO("Map with %lu points captured for snapshot (%.3f s).", cloud->size(), t.seconds_elapsed());
+        busy_ = true;
+        thread_ = std::thread([this, cloud, graph, adjacency, dirty, path, index_tmp_path]()
+        {
+            Timer t;
+            if (write_map_snapshot(path, *cloud, *graph, *adjacency, *dirty))
+            {
+                std::rename(index_tmp_path.c_str(), snapshot_index_path(path).c_str());
+                ROS_INFO("Map snapshot with %lu points saved to %s (%.3f s).",
+                         cloud->size(), path.c_str(), t.seconds_elapsed());
+            }
+            busy_ = false;
+        });
+        return true;
+    }
+
+protected:
+    std::thread thread_{};
+    std::atomic<bool> busy_{false};
+};
+
+}  // namespace naex
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <cstdint>
+
+namespace naex
+{
+
+/// Spread lower 21 bits of x so that there are two zero bits between them.
+inline uint64_t morton_spread(uint64_t x)
+{
+    x &= 0x1fffff;
+    x = (x | x << 32) & 0x1f00000000ffff;
+    x = (x | x << 16) & 0x1f0000ff0000ff;
+    x = (x | x << 8) & 0x100f00f00f00f00f;
+    x = (x | x << 4) & 0x10c30c30c30c30c3;
+    x = (x | x << 2) & 0x1249249249249249;
+    return x;
+}
+
+/**
+ * Morton (Z-order) code of non-negative cell coordinates, 21 bits each.
+ *
+ * Sorting by the code orders cells along a space-filling curve, so that
+ * cells near in space tend to be near in the order.
+ */
+inline uint64_t morton_code(uint32_t x, uint32_t y, uint32_t z)
+{
+    return morton_spread(x) | morton_spread(y) << 1 | morton_spread(z) << 2;
+}
+
+}  // namespace naex
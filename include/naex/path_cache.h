@@ -0,0 +1,192 @@
+#pragma once
+
+#include <cassert>
+#include <cmath>
+#include <geometry_msgs/PoseStamped.h>
+#include <limits>
+#include <mutex>
+#include <naex/nearest_neighbors.h>
+#include <naex/types.h>
+#include <nav_msgs/Path.h>
+#include <ros/ros.h>
+#include <unordered_set>
+#include <vector>
+
+namespace naex
+{
+
+/**
+ * Last planned path, reused for periodic replanning while it stays valid.
+ *
+ * The path is invalidated once any of its points is updated in the map,
+ * since costs of path edges can only change with labels of their end
+ * points, once the robot gets farther from the path than given offset,
+ * once the goal is reached, or once the path gets older than the refresh
+ * period. Otherwise, the traversed prefix is trimmed as the robot moves
+ * and the rest of the path is reused.
+ *
+ * Paths which got better due to new map points are only found on refresh.
+ */
+class PathCache
+{
+public:
+    typedef std::mutex Mutex;
+    typedef std::lock_guard<Mutex> Lock;
+
+    /**
+     * Store a new path, with map vertices matching the last poses of the
+     * path and path costs of these vertices.
+     */
+    void set(const std::vector<Vertex>& vertices, const std::vector<Value>& costs,
+             const nav_msgs::Path& path, double now)
+    {
+        Lock lock(mutex_);
+        assert(vertices.size() == costs.size());
+        assert(vertices.size() <= path.poses.size());
+        header_ = path.header;
+        vertices_ = vertices;
+        costs_ = costs;
+        poses_.assign(path.poses.end() - vertices.size(), path.poses.end());
+        members_.clear();
+        members_.insert(vertices.begin(), vertices.end());
+        time_ = now;
+        valid_ = !vertices_.empty();
+    }
+
+    void clear()
+    {
+        Lock lock(mutex_);
+        valid_ = false;
+        vertices_.clear();
+        costs_.clear();
+        poses_.clear();
+        members_.clear();
+    }
+
+    bool valid() const
+    {
+        Lock lock(mutex_);
+        return valid_;
+    }
+
+    /// Invalidate the path if any of updated points lies on it.
+    template<typename C>
+    void update(const C& indices)
+    {
+        Lock lock(mutex_);
+        if (!valid_)
+        {
+            return;
+        }
+        for (const auto i: indices)
+        {
+            if (members_.count(Index(i)))
+            {
+                ROS_DEBUG("Cached path invalidated by update of point %li.", long(i));
+                valid_ = false;
+                return;
+            }
+        }
+    }
+
+    /// Apply map index remap, invalidate the path if any of its points was removed.
+    void remap(const std::vector<Index>& remap)
+    {
+        Lock lock(mutex_);
+        if (!valid_)
+        {
+            return;
+        }
+        members_.clear();
+        for (auto& v: vertices_)
+        {
+            const Index i = v < Vertex(remap.size()) ? remap[v] : invalid_index<Index>();
+            if (invalid_index(i))
+            {
+                valid_ = false;
+                return;
+            }
+            v = Vertex(i);
+            members_.insert(i);
+        }
+    }
+
+    /**
+     * Trim the traversed part of the path and return the rest, starting
+     * from the robot pose, if the path can still be used.
+     */
+    bool reuse(const geometry_msgs::PoseStamped& robot, double now, nav_msgs::Path& path)
+    {
+        Lock lock(mutex_);
+        if (!valid_)
+        {
+            return false;
+        }
+        if (now - time_ >= refresh_period_)
+        {
+            ROS_DEBUG("Cached path is %.1f s old, refresh needed.", now - time_);
+            valid_ = false;
+            return false;
+        }
+        // Closest path pose to the robot.
+        size_t closest = 0;
+        double min_dist = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < poses_.size(); ++i)
+        {
+            const double dx = poses_[i].pose.position.x - robot.pose.position.x;
+            const double dy = poses_[i].pose.position.y - robot.pose.position.y;
+            const double dz = poses_[i].pose.position.z - robot.pose.position.z;
+            const double dist = std::sqrt(dx * dx + dy * dy + dz * dz);
+            if (dist < min_dist)
+            {
+                closest = i;
+                min_dist = dist;
+            }
+        }
+        if (min_dist > max_offset_)
+        {
+            ROS_DEBUG("Robot is %.2f m > %.2f m from cached path.", min_dist, max_offset_);
+            valid_ = false;
+            return false;
+        }
+        for (size_t i = 0; i < closest; ++i)
+        {
+            members_.erase(Index(vertices_[i]));
+        }
+        vertices_.erase(vertices_.begin(), vertices_.begin() + closest);
+        costs_.erase(costs_.begin(), costs_.begin() + closest);
+        poses_.erase(poses_.begin(), poses_.begin() + closest);
+        if (vertices_.size() <= 1)
+        {
+            ROS_DEBUG("Goal of cached path reached.");
+            valid_ = false;
+            return false;
+        }
+        path.header = header_;
+        path.header.stamp = ros::Time::now();
+        path.poses.clear();
+        path.poses.reserve(poses_.size() + 1);
+        path.poses.push_back(robot);
+        path.poses.insert(path.poses.end(), poses_.begin(), poses_.end());
+        ROS_DEBUG("Cached path with %lu poses and remaining cost %.3f reused.",
+                  path.poses.size(), costs_.back() - costs_.front());
+        return true;
+    }
+
+    // Full replanning is done at least this often.
+    double refresh_period_{10.0};
+    // Maximum distance of the robot from the path to reuse it.
+    double max_offset_{1.0};
+
+protected:
+    mutable Mutex mutex_;
+    bool valid_{false};
+    double time_{std::numeric_limits<double>::quiet_NaN()};
+    std_msgs::Header header_{};
+    std::vector<Vertex> vertices_{};
+    std::vector<Value> costs_{};
+    std::vector<geometry_msgs::PoseStamped> poses_{};
+    std::unordered_set<Index> members_{};
+};
+
+}  // namespace naex
@@ -0,0 +1,217 @@
+#pragma once
+
+#include <algorithm>
+#include <cassert>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <naex/timer.h>
+#include <ros/ros.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace naex
+{
+
+/**
+ * Bounded FIFO queue between pipeline stages.
+ *
+ * If the queue is full, a pushed item is coalesced into the last queued
+ * one, so that producers never block and no item is lost. Without a
+ * coalescing function, the producer waits for a free slot.
+ */
+template<typename T>
+class BoundedQueue
+{
+public:
+    typedef std::function<void(T& queued, T&& item)> Coalesce;
+
+    BoundedQueue(size_t capacity, Coalesce coalesce = Coalesce()):
+        capacity_(std::max(capacity, size_t(1))),
+        coalesce_(coalesce)
+    {}
+
+    /// Push an item, return false if the queue has been closed.
+    bool push(T item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (!coalesce_)
+        {
+            not_full_.wait(lock, [this]() { return closed_ || queue_.size() < capacity_; });
+        }
+        if (closed_)
+        {
+            return false;
+        }
+        if (queue_.size() >= capacity_)
+        {
+            coalesce_(queue_.back(), std::move(item));
+            ++num_coalesced_;
+        }
+        else
+        {
+            queue_.push_back(std::move(item));
+        }
+        lock.unlock();
+        not_empty_.notify_one();
+        return true;
+    }
+
+    /// Pop the oldest item, waiting for one. Return false once the queue
+    /// is closed and empty.
+    bool pop(T& item)
+    {
+        std::unique_lock<std::mutex> lock(mutex_);
+        not_empty_.wait(lock, [this]() { return closed_ || !queue_.empty(); });
+        if (queue_.empty())
+        {
+            return false;
+        }
+        item = std::move(queue_.front());
+        queue_.pop_front();
+        lock.unlock();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            closed_ = true;
+        }
+        not_empty_.notify_all();
+        not_full_.notify_all();
+    }
+
+    size_t size() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return queue_.size();
+    }
+
+    size_t num_coalesced() const
+    {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return num_coalesced_;
+    }
+
+protected:
+    size_t capacity_{1};
+    Coalesce coalesce_{};
+    mutable std::mutex mutex_;
+    std::condition_variable not_empty_;
+    std::condition_variable not_full_;
+    std::deque<T> queue_{};
+    bool closed_{false};
+    size_t num_coalesced_{0};
+};
+
+/**
+ * Linear pipeline of stages, each running in its own thread.
+ *
+ * Each stage takes items from its input queue and passes them to the
+ * next one, unless it returns false. Queues are bounded and coalesce
+ * items under backpressure, so that sustained throughput is given by the
+ * slowest stage. Exceptions thrown by a stage drop the item.
+ */
+template<typename T>
+class Pipeline
+{
+public:
+    typedef std::function<bool(T&)> Stage;
+
+    Pipeline(size_t capacity = 2, typename BoundedQueue<T>::Coalesce coalesce = {}):
+        capacity_(capacity),
+        coalesce_(coalesce)
+    {}
+    ~Pipeline()
+    {
+        stop();
+    }
+
+    void add_stage(const std::string& name, Stage stage)
+    {
+        assert(threads_.empty());
+        names_.push_back(name);
+        stages_.push_back(stage);
+    }
+
+    void start()
+    {
+        for (size_t i = 0; i < stages_.size(); ++i)
+        {
+            queues_.push_back(std::make_shared<BoundedQueue<T>>(capacity_, coalesce_));
+        }
+        for (size_t i = 0; i < stages_.size(); ++i)
+        {
+            threads_.emplace_back(&Pipeline::run, this, i);
+        }
+    }
+
+    /// Close the queues and wait for stages to finish pending items.
+    void stop()
+    {
+        // Close queues in order, so that a stage finishes its items
+        // before the next one is closed.
+        for (size_t i = 0; i < threads_.size(); ++i)
+        {
+            queues_[i]->close();
+            threads_[i].join();
+        }
+        threads_.clear();
+        queues_.clear();
+    }
+
+    bool push(T item)
+    {
+        if (queues_.empty())
+        {
+            return false;
+        }
+        return queues_.front()->push(std::move(item));
+    }
+
+protected:
+    void run(size_t i)
+    {
+        T item;
+        while (queues_[i]->pop(item))
+        {
+            Timer t;
+            bool pass = false;
+            try
+            {
+                pass = stages_[i](item);
+            }
+            catch (const std::exception& ex)
+            {
+                ROS_ERROR("Pipeline stage %s failed: %s", names_[i].c_str(), ex.what());
+            }
+            catch (...)
+            {
+                ROS_ERROR("Pipeline stage %s failed with an unknown exception.", names_[i].c_str());
+            }
+            ROS_DEBUG("Pipeline stage %s done, %lu queued, %lu coalesced (%.3f s).",
+                      names_[i].c_str(), queues_[i]->size(), queues_[i]->num_coalesced(),
+                      t.seconds_elapsed());
+            if (pass && i + 1 < queues_.size())
+            {
+                queues_[i + 1]->push(std::move(item));
+            }
+        }
+    }
+
+    size_t capacity_{2};
+    typename BoundedQueue<T>::Coalesce coalesce_{};
+    std::vector<std::string> names_{};
+    std::vector<Stage> stages_{};
+    std::vector<std::shared_ptr<BoundedQueue<T>>> queues_{};
+    std::vector<std::thread> threads_{};
+};
+
+}  // namespace naex
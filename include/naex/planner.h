@@ -6,6 +6,7 @@
 #define NAEX_PLANNER_H
 
 #include <algorithm>
+#include <atomic>
 #include <boost/graph/graph_concepts.hpp>
 #include <cmath>
 #include <cstddef>
@@ -21,23 +22,38 @@
 #include <naex/exceptions.h>
 #include <naex/exclude_frames_filter.h>
 #include <naex/flann.h>
+#include <naex/GetCostMatrix.h>
+#include <naex/goal_candidates.h>
 #include <naex/iterators.h>
 #include <naex/map.h>
+#include <naex/map_delta.h>
+#include <naex/map_paging.h>
+#include <naex/map_publisher.h>
+#include <naex/map_snapshot.h>
 #include <naex/nearest_neighbors.h>
+#include <naex/path_cache.h>
+#include <naex/pipeline.h>
 #include <naex/range_filter.h>
+#include <naex/range_step_filter.h>
 #include <naex/reward.h>
+#include <naex/reward_field.h>
 #include <naex/step_filter.h>
 #include <naex/timer.h>
 #include <naex/transform_filter.h>
 #include <naex/transforms.h>
 #include <naex/types.h>
+#include <naex/update_batcher.h>
+#include <naex/viewpoints.h>
 #include <naex/voxel_filter.h>
 #include <nav_msgs/GetPlan.h>
 #include <nav_msgs/Path.h>
 #include <random>
+#include <ros/callback_queue.h>
 #include <ros/ros.h>
 #include <sensor_msgs/point_cloud2_iterator.h>
 #include <sensor_msgs/PointCloud2.h>
+#include <std_msgs/Float32.h>
+#include <std_msgs/UInt8MultiArray.h>
 #include <tf2_eigen/tf2_eigen.h>
 #include <tf2_ros/buffer.h>
 #include <tf2_ros/transform_listener.h>
@@ -54,10 +70,62 @@ typedef ValueIterator<Edge> EdgeIter;
 namespace naex
 {
 
-class Planner
+/// Input scans passed through the mapping pipeline.
+/// Scans are accumulated in a batch when a stage falls behind.
+class ScanBatch
 {
 public:
-    Planner(ros::NodeHandle& nh, ros::NodeHandle& pnh):
+    class Scan
+    {
+    public:
+        sensor_msgs::PointCloud2::ConstPtr input_{};
+        // Subsampled organized cloud for occupancy updates.
+        sensor_msgs::PointCloud2 organized_{};
+        geometry_msgs::TransformStamped cloud_to_map_{};
+        // Filtered cloud in map frame.
+        sensor_msgs::PointCloud2 cloud_{};
+        Vec3 origin_{Vec3::Zero()};
+    };
+
+    void append(ScanBatch& other)
+    {
+        scans_.insert(scans_.end(),
+                      std::make_move_iterator(other.scans_.begin()),
+                      std::make_move_iterator(other.scans_.end()));
+        other.scans_.clear();
+    }
+
+    std::vector<Scan> scans_{};
+};
+typedef std::shared_ptr<ScanBatch> ScanBatchPtr;
+
+/// Planner of any neighborhood size, see create_planner.
+class PlannerBase
+{
+public:
+    virtual ~PlannerBase() = default;
+    /// Wait for other robots and transforms, then start planning.
+    virtual void initialize() = 0;
+    /// Stop waiting in initialize, e.g., on shutdown.
+    virtual void cancel() = 0;
+};
+
+/**
+ * Exploration and path planner in point map.
+ * @tparam K Maximum neighborhood size, see MapK.
+ */
+template<Index K>
+class PlannerK: public PlannerBase
+{
+public:
+    typedef MapK<K> Map;
+    typedef GraphK<K> Graph;
+    typedef EdgeCostsK<K> EdgeCosts;
+    typedef NeighborhoodK<K> Neighborhood;
+    typedef typename Map::CloudLock CloudLock;
+    typedef typename Map::ViewLock ViewLock;
+
+    PlannerK(ros::NodeHandle& nh, ros::NodeHandle& pnh):
         nh_(nh),
         pnh_(pnh)
     {
@@ -70,18 +138,106 @@ public:
         last_request_.goal.pose.position.y = std::numeric_limits<double>::quiet_NaN();
         last_request_.goal.pose.position.z = std::numeric_limits<double>::quiet_NaN();
         last_request_.tolerance = 2.0f;
+        map_.add_remap_listener([this](const std::vector<Index>& remap)
+                                {
+                                    reward_field_.remap(remap);
+                                    goal_candidates_.remap(remap);
+                                    path_cache_.remap(remap);
+                                    map_publisher_.mark_all();
+                                });
+        map_.add_update_listener([this](const std::vector<Index>& updated)
+                                 {
+                                     goal_candidates_.update(map_.cloud_, updated);
+                                     path_cache_.update(updated);
+                                 });
         configure();
+        ROS_INFO("Configured (%.3f s).", t.seconds_elapsed());
+    }
+
+    /// Wait for other robots and bootstrap the map, unless canceled.
+    void initialize() override
+    {
+        Timer t;
+        const double timeout = 15.;
         ROS_INFO("Initializing. Waiting for other robots...");
-        // TODO: Avoid blocking here to be usable as nodelet.
-        find_robots(map_frame_, ros::Time(), 15.f);
+        for (const auto& frame: robot_frames_)
+        {
+            if (frame != robot_frame_)
+            {
+                wait_for_transform(frame, std::max(timeout - t.seconds_elapsed(), 0.));
+            }
+        }
+        if (canceled_)
+        {
+            ROS_WARN("Initialization canceled (%.3f s).", t.seconds_elapsed());
+            return;
+        }
+        find_robots(map_frame_, ros::Time(), 0.f);
         Lock lock(initialized_mutex_);
         initialized_ = true;
         time_initialized_ = ros::Time::now().toSec();
-        bootstrap_map();
+        if (!snapshot_loaded_)
+        {
+            bootstrap_map();
+        }
         ROS_INFO("Initialized at %.1f s (%.3f s).",
                  time_initialized_, t.seconds_elapsed());
     }
 
+    void cancel() override
+    {
+        canceled_ = true;
+    }
+
+    /// Wait for transform from given frame to map, return false on timeout
+    /// or once canceled.
+    bool wait_for_transform(const std::string& frame, double timeout)
+    {
+        Timer t;
+        while (!canceled_ && ros::ok())
+        {
+            if (tf_->canTransform(map_frame_, frame, ros::Time(), ros::Duration(0.1)))
+            {
+                return true;
+            }
+            if (t.seconds_elapsed() >= timeout)
+            {
+                break;
+            }
+        }
+        return false;
+    }
+
+    ~PlannerK() override
+    {
+        // Stop callbacks and pipeline stages before members are destroyed.
+        cloud_sub_.shutdown();
+        map_delta_sub_.shutdown();
+        for (auto& sub: input_cloud_subs_)
+        {
+            sub.shutdown();
+        }
+        planning_timer_.stop();
+        viewpoints_update_timer_.stop();
+        update_params_timer_.stop();
+        snapshot_timer_.stop();
+        paging_timer_.stop();
+        compaction_timer_.stop();
+        reorder_timer_.stop();
+        batch_timer_.stop();
+        get_plan_service_.shutdown();
+        get_cost_matrix_service_.shutdown();
+        if (pipeline_)
+        {
+            pipeline_->stop();
+        }
+        // Finish pending planning requests.
+        if (planning_spinner_)
+        {
+            planning_spinner_->stop();
+        }
+    }
+
     void update_params(const ros::WallTimerEvent& evt)
     {
         Timer t;
@@ -116,22 +272,52 @@ public:
         pnh_.param("inclination_penalty", map_.inclination_penalty_, map_.inclination_penalty_);
 
         pnh_.param("neighborhood_radius", map_.neighborhood_radius_, map_.neighborhood_radius_);
+        pnh_.param("neighborhood_search_radius", map_.neighborhood_search_radius_, map_.neighborhood_search_radius_);
+        pnh_.param("max_unused_adjacency_ratio", map_.max_unused_adjacency_ratio_, map_.max_unused_adjacency_ratio_);
+        pnh_.param("track_dependencies", map_.track_dependencies_, map_.track_dependencies_);
+        pnh_.param("lazy_edge_costs", map_.lazy_edge_costs_, map_.lazy_edge_costs_);
         pnh_.param("normal_radius", normal_radius_, normal_radius_);
 
         update_params(ros::WallTimerEvent());
 
         pnh_.param("viewpoints_update_freq", viewpoints_update_freq_, viewpoints_update_freq_);
+        pnh_.param("viewpoints_bin_size", viewpoints_bin_size_, viewpoints_bin_size_);
         pnh_.param("min_vp_distance", min_vp_distance_, min_vp_distance_);
         pnh_.param("max_vp_distance", max_vp_distance_, max_vp_distance_);
         pnh_.param("collect_rewards", collect_rewards_, collect_rewards_);
+        pnh_.param("reward_method", reward_method_, reward_method_);
+        pnh_.param("max_fft_cells", max_fft_cells_, max_fft_cells_);
+        if (reward_method_ != "voxel" && reward_method_ != "fft" && reward_method_ != "lut"
+            && reward_method_ != "incremental")
+        {
+            ROS_WARN("Unknown reward method %s, using voxel.", reward_method_.c_str());
+            reward_method_ = "voxel";
+        }
         pnh_.param("full_coverage_dist", full_coverage_dist_, full_coverage_dist_);
         pnh_.param("coverage_dist_spread", coverage_dist_spread_, coverage_dist_spread_);
 
         pnh_.param("self_factor", self_factor_, self_factor_);
         pnh_.param("suppress_base_reward", suppress_base_reward_, suppress_base_reward_);
+        pnh_.param("min_deficit_change", min_deficit_change_, min_deficit_change_);
+        reward_field_ = RewardField(0.5, full_coverage_dist_, coverage_dist_spread_, max_vp_distance_,
+                                    min_deficit_change_, suppress_base_reward_);
         pnh_.param("path_cost_pow", path_cost_pow_, path_cost_pow_);
         pnh_.param("min_path_cost", min_path_cost_, min_path_cost_);
+        pnh_.param("goal_candidates", use_goal_candidates_, use_goal_candidates_);
+        pnh_.param("goal_cluster_size", goal_cluster_size_, goal_cluster_size_);
+        pnh_.param("max_goal_coverage", max_goal_coverage_, max_goal_coverage_);
+        if (use_goal_candidates_)
+        {
+            goal_candidates_.reset(goal_cluster_size_,
+                                   [this](const Point& pt) { return goal_candidate(pt); });
+        }
         pnh_.param("planning_freq", planning_freq_, planning_freq_);
+        pnh_.param("planning_deadline", planning_deadline_, planning_deadline_);
+        pnh_.param("reuse_path", reuse_path_, reuse_path_);
+        pnh_.param("planning_threads", planning_threads_, planning_threads_);
+        pnh_.param("cost_matrix_threads", cost_matrix_threads_, cost_matrix_threads_);
+        pnh_.param("path_refresh_period", path_cache_.refresh_period_, path_cache_.refresh_period_);
+        pnh_.param("max_path_offset", path_cache_.max_offset_, path_cache_.max_offset_);
         pnh_.param("random_start", random_start_, random_start_);
         pnh_.param("plan_from_goal_dist", plan_from_goal_dist_, plan_from_goal_dist_);
         pnh_.param("bootstrap_z", bootstrap_z_, bootstrap_z_);
@@ -139,7 +325,19 @@ public:
         int num_input_clouds = 1;
         pnh_.param("num_input_clouds", num_input_clouds, num_input_clouds);
         pnh_.param("input_queue_size", queue_size_, queue_size_);
+        pnh_.param("async_pipeline", async_pipeline_, async_pipeline_);
+        pnh_.param("pipeline_queue_size", pipeline_queue_size_, pipeline_queue_size_);
+        pnh_.param("max_batch_clouds", update_batcher_.max_batch_clouds_, update_batcher_.max_batch_clouds_);
+        int max_batch_points = 0;
+        pnh_.param("max_batch_points", max_batch_points, max_batch_points);
+        if (max_batch_points > 0)
+        {
+            update_batcher_.max_batch_points_ = size_t(max_batch_points);
+        }
+        pnh_.param("max_batch_delay", update_batcher_.max_batch_delay_, update_batcher_.max_batch_delay_);
+        pnh_.param("max_update_load", update_batcher_.max_update_load_, update_batcher_.max_update_load_);
         pnh_.param("points_min_dist", map_.points_min_dist_, map_.points_min_dist_);
+        pnh_.param("range_step_filter", range_step_filter_, range_step_filter_);
 
         pnh_.param("min_empty_cos", map_.min_empty_cos_, map_.min_empty_cos_);
         pnh_.param("min_num_empty", map_.min_num_empty_, map_.min_num_empty_);
@@ -147,6 +345,22 @@ public:
         pnh_.param("max_occ_counter", map_.max_occ_counter_, map_.max_occ_counter_);
 
         pnh_.param("filter_robots", filter_robots_, filter_robots_);
+        std::string map_delta_fields = "coverage";
+        pnh_.param("map_delta_fields", map_delta_fields, map_delta_fields);
+        map_delta_fields_ = parse_map_delta_fields(map_delta_fields);
+        pnh_.param("map_delta_resolution", map_delta_resolution_, map_delta_resolution_);
+        pnh_.param("snapshot_path", snapshot_path_, snapshot_path_);
+        pnh_.param("snapshot_period", snapshot_period_, snapshot_period_);
+        pnh_.param("map_fields", map_fields_, map_fields_);
+        pnh_.param("map_publish_rate", map_publish_rate_, map_publish_rate_);
+        pnh_.param("paging_dir", map_pager_.dir_, map_pager_.dir_);
+        pnh_.param("paging_tile_size", map_pager_.tile_size_, map_pager_.tile_size_);
+        pnh_.param("paging_evict_distance", map_pager_.evict_distance_, map_pager_.evict_distance_);
+        pnh_.param("paging_load_distance", map_pager_.load_distance_, map_pager_.load_distance_);
+        pnh_.param("paging_period", paging_period_, paging_period_);
+        pnh_.param("compaction_period", compaction_period_, compaction_period_);
+        pnh_.param("min_removed_ratio", min_removed_ratio_, min_removed_ratio_);
+        pnh_.param("reorder_period", reorder_period_, reorder_period_);
 
         bool among_robots = std::find(robot_frames_.begin(), robot_frames_.end(), robot_frame_) != robot_frames_.end();
         if (!among_robots)
@@ -159,8 +373,11 @@ public:
             ROS_INFO("Robot frame: %s", f.c_str());
         }
 
-        viewpoints_.reserve(size_t(7200. * viewpoints_update_freq_) * 3);
-        other_viewpoints_.reserve(size_t(7200. * viewpoints_update_freq_) * 3 * robot_frames_.size());
+        viewpoints_.bin_size_ = viewpoints_bin_size_;
+        other_viewpoints_.bin_size_ = viewpoints_bin_size_;
+
+        // Load map snapshot before any input or request arrives.
+        snapshot_loaded_ = !snapshot_path_.empty() && load_map_snapshot(map_, snapshot_path_);
 
         tf_ = std::make_shared<tf2_ros::Buffer>(ros::Duration(30.0));
         tf_sub_ = std::make_shared<tf2_ros::TransformListener>(*tf_);
@@ -168,28 +385,43 @@ public:
         viewpoints_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("viewpoints", 5);
         other_viewpoints_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("other_viewpoints", 5);
         map_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("map", 5);
+        map_publisher_.start(map_pub_, map_frame_, MapPublisher<Map>::parse_fields(map_fields_), map_publish_rate_);
         updated_map_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("updated_map", 5);
         dirty_map_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("dirty_map", 5);
         map_diff_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("map_diff", 5);
         local_map_pub_ = nh_.advertise<sensor_msgs::PointCloud2>("local_map", 5);
         path_pub_ = nh_.advertise<nav_msgs::Path>("path", 5);
+        settled_ratio_pub_ = nh_.advertise<std_msgs::Float32>("settled_ratio", 5);
+        map_delta_pub_ = nh_.advertise<std_msgs::UInt8MultiArray>("map_delta", 50);
 
-        cloud_sub_ = nh_.subscribe("input_map", queue_size_, &Planner::cloud_received, this);
+        cloud_sub_ = nh_.subscribe("input_map", queue_size_, &PlannerK::cloud_received, this);
+        map_delta_sub_ = nh_.subscribe("input_map_delta", 50, &PlannerK::input_map_delta_received, this);
+        if (async_pipeline_)
+        {
+            start_pipeline();
+        }
+        if (update_batcher_.max_batch_clouds_ > 1)
+        {
+            batch_timer_ = nh_.createWallTimer(ros::WallDuration(update_batcher_.max_batch_delay_),
+                                               &PlannerK::flush_batch, this);
+            ROS_INFO("Updating map after up to %i merged clouds or %.2f s.",
+                     update_batcher_.max_batch_clouds_, update_batcher_.max_batch_delay_);
+        }
         for (int i = 0; i < num_input_clouds; ++i)
         {
             std::stringstream ss;
             ss << "input_cloud_" << i;
-//            auto sub = nh_.subscribe(ss.str(), queue_size_, &Planner::input_cloud_received, this);
-            auto sub = nh_.subscribe(ss.str(), queue_size_, &Planner::input_cloud_received_safe, this);
+//            auto sub = nh_.subscribe(ss.str(), queue_size_, &PlannerK::input_cloud_received, this);
+            auto sub = nh_.subscribe(ss.str(), queue_size_, &PlannerK::input_cloud_received_safe, this);
             input_cloud_subs_.push_back(sub);
         }
 
         viewpoints_update_timer_ = nh_.createTimer(ros::Rate(viewpoints_update_freq_),
-                                                   &Planner::gather_viewpoints, this);
+                                                   &PlannerK::gather_viewpoints, this);
         if (planning_freq_ > 0.f)
         {
             planning_timer_ = nh_.createTimer(ros::Rate(planning_freq_),
-                                              &Planner::planning_timer_cb, this);
+                                              &PlannerK::planning_timer_cb, this);
             ROS_INFO("Re-plan automatically at %.1f Hz using the last request.",
                      planning_freq_);
         }
@@ -199,9 +431,100 @@ public:
         }
 
         update_params_timer_ = nh_.createWallTimer(ros::WallDuration(2.0),
-                                                   &Planner::update_params, this);
+                                                   &PlannerK::update_params, this);
+
+        if (!snapshot_path_.empty() && snapshot_period_ > 0.)
+        {
+            snapshot_timer_ = nh_.createWallTimer(ros::WallDuration(snapshot_period_),
+                                                  &PlannerK::save_snapshot, this);
+            ROS_INFO("Save map snapshot to %s every %.1f s.", snapshot_path_.c_str(), snapshot_period_);
+        }
 
-        get_plan_service_ = nh_.advertiseService("get_plan", &Planner::plan, this);
+        if (compaction_period_ > 0.)
+        {
+            compaction_timer_ = nh_.createWallTimer(ros::WallDuration(compaction_period_),
+                                                    &PlannerK::compact_map, this);
+        }
+
+        if (reorder_period_ > 0.)
+        {
+            reorder_timer_ = nh_.createWallTimer(ros::WallDuration(reorder_period_),
+                                                 &PlannerK::reorder_map, this);
+        }
+
+        if (map_pager_.enabled() && paging_period_ > 0.)
+        {
+            map_pager_.start();
+            paging_timer_ = nh_.createWallTimer(ros::WallDuration(paging_period_),
+                                                &PlannerK::update_paging, this);
+            ROS_INFO("Page out map tiles of %.1f m beyond %.1f m into %s every %.1f s.",
+                     map_pager_.tile_size_, map_pager_.evict_distance_, map_pager_.dir_.c_str(), paging_period_);
+        }
+
+        // Planning requests may be served from dedicated threads, so that
+        // these do not wait for other callbacks or each other.
+        ros::NodeHandle plan_nh(nh_);
+        if (planning_threads_ > 0)
+        {
+            plan_nh.setCallbackQueue(&planning_queue_);
+            planning_spinner_.reset(new ros::AsyncSpinner(uint32_t(planning_threads_), &planning_queue_));
+            planning_spinner_->start();
+            ROS_INFO("Serving planning requests from %i threads.", planning_threads_);
+        }
+        get_plan_service_ = plan_nh.advertiseService("get_plan", &PlannerK::plan, this);
+        get_cost_matrix_service_ = plan_nh.advertiseService("get_cost_matrix", &PlannerK::get_cost_matrix, this);
+    }
+
+    void save_snapshot(const ros::WallTimerEvent& evt)
+    {
+        if (map_.empty())
+        {
+            return;
+        }
+        snapshot_writer_.save(map_, snapshot_path_);
+    }
+
+    void compact_map(const ros::WallTimerEvent& evt)
+    {
+        if (map_.empty())
+        {
+            return;
+        }
+        map_.compact(min_removed_ratio_);
+    }
+
+    void reorder_map(const ros::WallTimerEvent& evt)
+    {
+        // Skip reordering if no points were added since the last one.
+        const auto n = map_.size();
+        if (n == 0 || n == reordered_size_)
+        {
+            return;
+        }
+        map_.reorder(map_.points_min_dist_);
+        reordered_size_ = map_.size();
+    }
+
+    void update_paging(const ros::WallTimerEvent& evt)
+    {
+        if (map_.empty())
+        {
+            return;
+        }
+        CloudLock cloud_lock(map_.cloud_mutex_);
+        Lock index_lock(map_.index_mutex_);
+        Lock updated_lock(map_.updated_mutex_);
+        Lock dirty_lock(map_.dirty_mutex_);
+        // Paged points are not sent to other robots.
+        const auto n_updated = map_.updated_indices_.size();
+        map_pager_.update(map_);
+        map_publisher_.mark(map_.updated_indices_);
+        path_cache_.update(map_.updated_indices_);
+        if (collect_rewards_ && reward_method_ == "incremental")
+        {
+            reward_field_.update_points(map_.cloud_, map_.updated_indices_);
+        }
+        map_.updated_indices_.resize(n_updated);
     }
 
     void bootstrap_map()
@@ -221,8 +544,8 @@ public:
         Eigen::Isometry3f robot_to_map;
         try
         {
-            ros::Duration timeout(15.);
-            const auto cloud_to_map_tf = tf_->lookupTransform(map_frame_, robot_frame_, latest, timeout);
+            wait_for_transform(robot_frame_, 15.);
+            const auto cloud_to_map_tf = tf_->lookupTransform(map_frame_, robot_frame_, latest);
             robot_to_map = tf2::transformToEigen(cloud_to_map_tf.transform).cast<float>();
         }
         catch (const tf2::TransformException& ex)
@@ -274,6 +597,66 @@ public:
         return time_from_init(time.toSec());
     }
 
+    /// Update coverage from a batch of viewpoints and collect rewards around.
+    void update_rewards(const std::vector<Vec3>& positions, const std::vector<bool>& self)
+    {
+        CloudLock cloud_lock(map_.cloud_mutex_);
+        Lock index_lock(map_.index_mutex_);
+        // Contiguous copy of viewpoints for the queries.
+        std::vector<Value> buf;
+        for (const auto& pos: positions)
+        {
+            buf.insert(buf.end(), pos.data(), pos.data() + 3);
+        }
+        FMat queries(buf.data(), positions.size(), 3);
+
+        if (reward_method_ == "incremental")
+        {
+            // Only coverage within max_vp_distance_ changes,
+            // rewards around are updated from coverage changes.
+            RadiusQuery<Value> q(*map_.index_, queries, max_vp_distance_);
+            const auto updated = update_coverage(map_.cloud_, q.nn_, q.dist_, self,
+                                                 full_coverage_dist_, coverage_dist_spread_,
+                                                 max_vp_distance_);
+            reward_field_.add_new_points(map_.cloud_);
+            reward_field_.update_coverage(map_.cloud_, updated);
+            goal_candidates_.update(map_.cloud_, updated);
+            return;
+        }
+
+        RadiusQuery<Value> q(*map_.index_, queries, 2 * max_vp_distance_);
+        update_coverage(map_.cloud_, q.nn_, q.dist_, self,
+                        full_coverage_dist_, coverage_dist_spread_, max_vp_distance_);
+        // Collect rewards once for the union of neighborhoods.
+        std::vector<Index> indices;
+        for (const auto& nn: q.nn_)
+        {
+            indices.insert(indices.end(), nn.begin(), nn.end());
+        }
+        std::sort(indices.begin(), indices.end());
+        indices.erase(std::unique(indices.begin(), indices.end()), indices.end());
+        goal_candidates_.update(map_.cloud_, indices);
+
+        if (reward_method_ == "lut")
+        {
+            collect_rewards_lut(map_.cloud_, indices,
+                                full_coverage_dist_, coverage_dist_spread_, max_vp_distance_,
+                                self_factor_, suppress_base_reward_);
+        }
+        else if (reward_method_ == "fft")
+        {
+            collect_rewards_fft(map_.cloud_, indices,
+                                full_coverage_dist_, coverage_dist_spread_, max_vp_distance_,
+                                self_factor_, suppress_base_reward_, 0.5, size_t(max_fft_cells_));
+        }
+        else
+        {
+            collect_rewards(map_.cloud_, indices,
+                            full_coverage_dist_, coverage_dist_spread_, max_vp_distance_,
+                            self_factor_, suppress_base_reward_);
+        }
+    }
+
     void gather_viewpoints(const ros::TimerEvent& event)
     {
         ROS_DEBUG("Gathering viewpoints for %lu actors.", robot_frames_.size());
@@ -285,6 +668,9 @@ public:
         }
         // TODO: Gathering viewpoints are not necessary. Drop it?
         Lock lock(viewpoints_mutex_);
+        std::vector<Vec3> positions;
+        std::vector<bool> self_flags;
+        std::vector<Vec3> actor_positions;
         for (const auto& frame: robot_frames_)
         {
 //            const auto& frame = kv.second;
@@ -311,14 +697,15 @@ public:
                          Value(tf.transform.translation.y),
                          Value(tf.transform.translation.z));
 
+                actor_positions.push_back(pos);
                 bool self = (frame == robot_frame_);
                 if (self)
                 {
-                    viewpoints_.push_back(pos);
+                    viewpoints_.add(pos);
                 }
                 else
                 {
-                    other_viewpoints_.push_back(pos);
+                    other_viewpoints_.add(pos);
                 }
 
                 if (map_.empty())
@@ -326,24 +713,16 @@ public:
                     ROS_WARN("Empty map, no points updated from gathered viewpoints.");
                     continue;
                 }
-                Lock cloud_lock(map_.cloud_mutex_);
-                Lock index_lock(map_.index_mutex_);
-
                 if (collect_rewards_)
                 {
-                    RadiusQuery<Value> q1(*map_.index_, FMat(pos.data(), 1, 3), 2 * max_vp_distance_);
-
-                    std::vector<Vec3> vps = {pos};
-                    update_coverage(map_.cloud_, q1.nn_[0], vps,
-                                    full_coverage_dist_, coverage_dist_spread_, max_vp_distance_,
-                                    true, self);
-
-                    collect_rewards(map_.cloud_, q1.nn_[0],
-                                    full_coverage_dist_, coverage_dist_spread_, max_vp_distance_,
-                                    self_factor_, suppress_base_reward_);
+                    // Coverage and rewards are updated for all viewpoints at once below.
+                    positions.push_back(pos);
+                    self_flags.push_back(self);
                 }
                 else
                 {
+                    CloudLock cloud_lock(map_.cloud_mutex_);
+                    Lock index_lock(map_.index_mutex_);
                     RadiusQuery<Value> q(*map_.index_, FMat(pos.data(), 1, 3), max_vp_distance_);
                     assert(q.nn_.size() == 1);
                     assert(q.dist_.size() == 1);
@@ -371,6 +750,7 @@ public:
                             map_.cloud_[v].other_actors_last_visit_ = t;
                         }
                     }
+                    goal_candidates_.update(map_.cloud_, q.nn_[0]);
                 }
             }
             catch (const tf2::TransformException& ex)
@@ -380,12 +760,20 @@ public:
                 continue;
             }
         }
+        if (!positions.empty())
+        {
+            update_rewards(positions, self_flags);
+            map_publisher_.mark_all();
+        }
+        if (map_pager_.enabled() && !actor_positions.empty())
+        {
+            map_pager_.set_positions(actor_positions);
+        }
         auto now = ros::Time::now();
         if (viewpoints_pub_.getNumSubscribers() > 0)
         {
             sensor_msgs::PointCloud2 vp_cloud;
-            flann::Matrix<Elem> vp(viewpoints_.data()->data(), viewpoints_.size(), 3);
-            create_xyz_cloud(vp, vp_cloud);
+            viewpoints_.create_cloud(vp_cloud);
             vp_cloud.header.frame_id = map_frame_;
             vp_cloud.header.stamp = now;
             viewpoints_pub_.publish(vp_cloud);
@@ -393,8 +781,7 @@ public:
         if (other_viewpoints_pub_.getNumSubscribers() > 0)
         {
             sensor_msgs::PointCloud2 other_vp_cloud;
-            flann::Matrix<Elem> other_vp(other_viewpoints_.data()->data(), other_viewpoints_.size(), 3);
-            create_xyz_cloud(other_vp, other_vp_cloud);
+            other_viewpoints_.create_cloud(other_vp_cloud);
             other_vp_cloud.header.frame_id = map_frame_;
             other_vp_cloud.header.stamp = now;
             other_viewpoints_pub_.publish(other_vp_cloud);
@@ -478,56 +865,24 @@ public:
 
     Buffer<Elem> viewpoint_dist(const flann::Matrix<Elem>& points)
     {
-        Timer t;
-        Buffer<Elem> dist(points.rows);
-//        std::vector<Elem> vp_copy;
-        std::vector<Vec3> vp_copy;
+        Lock lock(viewpoints_mutex_);
+        if (viewpoints_.empty())
         {
-            Lock lock(viewpoints_mutex_);
-            if (viewpoints_.empty())
-            {
-                ROS_WARN("No viewpoints gathered. Return infinity.");
-                std::fill(dist.begin(), dist.end(), std::numeric_limits<Elem>::infinity());
-                return dist;
-            }
-            vp_copy = viewpoints_;
-        }
-        size_t n_vp = vp_copy.size() / 3;
-        ROS_INFO("Number of viewpoints: %lu.", n_vp);
-//        flann::Matrix<Elem> vp(vp_copy.data(), n_vp, 3);
-        flann::Matrix<Elem> vp(vp_copy.data()->data(), n_vp, 3);
-//            flann::Index<flann::L2_3D<Elem>> vp_index(vp, flann::KDTreeIndexParams(2));
-        flann::Index<flann::L2_3D<Elem>> vp_index(vp, flann::KDTreeSingleIndexParams());
-        vp_index.buildIndex();
-        Query<Elem> vp_query(vp_index, points, 1);
-        return vp_query.dist_buf_;
+            ROS_WARN("No viewpoints gathered. Return infinity.");
+        }
+        ROS_INFO("Number of viewpoints: %lu.", viewpoints_.size());
+        return viewpoints_.nearest_dist(points);
     }
 
     Buffer<Elem> other_viewpoint_dist(const flann::Matrix<Elem>& points)
     {
-        Timer t;
-        Buffer<Elem> dist(points.rows);
-//        std::vector<Elem> vp_copy;
-        std::vector<Vec3> vp_copy;
+        Lock lock(viewpoints_mutex_);
+        if (other_viewpoints_.empty())
         {
-            Lock lock(viewpoints_mutex_);
-            if (other_viewpoints_.empty())
-            {
-                ROS_WARN("No viewpoints gathered from other robots. Return infinity.");
-                std::fill(dist.begin(), dist.end(), std::numeric_limits<Elem>::infinity());
-                return dist;
-            }
-            vp_copy = other_viewpoints_;
-        }
-        size_t n_vp = vp_copy.size() / 3;
-        ROS_INFO("Number of viewpoints from other robots: %lu.", n_vp);
-//        flann::Matrix<Elem> vp(vp_copy.data(), n_vp, 3);
-        flann::Matrix<Elem> vp(vp_copy.data()->data(), n_vp, 3);
-//            flann::Index<flann::L2_3D<Elem>> vp_index(vp, flann::KDTreeIndexParams(2));
-        flann::Index<flann::L2_3D<Elem>> vp_index(vp, flann::KDTreeSingleIndexParams());
-        vp_index.buildIndex();
-        Query<Elem> vp_query(vp_index, points, 1);
-        return vp_query.dist_buf_;
+            ROS_WARN("No viewpoints gathered from other robots. Return infinity.");
+        }
+        ROS_INFO("Number of viewpoints from other robots: %lu.", other_viewpoints_.size());
+        return other_viewpoints_.nearest_dist(points);
     }
 
     void input_map_received(const sensor_msgs::PointCloud2& cloud)
@@ -552,21 +907,25 @@ public:
 //        flann::Matrix<Elem> points(points_buf.begin(), n_pts, 3);
 //        flann::Matrix<Elem> normals(normals_buf.begin(), n_pts, 3);
 //        ROS_INFO("Copy of %lu points and normals: %.3f s.", n_pts, t.seconds_elapsed());
-        Lock cloud_lock(map_.cloud_mutex_);
+        CloudLock cloud_lock(map_.cloud_mutex_);
         Lock index_lock(map_.index_mutex_);
         Lock dirty_lock(map_.dirty_mutex_);
 
         map_.cloud_.clear();
-        map_.graph_.clear();
+        map_.clear_graph();
         map_.clear_dirty();
+        reward_field_.clear();
+        goal_candidates_.clear();
+        path_cache_.clear();
 
         auto points = flann_matrix_view<Value>(const_cast<sensor_msgs::PointCloud2&>(cloud), position_name_, uint32_t(3));
 //        auto points = const_flann_matrix_view<Value>(cloud, position_name_, uint32_t(3));
-        Vec3 zero(0, 0, 0);
-//        Value* origin_ptr = viewpoints_.size() >= 3
-//                            ? viewpoints_.data()
-//                            : &zero(0);
-        Value* origin_ptr = !viewpoints_.empty() ? viewpoints_.data()->data() : zero.data();
+        Vec3 origin_pos(0, 0, 0);
+        {
+            Lock lock(viewpoints_mutex_);
+            viewpoints_.last(origin_pos);
+        }
+        Value* origin_ptr = origin_pos.data();
         flann::Matrix<Value> origin(origin_ptr, 1, 3);
         map_.initialize(points, origin);
         map_.update_dirty();
@@ -579,7 +938,79 @@ public:
         return std::isfinite(x) && std::isfinite(y) && std::isfinite(z);
     }
 
-    Value distance_reward(Value distance)
+    /// Rewarding point to consider as exploration goal, see goal_candidates.
+    bool goal_candidate(const Point& pt) const
+    {
+        if (!(pt.flags_ & STATIC) || !(pt.flags_ & TRAVERSABLE) || (pt.flags_ & EDGE)
+            || pt.num_edge_neighbors_ == 0)
+        {
+            return false;
+        }
+        if (collect_rewards_)
+        {
+            return pt.coverage_ < max_goal_coverage_;
+        }
+        return !(pt.dist_to_actor_ < min_vp_distance_);
+    }
+
+    /// Reward of a goal candidate, collected or from distances to actors.
+    Value goal_reward(Vertex v) const
+    {
+        const auto& pt = map_.cloud_[v];
+        if (collect_rewards_)
+        {
+            return pt.reward_;
+        }
+        Value reward = std::max(std::min(distance_reward(pt.dist_to_actor_),
+                                         distance_reward(pt.other_actors_last_visit_)),
+                                self_factor_ * distance_reward(pt.dist_to_actor_));
+        reward *= (1 + pt.num_edge_neighbors_);
+        // Decrease rewards in specific areas (staging area).
+        // TODO: Ensure correct frame (subt) is used here.
+        // TODO: Parametrize the areas.
+        return suppressed_reward(pt, reward);
+    }
+
+    /**
+     * Compute relative cost of a goal candidate.
+     *
+     * Reward, path cost and relative cost are also stored in the map for
+     * visualization, with atomic stores since concurrent requests may
+     * store them at the same time.
+     */
+    Value goal_cost(Vertex v, Value path_cost)
+    {
+        auto& pt = map_.cloud_[v];
+        Value reward = goal_reward(v);
+        if (!collect_rewards_)
+        {
+            __atomic_store(&pt.reward_, &reward, __ATOMIC_RELAXED);
+        }
+        // Keep original path cost, but discount for relative cost.
+        Value relative_cost = std::pow(path_cost, path_cost_pow_) / reward;
+        __atomic_store(&pt.path_cost_, &path_cost, __ATOMIC_RELAXED);
+        __atomic_store(&pt.relative_cost_, &relative_cost, __ATOMIC_RELAXED);
+        return relative_cost;
+    }
+
+    /// Traversable non-edge vertices within radius, the nearest first.
+    std::vector<Vertex> traversable_vertices(Value* position, Value radius)
+    {
+        ViewLock view_lock(map_.cloud_mutex_);
+        std::vector<Vertex> traversable;
+        for (const auto v: map_.nearby_indices(position, radius))
+        {
+            if (!(map_.cloud_[v].flags_ & TRAVERSABLE)
+                    || (map_.cloud_[v].flags_ & EDGE))
+            {
+                continue;
+            }
+            traversable.push_back(v);
+        }
+        return traversable;
+    }
+
+    Value distance_reward(Value distance) const
     {
         Value r = std::isfinite(distance) ? distance : max_vp_distance_;
         r = r >= min_vp_distance_ ? r : 0.f;
@@ -589,6 +1020,17 @@ public:
 
     bool plan(nav_msgs::GetPlanRequest& req, nav_msgs::GetPlanResponse& res)
     {
+        return plan_path(req, res, false);
+    }
+
+    /**
+     * Plan path for the request. With cache set, path planned from robot
+     * pose is kept to be reused by periodic replanning.
+     */
+    bool plan_path(nav_msgs::GetPlanRequest& req, nav_msgs::GetPlanResponse& res, bool cache)
+    {
+        // Planning deadline includes waiting for transforms and the map.
+        Timer t_request;
         Timer t;
         Timer t_part;
         {
@@ -607,8 +1049,10 @@ public:
             Lock lock(last_request_mutex_);
             last_request_ = req;
         }
+        path_cache_.clear();
 
         geometry_msgs::PoseStamped start = req.start;
+        bool from_robot = false;
         if (!valid_point(start.pose.position.x,
                          start.pose.position.y,
                          start.pose.position.z))
@@ -618,7 +1062,9 @@ public:
                 const auto tf = tf_->lookupTransform(map_frame_, robot_frame_,
                                                      ros::Time::now(), ros::Duration(5.));
                 transform_to_pose(tf, start);
+                from_robot = true;
                 // If the robot is near the previous goal, try to plan from this goal.
+                Lock lock(last_request_mutex_);
                 auto last_goal_valid = valid_point(last_goal_.pose.position.x,
                                                    last_goal_.pose.position.y,
                                                    last_goal_.pose.position.z);
@@ -631,6 +1077,7 @@ public:
                     if (dist < plan_from_goal_dist_)
                     {
                         start = last_goal_;
+                        from_robot = false;
                         ROS_INFO("Planning from previous goal [%.1f, %.1f, %.1f].",
                                  start.pose.position.x, start.pose.position.y, start.pose.position.z);
                     }
@@ -644,8 +1091,11 @@ public:
             }
         }
 
-        Lock cloud_lock(map_.cloud_mutex_);
-        Lock index_lock(map_.index_mutex_);
+        // Read-only map view, shared with concurrent planning requests.
+        // Map fields for visualization are written with atomic stores.
+        // Map updates wait for the view, which is held through graph search
+        // bounded by planning_deadline_ if positive.
+        ViewLock view_lock(map_.cloud_mutex_);
 
         t.reset();
 
@@ -660,35 +1110,12 @@ public:
         // TODO: Deal with occupancy on merging.
         // TODO: Index rebuild incrementally with new points.
 
-        // Create debug cloud for visualization of intermediate results.
-        sensor_msgs::PointCloud2 debug_cloud;
-//        map_.create_debug_cloud(debug_cloud);
-        map_.create_cloud_msg(debug_cloud);
-        debug_cloud.header.frame_id = map_frame_;
-        // TODO: Refresh on sending?
-        debug_cloud.header.stamp = ros::Time::now();
-        // Reconstruct original 2D shape.
-        debug_cloud.height = 1;
-        debug_cloud.width = uint32_t(map_.size());
-
         // Use the nearest traversable point to robot as the starting point.
         Vec3 start_position(Value(start.pose.position.x),
                             Value(start.pose.position.y),
                             Value(start.pose.position.z));
         Value start_tol = req.tolerance > 0. ? req.tolerance : neighborhood_radius_;
-        std::vector<Vertex> traversable;
-        {
-            Lock lock(map_.cloud_mutex_);
-            for (const auto v: map_.nearby_indices(start_position.data(), start_tol))
-            {
-                if (!(map_.cloud_[v].flags_ & TRAVERSABLE)
-                        || (map_.cloud_[v].flags_ & EDGE))
-                {
-                    continue;
-                }
-                traversable.push_back(v);
-            }
-        }
+        const auto traversable = traversable_vertices(start_position.data(), start_tol);
         if (traversable.empty())
         {
             ROS_ERROR("No traversable vertex found within %.1f m from [%.1f, %.1f, %.1f].",
@@ -723,15 +1150,52 @@ public:
         boost::typed_identity_property_map<Vertex> index_map;
 
         t_part.reset();
-        // TODO: Stop via exception if needed.
-        boost::dijkstra_shortest_paths_no_color_map(g, v_start,
-                                                    predecessor.data(), path_costs.data(), edge_costs,
-                                                    index_map,
-                                                    std::less<Value>(), boost::closed_plus<Value>(),
-                                                    std::numeric_limits<Value>::infinity(), Value(0.),
-                                                    boost::dijkstra_visitor<boost::null_visitor>());
-        ROS_INFO("Dijkstra (%u pts): %.3f s.",
-                 g.num_vertices(), t_part.seconds_elapsed());
+        if (planning_deadline_ > 0.)
+        {
+            // Anytime search, goals are selected from the settled region
+            // expanded in cost order until the deadline.
+            std::vector<uint8_t> settled(size_t(g.num_vertices()), 0);
+            size_t num_settled = 0;
+            bool stopped = false;
+            try
+            {
+                boost::dijkstra_shortest_paths_no_color_map(g, v_start,
+                                                            predecessor.data(), path_costs.data(), edge_costs,
+                                                            index_map,
+                                                            std::less<Value>(), boost::closed_plus<Value>(),
+                                                            std::numeric_limits<Value>::infinity(), Value(0.),
+                                                            DeadlineVisitor(t_request, planning_deadline_,
+                                                                            settled, num_settled));
+            }
+            catch (const SearchDeadline&)
+            {
+                stopped = true;
+                for (Vertex v = 0; v < path_costs.size(); ++v)
+                {
+                    if (!settled[v])
+                    {
+                        path_costs[v] = std::numeric_limits<Value>::infinity();
+                    }
+                }
+            }
+            std_msgs::Float32 settled_ratio;
+            settled_ratio.data = float(num_settled) / std::max(g.num_vertices(), Vertex(1));
+            settled_ratio_pub_.publish(settled_ratio);
+            ROS_DEBUG("Dijkstra (%u pts) %s, %lu pts (%.1f %%) settled: %.3f s.",
+                      g.num_vertices(), stopped ? "stopped at deadline" : "finished",
+                      num_settled, 100. * settled_ratio.data, t_part.seconds_elapsed());
+        }
+        else
+        {
+            boost::dijkstra_shortest_paths_no_color_map(g, v_start,
+                                                        predecessor.data(), path_costs.data(), edge_costs,
+                                                        index_map,
+                                                        std::less<Value>(), boost::closed_plus<Value>(),
+                                                        std::numeric_limits<Value>::infinity(), Value(0.),
+                                                        boost::dijkstra_visitor<boost::null_visitor>());
+            ROS_INFO("Dijkstra (%u pts): %.3f s.",
+                     g.num_vertices(), t_part.seconds_elapsed());
+        }
 
         // If planning for a given goal, return path to the closest reachable
         // point from the goal.
@@ -743,19 +1207,33 @@ public:
             Vec3 goal_position(Value(req.goal.pose.position.x),
                                Value(req.goal.pose.position.y),
                                Value(req.goal.pose.position.z));
+            // Distances through evicted parts of the map are estimated from
+            // tile summaries.
+            VoxelMap<int, Value> coarse_dist;
+            if (map_pager_.enabled() && map_pager_.evicted(goal_position.data()))
+            {
+                coarse_dist = map_pager_.coarse_distances(goal_position);
+                ROS_INFO("Goal [%.1f, %.1f, %.1f] in evicted map tile, using %lu coarse tile distances.",
+                         goal_position.x(), goal_position.y(), goal_position.z(), coarse_dist.size());
+            }
             Vertex v_goal = INVALID_VERTEX;
             Value best_dist = std::numeric_limits<Value>::infinity();
-            for (Index v = 0; v < path_costs.size(); ++v)
+            for (int coarse = coarse_dist.empty() ? 0 : 1; coarse >= 0 && v_goal == INVALID_VERTEX; --coarse)
             {
-                if (!std::isfinite(path_costs[v]))
+                for (Index v = 0; v < path_costs.size(); ++v)
                 {
-                    continue;
-                }
-                Value dist = (ConstVec3Map(map_.cloud_[v].position_) - goal_position).norm();
-                if (dist < best_dist)
-                {
-                    v_goal = v;
-                    best_dist = dist;
+                    if (!std::isfinite(path_costs[v]))
+                    {
+                        continue;
+                    }
+                    Value dist = coarse
+                                 ? map_pager_.coarse_distance(coarse_dist, map_.cloud_[v].position_)
+                                 : (ConstVec3Map(map_.cloud_[v].position_) - goal_position).norm();
+                    if (dist < best_dist)
+                    {
+                        v_goal = v;
+                        best_dist = dist;
+                    }
                 }
             }
             if (v_goal == INVALID_VERTEX)
@@ -771,6 +1249,15 @@ public:
             res.plan.header.stamp = ros::Time::now();
             res.plan.poses.push_back(start);
             append_path(path_indices, map_.cloud_, res.plan);
+            if (cache && from_robot)
+            {
+                cache_path(path_indices, path_costs, res.plan);
+            }
+            if (map_pager_.enabled())
+            {
+                // Page in tiles toward the goal as the robot approaches them.
+                map_pager_.set_goal(ConstVec3Map(map_.cloud_[v_goal].position_));
+            }
             ROS_INFO("Path with %lu poses toward fixed goal [%.1f, %.1f, %.1f] planned "
                      "(t_part.seconds_elapsed(), %.3f s).",
                      res.plan.poses.size(),
@@ -781,49 +1268,48 @@ public:
 
         // TODO: Account for time to enable patrolling (coverage half-life).
         Vertex v_goal = INVALID_VERTEX;
-        for (Vertex v = 0; v < path_costs.size(); ++v)
+        Value goal_relative_cost = std::numeric_limits<Value>::quiet_NaN();
+        if (use_goal_candidates_)
         {
-            if (!collect_rewards_)
+            // Score only cluster representatives, other points keep their
+            // costs from the last full pass.
+            std::vector<Index> scored;
+            const auto best = goal_candidates_.select(map_.cloud_, [&](Index v)
             {
-                map_.cloud_[v].reward_ = std::max(std::min(distance_reward(map_.cloud_[v].dist_to_actor_),
-                                                           distance_reward(map_.cloud_[v].other_actors_last_visit_)),
-                                                  self_factor_ * distance_reward(map_.cloud_[v].dist_to_actor_));
-                map_.cloud_[v].reward_ *= (1 + map_.cloud_[v].num_edge_neighbors_);
-                // Decrease rewards in specific areas (staging area).
-                // TODO: Ensure correct frame (subt) is used here.
-                // TODO: Parametrize the areas.
-                suppress_reward(map_.cloud_[v]);
-            }
-
-            // Keep original path cost, but discount for relative cost.
-//            map_.cloud_[v].path_cost_ = std::isfinite(path_costs[v])
-//                                        ? path_costs[v]
-//                                        : std::numeric_limits<Value>::quiet_NaN();
-            map_.cloud_[v].path_cost_ = path_costs[v];
-            map_.cloud_[v].relative_cost_ = std::pow(map_.cloud_[v].path_cost_, path_cost_pow_)
-                                            / map_.cloud_[v].reward_;
-            // Prefer longer feasible paths, with lowest relative costs.
-            if (std::isfinite(map_.cloud_[v].path_cost_)
-                && map_.cloud_[v].path_cost_ >= min_path_cost_
-                && (v_goal == INVALID_VERTEX
-//                    ||  (map_.cloud_[v_goal].path_cost_ < min_path_cost_
-//                         && map_.cloud_[v].path_cost_ >= min_path_cost_)
-                    || map_.cloud_[v].relative_cost_ < map_.cloud_[v_goal].relative_cost_))
+                const Value relative_cost = goal_cost(Vertex(v), path_costs[v]);
+                scored.push_back(v);
+                return std::isfinite(path_costs[v]) && path_costs[v] >= min_path_cost_
+                       ? relative_cost
+                       : std::numeric_limits<Value>::quiet_NaN();
+            });
+            map_publisher_.mark(scored);
+            if (!invalid_index(best))
             {
-                v_goal = v;
+                v_goal = Vertex(best);
+                goal_relative_cost = goal_cost(v_goal, path_costs[v_goal]);
             }
+            ROS_INFO("Goal selected among %lu candidates in %lu clusters (%.3f s).",
+                     goal_candidates_.size(), goal_candidates_.num_clusters(), t_part.seconds_elapsed());
         }
-
-        if (map_pub_.getNumSubscribers() > 0)
+        if (v_goal == INVALID_VERTEX)
         {
-            Timer t_send;
-            sensor_msgs::PointCloud2 map_cloud;
-            map_cloud.header.frame_id = map_frame_;
-            map_cloud.header.stamp = ros::Time::now();
-//            Lock lock(map_.cloud_mutex_);
-            map_.create_cloud_msg(map_cloud);
-            map_pub_.publish(map_cloud);
-            ROS_DEBUG("Sending map: %.3f s.", t_send.seconds_elapsed());
+            for (Vertex v = 0; v < path_costs.size(); ++v)
+            {
+                const Value relative_cost = goal_cost(v, path_costs[v]);
+                // Prefer longer feasible paths, with lowest relative costs.
+                if (std::isfinite(path_costs[v])
+                    && path_costs[v] >= min_path_cost_
+                    && (v_goal == INVALID_VERTEX
+//                        ||  (path_costs[v_goal] < min_path_cost_
+//                             && path_costs[v] >= min_path_cost_)
+                        || relative_cost < goal_relative_cost))
+                {
+                    v_goal = v;
+                    goal_relative_cost = relative_cost;
+                }
+            }
+            // Path costs and rewards changed everywhere.
+            map_publisher_.mark_all();
         }
 
         if (v_goal == INVALID_VERTEX)
@@ -842,24 +1328,134 @@ public:
         res.plan.poses.push_back(start);
 //            append_path(path_indices, points, normals, res.plan);
         append_path(path_indices, map_.cloud_, res.plan);
+        if (cache && from_robot)
+        {
+            cache_path(path_indices, path_costs, res.plan);
+        }
         if (!res.plan.poses.empty())
         {
+            Lock lock(last_request_mutex_);
             last_start_ = res.plan.poses.front();
             last_goal_ = res.plan.poses.back();
         }
+        if (map_pager_.enabled())
+        {
+            map_pager_.set_goal(ConstVec3Map(map_.cloud_[v_goal].position_));
+        }
         ROS_INFO("Path with %lu poses to goal [%.1f, %.1f, %.1f] "
                  "has cost %.3f, reward %.3f, relative cost %.3f (%.3f s).",
                  res.plan.poses.size(),
                  map_.cloud_[v_goal].position_[0],
                  map_.cloud_[v_goal].position_[1],
                  map_.cloud_[v_goal].position_[2],
-                 map_.cloud_[v_goal].path_cost_,
-                 map_.cloud_[v_goal].reward_,
-                 map_.cloud_[v_goal].relative_cost_,
+                 path_costs[v_goal],
+                 goal_reward(v_goal),
+                 goal_relative_cost,
                  t.seconds_elapsed());
         return true;
     }
 
+    /**
+     * Path costs between many starts and goals, e.g., for task allocation.
+     *
+     * One search is run per start, in parallel from cost_matrix_threads_.
+     * Each search holds its own read-only map view, shared with other planning
+     * requests, so that map updates can proceed between searches.
+     */
+    bool get_cost_matrix(GetCostMatrixRequest& req, GetCostMatrixResponse& res)
+    {
+        Timer t;
+        {
+            Lock lock(initialized_mutex_);
+            if (!initialized_)
+            {
+                ROS_WARN("Won't plan. Waiting for initialization.");
+                return false;
+            }
+        }
+        const size_t min_map_points = Neighborhood::K_NEIGHBORS;
+        {
+            ViewLock view_lock(map_.cloud_mutex_);
+            if (map_.size() < min_map_points)
+            {
+                ROS_ERROR("Cannot plan in map with %lu < %lu points.",
+                          map_.size(), min_map_points);
+                return false;
+            }
+        }
+
+        // Snap starts and goals to the nearest traversable points.
+        const Value tol = req.tolerance > 0. ? req.tolerance : neighborhood_radius_;
+        auto nearest = [this, tol](const geometry_msgs::PoseStamped& pose)
+        {
+            Vec3 position(Value(pose.pose.position.x),
+                          Value(pose.pose.position.y),
+                          Value(pose.pose.position.z));
+            const auto traversable = traversable_vertices(position.data(), tol);
+            return traversable.empty() ? INVALID_VERTEX : traversable[0];
+        };
+
+        const size_t n = req.starts.size();
+        const size_t m = req.goals.size();
+        res.costs.assign(n * m, std::numeric_limits<Value>::infinity());
+        if (req.return_paths)
+        {
+            res.paths.assign(n * m, nav_msgs::Path());
+        }
+        const auto stamp = ros::Time::now();
+        #pragma omp parallel for schedule(dynamic) num_threads(std::max(cost_matrix_threads_, 1))
+        for (size_t i = 0; i < n; ++i)
+        {
+            // Map indices are valid only within the view, points are snapped
+            // again for each start.
+            ViewLock view_lock(map_.cloud_mutex_);
+            const Vertex start = nearest(req.starts[i]);
+            if (start == INVALID_VERTEX)
+            {
+                continue;
+            }
+            std::vector<Vertex> goals;
+            for (const auto& pose: req.goals)
+            {
+                goals.push_back(nearest(pose));
+            }
+            Graph g(map_);
+            EdgeCosts edge_costs(map_);
+            std::vector<Vertex> predecessor(size_t(g.num_vertices()), INVALID_VERTEX);
+            std::vector<Value> path_costs(size_t(g.num_vertices()), std::numeric_limits<Value>::infinity());
+            boost::typed_identity_property_map<Vertex> index_map;
+            boost::dijkstra_shortest_paths_no_color_map(g, start,
+                                                        predecessor.data(), path_costs.data(), edge_costs,
+                                                        index_map,
+                                                        std::less<Value>(), boost::closed_plus<Value>(),
+                                                        std::numeric_limits<Value>::infinity(), Value(0.),
+                                                        boost::dijkstra_visitor<boost::null_visitor>());
+            for (size_t j = 0; j < m; ++j)
+            {
+                if (goals[j] == INVALID_VERTEX || !std::isfinite(path_costs[goals[j]]))
+                {
+                    continue;
+                }
+                res.costs[i * m + j] = path_costs[goals[j]];
+                if (req.return_paths)
+                {
+                    std::vector<Vertex> path_indices;
+                    trace_path_indices(start, goals[j], predecessor.data(), path_indices);
+                    auto& path = res.paths[i * m + j];
+                    path.header.frame_id = map_frame_;
+                    path.header.stamp = stamp;
+                    path.poses.push_back(req.starts[i]);
+                    append_path(path_indices, map_.cloud_, path);
+                }
+            }
+        }
+        const auto n_valid = std::count_if(res.costs.begin(), res.costs.end(),
+                                           [](Value c) { return std::isfinite(c); });
+        ROS_INFO("Cost matrix %lu x %lu with %li reachable pairs computed (%.3f s).",
+                 n, m, long(n_valid), t.seconds_elapsed());
+        return true;
+    }
+
     void cloud_received(const sensor_msgs::PointCloud2::ConstPtr& cloud)
     {
         ROS_INFO("Cloud received (%u points).", cloud->height * cloud->width);
@@ -933,6 +1529,47 @@ public:
 //            plan(*cloud, start);
     }
 
+    void cache_path(const std::vector<Vertex>& path_indices, const std::vector<Value>& path_costs,
+                    const nav_msgs::Path& path)
+    {
+        if (!reuse_path_)
+        {
+            return;
+        }
+        std::vector<Value> costs;
+        costs.reserve(path_indices.size());
+        for (const auto v: path_indices)
+        {
+            costs.push_back(path_costs[v]);
+        }
+        path_cache_.set(path_indices, costs, path, ros::Time::now().toSec());
+    }
+
+    /// Reuse the rest of the last path if it is still valid.
+    bool reuse_path(const nav_msgs::GetPlanRequest& req, nav_msgs::GetPlanResponse& res)
+    {
+        // Only paths planned from robot position follow the robot.
+        if (!reuse_path_
+            || !path_cache_.valid()
+            || valid_point(req.start.pose.position.x, req.start.pose.position.y, req.start.pose.position.z))
+        {
+            return false;
+        }
+        geometry_msgs::PoseStamped robot;
+        try
+        {
+            const auto tf = tf_->lookupTransform(map_frame_, robot_frame_, ros::Time());
+            transform_to_pose(tf, robot);
+        }
+        catch (const tf2::TransformException& ex)
+        {
+            ROS_WARN("Could not get robot %s position in map %s: %s.",
+                     robot_frame_.c_str(), map_frame_.c_str(), ex.what());
+            return false;
+        }
+        return path_cache_.reuse(robot, ros::Time::now().toSec(), res.plan);
+    }
+
     void planning_timer_cb(const ros::TimerEvent& event)
     {
         ROS_DEBUG("Planning timer callback.");
@@ -943,7 +1580,14 @@ public:
             req = last_request_;
         }
         nav_msgs::GetPlanResponse res;
-        if (!plan(req, res))
+        if (reuse_path(req, res))
+        {
+            path_pub_.publish(res.plan);
+            ROS_DEBUG("Reusing robot %s path (%lu poses) in map %s: %.6f s.",
+                      robot_frame_.c_str(), res.plan.poses.size(), map_frame_.c_str(), t.seconds_elapsed());
+            return;
+        }
+        if (!plan_path(req, res, true))
         {
             return;
         }
@@ -1002,28 +1646,6 @@ public:
         }
     }
 
-    void send_cloud(ros::Publisher& pub, const ros::Time& stamp = ros::Time(0), bool force = false)
-    {
-        if (force || pub.getNumSubscribers() > 0)
-        {
-            Timer t;
-            sensor_msgs::PointCloud2 cloud;
-            cloud.header.frame_id = map_frame_;
-            cloud.header.stamp = stamp.toNSec() == 0 ? ros::Time::now() : stamp;
-            map_.create_cloud_msg(cloud);
-            if (cloud.height * cloud.width > 0)
-            {
-                pub.publish(cloud);
-                ROS_DEBUG("Sending cloud %s: %.3f s.", pub.getTopic().c_str(), t.seconds_elapsed());
-            }
-        }
-    }
-
-    void send_map(const ros::Time& stamp = ros::Time(0), bool force = false)
-    {
-        send_cloud(map_pub_, stamp, force);
-    }
-
     template<typename C>
     void send_cloud(ros::Publisher& pub, const C& indices, const ros::Time& stamp = ros::Time(0), bool force = false)
     {
@@ -1036,7 +1658,7 @@ public:
             cloud.header.frame_id = map_frame_;
             cloud.header.stamp = stamp.toNSec() == 0 ? ros::Time::now() : stamp;
 //            {
-//                Lock cloud_lock(map_.cloud_mutex_);
+//                CloudLock cloud_lock(map_.cloud_mutex_);
 //                Lock index_lock(map_.index_mutex_);
                 map_.create_cloud_msg(indices, cloud);
 //            }
@@ -1049,7 +1671,7 @@ public:
     {
         if (force || dirty_map_pub_.getNumSubscribers() > 0)
         {
-            Lock cloud_lock(map_.cloud_mutex_);
+            CloudLock cloud_lock(map_.cloud_mutex_);
             Lock index_lock(map_.index_mutex_);
             Lock updated_lock(map_.updated_mutex_);
             Lock dirty_lock(map_.dirty_mutex_);
@@ -1061,91 +1683,335 @@ public:
     {
         if (force || updated_map_pub_.getNumSubscribers() > 0)
         {
-            Lock cloud_lock(map_.cloud_mutex_);
+            CloudLock cloud_lock(map_.cloud_mutex_);
             Lock index_lock(map_.index_mutex_);
             Lock updated_lock(map_.updated_mutex_);
             send_cloud(updated_map_pub_, map_.updated_indices_, stamp, force);
         }
     }
 
-    void send_local_map(Value* origin, const ros::Time& stamp = ros::Time(0), bool force = false)
+    /// Publish added and removed points since the last update as a compact delta.
+    void send_map_delta()
     {
-        if (force || local_map_pub_.getNumSubscribers() > 0)
+        if (map_delta_pub_.getNumSubscribers() == 0)
         {
-            const auto indices = map_.nearby_indices(origin, input_range_);
-            send_cloud(local_map_pub_, indices, stamp, force);
+            return;
         }
+        Timer t;
+        MapDelta delta;
+        delta.sender_ = robot_frame_;
+        delta.fields_ = map_delta_fields_;
+        delta.resolution_ = map_delta_resolution_;
+        {
+            CloudLock cloud_lock(map_.cloud_mutex_);
+            Lock updated_lock(map_.updated_mutex_);
+            if (map_.updated_indices_.empty())
+            {
+                return;
+            }
+            delta.seq_ = map_delta_seq_++;
+            for (const auto i: map_.updated_indices_)
+            {
+                delta.push_back(map_.cloud_[i]);
+            }
+        }
+        std_msgs::UInt8MultiArray msg;
+        MapDeltaCodec::encode(delta, msg.data);
+        map_delta_pub_.publish(msg);
+        ROS_DEBUG("Map delta %u with %lu points sent in %lu bytes (%.3f s).",
+                  delta.seq_, delta.size(), msg.data.size(), t.seconds_elapsed());
     }
 
-    void input_cloud_received(const sensor_msgs::PointCloud2::ConstPtr& input)
+    /// Merge map delta from another robot.
+    void input_map_delta_received(const std_msgs::UInt8MultiArray::ConstPtr& msg)
     {
-        const auto age = (ros::Time::now() - input->header.stamp).toSec();
-        if (age > max_cloud_age_)
         {
-            ROS_INFO("Skipping old input cloud from %s, age %.1f s > %.1f s.",
-                     input->header.frame_id.c_str(), age, max_cloud_age_);
+            Lock lock(initialized_mutex_);
+            if (!initialized_)
+            {
+                ROS_INFO("Skipping map delta. Waiting for initialization.");
+                return;
+            }
+        }
+        Timer t;
+        MapDelta delta;
+        if (!MapDeltaCodec::decode(msg->data, delta))
+        {
+            ROS_WARN("Invalid map delta with %lu bytes received.", msg->data.size());
             return;
         }
+        if (delta.sender_ == robot_frame_)
+        {
+            return;
+        }
+        {
+            Lock lock(map_delta_mutex_);
+            const auto it = map_delta_last_seq_.find(delta.sender_);
+            if (it != map_delta_last_seq_.end() && delta.seq_ != it->second + 1)
+            {
+                ROS_WARN("Map delta from %s: expected %u, received %u.",
+                         delta.sender_.c_str(), it->second + 1, delta.seq_);
+            }
+            map_delta_last_seq_[delta.sender_] = delta.seq_;
+        }
 
-        check_initialized();
-        sensor_msgs::PointCloud2 step_filtered;
+        std::vector<Value> added;
+        std::vector<Value> added_coverage;
+        std::vector<Value> removed;
+        for (size_t i = 0; i < delta.size(); ++i)
+        {
+            auto& dst = (delta.flags_[i] & STATIC) ? added : removed;
+            dst.insert(dst.end(), &delta.positions_[3 * i], &delta.positions_[3 * i] + 3);
+            if ((delta.flags_[i] & STATIC) && (delta.fields_ & DELTA_COVERAGE))
+            {
+                added_coverage.push_back(delta.coverage_[i]);
+            }
+        }
+        flann::Matrix<Elem> added_mat(added.data(), added.size() / 3, 3);
+        flann::Matrix<Elem> removed_mat(removed.data(), removed.size() / 3, 3);
+        Vec3 origin(0, 0, 0);
+        flann::Matrix<Elem> origin_mat(origin.data(), 1, 3);
+
+        CloudLock cloud_lock(map_.cloud_mutex_);
+        Lock index_lock(map_.index_mutex_);
+        Lock updated_lock(map_.updated_mutex_);
+        Lock dirty_lock(map_.dirty_mutex_);
+        // Changes from other robots are not sent again.
+        const auto n_updated = map_.updated_indices_.size();
+        map_.remove_near(removed_mat, map_.points_min_dist_);
+        if (added_mat.rows > 0)
+        {
+            map_.merge(added_mat, origin_mat);
+            if (!added_coverage.empty())
+            {
+                map_.merge_coverage(added_mat, added_coverage.data(), map_.points_min_dist_);
+            }
+        }
+        map_.update_dirty();
+        map_publisher_.mark(map_.dirty_indices_);
+        map_.clear_dirty();
+        map_publisher_.mark(map_.updated_indices_);
+        path_cache_.update(map_.updated_indices_);
+        if (collect_rewards_ && reward_method_ == "incremental")
+        {
+            reward_field_.update_points(map_.cloud_, map_.updated_indices_);
+        }
+        map_.updated_indices_.resize(n_updated);
+        ROS_INFO("Map delta %u from %s merged, %lu added, %lu removed (%.3f s).",
+                 delta.seq_, delta.sender_.c_str(), size_t(added_mat.rows), size_t(removed_mat.rows),
+                 t.seconds_elapsed());
+    }
+
+    void send_local_map(Value* origin, const ros::Time& stamp = ros::Time(0), bool force = false)
+    {
+        if (force || local_map_pub_.getNumSubscribers() > 0)
+        {
+            const auto indices = map_.nearby_indices(origin, input_range_);
+            send_cloud(local_map_pub_, indices, stamp, force);
+        }
+    }
+
+    /// Subsample input cloud, look up its transform and filter it.
+    void preprocess_scan(ScanBatch::Scan& scan)
+    {
+        const auto& input = scan.input_;
         StepFilter step_filter(1024, 1024);
-        step_filter.filter(*input, step_filtered);
+        step_filter.filter(*input, scan.organized_);
 
         Timer t_tf;
         double wait = std::max(5.0 - (ros::Time::now() - input->header.stamp).toSec(), 0.0);
-        geometry_msgs::TransformStamped cloud_to_map;
-        cloud_to_map = tf_->lookupTransform(map_frame_, input->header.frame_id, input->header.stamp,
-                                            ros::Duration(wait));
+        scan.cloud_to_map_ = tf_->lookupTransform(map_frame_, input->header.frame_id, input->header.stamp,
+                                                  ros::Duration(wait));
         ROS_DEBUG("Had to wait %.3f s for input cloud transform.", t_tf.seconds_elapsed());
 
-        Eigen::Isometry3f transform(tf2::transformToEigen(cloud_to_map.transform));
+        Eigen::Isometry3f transform(tf2::transformToEigen(scan.cloud_to_map_.transform));
+        scan.origin_ = transform.translation();
 
-        // TODO: Update map occupancy based on reconstructed surface of 2D cloud.
-        if (step_filtered.height > 1 && step_filtered.width > 1)
-        {
-            map_.update_occupancy_projection(step_filtered, cloud_to_map.transform);
-        }
-        else
+        Timer t_filter;
+        FilterChain<sensor_msgs::PointCloud2>::Filters filters;
+        if (range_step_filter_)
         {
-            ROS_WARN("Cannot update occupancy using unstructured point cloud.");
+            // Thin near points before voxel filter, keep full cloud for occupancy.
+            filters.push_back(std::make_shared<RangeStepFilter>("x", map_.points_min_dist_, map_.projections_));
         }
-
-        Timer t_filter;
-        FilterChain<sensor_msgs::PointCloud2>::Filters filters{
+        filters.insert(filters.end(), {
             std::make_shared<VoxelFilter<float, int>>("x", map_.points_min_dist_),
             std::make_shared<RangeFilter<float>>("x", 1.f, input_range_),
             std::make_shared<ExcludeFramesFilter<float>>("x", robot_frames_, 1.f, tf_, ros::Duration(3.0)),
             std::make_shared<FilterFromProcessor<sensor_msgs::PointCloud2>>(
                 std::make_shared<TransformProcessor<float>>("x", map_frame_, tf_, ros::Duration(3.0)))
-        };
+        });
         FilterChain<sensor_msgs::PointCloud2> chain(filters);
-
-        auto cloud = std::make_shared<sensor_msgs::PointCloud2>();
-        chain.filter(step_filtered, *cloud);
+        chain.filter(scan.organized_, scan.cloud_);
         ROS_INFO("%lu filters applied (%.3f s).", filters.size(), t_filter.seconds_elapsed());
+    }
 
-        Vec3 origin = transform.translation();
-        flann::Matrix<Elem> origin_mat(origin.data(), 1, 3);
+    void update_scan_occupancy(const ScanBatch::Scan& scan)
+    {
+        // TODO: Update map occupancy based on reconstructed surface of 2D cloud.
+        if (scan.organized_.height > 1 && scan.organized_.width > 1)
+        {
+            map_.update_occupancy_projection(scan.organized_, scan.cloud_to_map_.transform);
+        }
+        else
+        {
+            ROS_WARN("Cannot update occupancy using unstructured point cloud.");
+        }
+    }
 
-        const auto points = flann_matrix_view<float>(*cloud, "x", 3);
+    void merge_scan(ScanBatch::Scan& scan)
+    {
+        flann::Matrix<Elem> origin_mat(scan.origin_.data(), 1, 3);
+        const auto points = flann_matrix_view<float>(scan.cloud_, "x", 3);
+        CloudLock cloud_lock(map_.cloud_mutex_);
+        Lock index_lock(map_.index_mutex_);
+        Lock added_lock(map_.updated_mutex_);
+        Lock lock_dirty(map_.dirty_mutex_);
+        map_.merge(points, origin_mat);
+    }
 
-        Lock cloud_lock(map_.cloud_mutex_);
+    /// Update dirty points and send changes.
+    void update_map(const ros::Time& stamp)
+    {
+        CloudLock cloud_lock(map_.cloud_mutex_);
         Lock index_lock(map_.index_mutex_);
-        {
-            Lock added_lock(map_.updated_mutex_);
-            Lock lock_dirty(map_.dirty_mutex_);
-            map_.merge(points, origin_mat);
-            map_.update_dirty();
+        Lock added_lock(map_.updated_mutex_);
+        Lock lock_dirty(map_.dirty_mutex_);
+        map_.update_dirty();
 //            ROS_INFO("Input cloud with %u points merged: %.3f s.", n_added, t.seconds_elapsed());
-            // TODO: Mark affected map points for update?
-            send_dirty_cloud(cloud->header.stamp);
-            map_.clear_dirty();
-            send_updated_cloud(cloud->header.stamp);
-            map_.clear_updated();
-        }
-        send_local_map(origin.data(), cloud->header.stamp);
-        send_map(cloud->header.stamp);
+        // TODO: Mark affected map points for update?
+        map_publisher_.mark(map_.dirty_indices_);
+        map_publisher_.mark(map_.updated_indices_);
+        path_cache_.update(map_.updated_indices_);
+        send_dirty_cloud(stamp);
+        map_.clear_dirty();
+        send_updated_cloud(stamp);
+        send_map_delta();
+        if (collect_rewards_ && reward_method_ == "incremental")
+        {
+            reward_field_.update_points(map_.cloud_, map_.updated_indices_);
+        }
+        map_.clear_updated();
+    }
+
+    /// Update map once enough merged clouds are pending, see UpdateBatcher.
+    void update_map_batched(const std::vector<ScanBatch::Scan>& scans)
+    {
+        size_t num_points = 0;
+        for (const auto& scan: scans)
+        {
+            num_points += size_t(scan.cloud_.height) * scan.cloud_.width;
+        }
+        if (update_batcher_.add(ros::WallTime::now().toSec(), scans.size(), num_points))
+        {
+            Timer t;
+            update_map(scans.back().cloud_.header.stamp);
+            update_batcher_.updated(t.seconds_elapsed());
+        }
+    }
+
+    /// Update map if pending clouds waited too long for the next one.
+    void flush_batch(const ros::WallTimerEvent& evt)
+    {
+        if (update_batcher_.due(ros::WallTime::now().toSec()))
+        {
+            Timer t;
+            update_map(ros::Time::now());
+            update_batcher_.updated(t.seconds_elapsed());
+        }
+    }
+
+    void input_cloud_received(const sensor_msgs::PointCloud2::ConstPtr& input)
+    {
+        const auto age = (ros::Time::now() - input->header.stamp).toSec();
+        if (age > max_cloud_age_)
+        {
+            ROS_INFO("Skipping old input cloud from %s, age %.1f s > %.1f s.",
+                     input->header.frame_id.c_str(), age, max_cloud_age_);
+            return;
+        }
+
+        check_initialized();
+        if (async_pipeline_)
+        {
+            auto batch = std::make_shared<ScanBatch>();
+            batch->scans_.emplace_back();
+            batch->scans_.back().input_ = input;
+            pipeline_->push(batch);
+            return;
+        }
+
+        std::vector<ScanBatch::Scan> scans(1);
+        auto& scan = scans.front();
+        scan.input_ = input;
+        preprocess_scan(scan);
+        update_scan_occupancy(scan);
+        {
+            CloudLock cloud_lock(map_.cloud_mutex_);
+            Lock index_lock(map_.index_mutex_);
+            merge_scan(scan);
+            update_map_batched(scans);
+        }
+        send_local_map(scan.origin_.data(), scan.cloud_.header.stamp);
+    }
+
+    /// Run input cloud processing in separate stages with their own threads.
+    /// Scans are coalesced into batches if a stage falls behind.
+    void start_pipeline()
+    {
+        pipeline_.reset(new Pipeline<ScanBatchPtr>(size_t(std::max(pipeline_queue_size_, 1)),
+                                                   [](ScanBatchPtr& queued, ScanBatchPtr&& batch)
+                                                   {
+                                                       queued->append(*batch);
+                                                   }));
+        pipeline_->add_stage("preprocess", [this](ScanBatchPtr& batch)
+        {
+            auto& scans = batch->scans_;
+            for (auto it = scans.begin(); it != scans.end(); )
+            {
+                try
+                {
+                    preprocess_scan(*it);
+                    ++it;
+                }
+                catch (const tf2::TransformException& ex)
+                {
+                    ROS_ERROR("Could not transform input cloud from %s to %s: %s.",
+                              it->input_->header.frame_id.c_str(), map_frame_.c_str(), ex.what());
+                    it = scans.erase(it);
+                }
+            }
+            return !scans.empty();
+        });
+        pipeline_->add_stage("occupancy", [this](ScanBatchPtr& batch)
+        {
+            for (const auto& scan: batch->scans_)
+            {
+                update_scan_occupancy(scan);
+            }
+            return true;
+        });
+        pipeline_->add_stage("merge", [this](ScanBatchPtr& batch)
+        {
+            for (auto& scan: batch->scans_)
+            {
+                merge_scan(scan);
+            }
+            return true;
+        });
+        pipeline_->add_stage("update", [this](ScanBatchPtr& batch)
+        {
+            update_map_batched(batch->scans_);
+            return true;
+        });
+        pipeline_->add_stage("publish", [this](ScanBatchPtr& batch)
+        {
+            auto& scan = batch->scans_.back();
+            send_local_map(scan.origin_.data(), scan.cloud_.header.stamp);
+            return true;
+        });
+        pipeline_->start();
+        ROS_INFO("Input clouds processed in a pipeline with queues of size %i.", pipeline_queue_size_);
     }
 
     void input_cloud_received_safe(const sensor_msgs::PointCloud2::ConstPtr& input)
@@ -1186,9 +2052,13 @@ protected:
     std::shared_ptr<tf2_ros::TransformListener> tf_sub_;
 
     ros::Publisher path_pub_;
+    // Ratio of map points settled by deadline-bounded searches.
+    ros::Publisher settled_ratio_pub_;
     ros::Publisher viewpoints_pub_;
     ros::Publisher other_viewpoints_pub_;
     ros::Subscriber cloud_sub_;
+    ros::Publisher map_delta_pub_;
+    ros::Subscriber map_delta_sub_;
 
     std::vector<ros::Subscriber> input_cloud_subs_;
     ros::Publisher map_pub_;
@@ -1198,10 +2068,23 @@ protected:
     ros::Publisher local_map_pub_;
     ros::Timer planning_timer_;
     ros::ServiceServer get_plan_service_;
+    ros::ServiceServer get_cost_matrix_service_;
+    // Planning services use default callback queue if there are no threads.
+    int planning_threads_{0};
+    // Parallel searches within a single cost matrix request, on top of
+    // planning threads serving concurrent requests.
+    int cost_matrix_threads_{2};
+    ros::CallbackQueue planning_queue_;
+    std::unique_ptr<ros::AsyncSpinner> planning_spinner_{};
     Mutex last_request_mutex_;
     nav_msgs::GetPlanRequest last_request_;
     ros::Timer viewpoints_update_timer_;
     ros::WallTimer update_params_timer_;
+    ros::WallTimer snapshot_timer_;
+    ros::WallTimer paging_timer_;
+    ros::WallTimer compaction_timer_;
+    ros::WallTimer reorder_timer_;
+    ros::WallTimer batch_timer_;
 
     std::string position_name_{"x"};
     std::string normal_name_{"normal_x"};
@@ -1214,29 +2097,49 @@ protected:
     float input_range_{10.0};
     bool filter_robots_{false};
 
-    int neighborhood_knn_{12};
     float neighborhood_radius_{0.5};
     float normal_radius_{neighborhood_radius_};
 
     Mutex viewpoints_mutex_;
     float viewpoints_update_freq_{1.0};
-//    std::vector<Value> viewpoints_{};  // 3xN
-//    std::vector<Value> other_viewpoints_{};  // 3xN
-//    std::vector<Vec<Value, 3>> viewpoints_{};
-//    std::vector<Vec<Value, 3>> other_viewpoints_{};
-    std::vector<Vec3> viewpoints_{};
-    std::vector<Vec3> other_viewpoints_{};
+    // Viewpoints compacted into voxels of this size.
+    float viewpoints_bin_size_{0.5};
+    ViewpointHistory viewpoints_{};
+    ViewpointHistory other_viewpoints_{};
     float min_vp_distance_{1.5};
     float max_vp_distance_{6.0};
     bool collect_rewards_{true};
+    // Reward collection method: voxel (subsampling and radius queries),
+    // lut (voxel, with vectorized parallel kernel),
+    // fft (dense 3D convolution of coverage deficit),
+    // or incremental (running sums updated from coverage changes).
+    std::string reward_method_{"voxel"};
+    // Larger FFT grids, e.g., around distant robots, fall back to LUT kernel.
+    int max_fft_cells_{1 << 22};
     float full_coverage_dist_{3.0};
     float coverage_dist_spread_{1.5};
     float self_factor_{0.25};
     bool suppress_base_reward_{true};
+    // Coverage deficit change of a voxel triggering incremental reward update.
+    float min_deficit_change_{1e-3};
+    RewardField reward_field_{};
     float path_cost_pow_{1.0};
     float min_path_cost_{0.0};
+    // Select exploration goals among clustered candidates instead of all
+    // reachable points, falling back to all points if none is feasible.
+    bool use_goal_candidates_{false};
+    float goal_cluster_size_{1.0};
+    // Points with higher coverage are not goal candidates when collecting rewards.
+    float max_goal_coverage_{0.9};
+    GoalCandidates<Point> goal_candidates_{};
     // Re-planning frequency, repeating the last request if positive.
     float planning_freq_{0.5};
+    // Graph search stops this many seconds after planning request if positive,
+    // goals are then selected among settled points.
+    double planning_deadline_{0.0};
+    // Periodic replanning reuses the last path until it is invalidated.
+    bool reuse_path_{false};
+    PathCache path_cache_{};
     // Randomize starting vertex within tolerance radius.
     bool random_start_{false};
     double plan_from_goal_dist_{0.0};
@@ -1246,13 +2149,79 @@ protected:
     float bootstrap_z_{0.0};
     Mutex initialized_mutex_;
     bool initialized_{false};
+    // Waiting for robots and transforms in initialize is abandoned once set.
+    std::atomic<bool> canceled_{false};
     double time_initialized_{std::numeric_limits<double>::quiet_NaN()};
 
     int queue_size_{5};
     Mutex map_mutex_;
     Map map_{};
+    // Map published from a separate thread, with selected fields (all if empty).
+    std::string map_fields_{};
+    double map_publish_rate_{1.0};
+    MapPublisher<Map> map_publisher_{map_};
+    // Map deltas exchanged with other robots.
+    uint16_t map_delta_fields_{DELTA_COVERAGE};
+    float map_delta_resolution_{0.01};
+    uint32_t map_delta_seq_{0};
+    Mutex map_delta_mutex_;
+    std::map<std::string, uint32_t> map_delta_last_seq_{};
+    // Map snapshot loaded on start and saved periodically if path is set.
+    std::string snapshot_path_{};
+    double snapshot_period_{0.0};
+    bool snapshot_loaded_{false};
+    MapSnapshotWriter snapshot_writer_{};
+    // Distant map tiles paged out to disk if directory is set.
+    MapPager map_pager_{};
+    double paging_period_{5.0};
+    // Subsample input clouds by range instead of voxel filter alone.
+    bool range_step_filter_{false};
+    // Input clouds processed in pipeline stages with their own threads.
+    bool async_pipeline_{false};
+    int pipeline_queue_size_{2};
+    std::unique_ptr<Pipeline<ScanBatchPtr>> pipeline_{};
+    // Dirty points updated once for several merged clouds.
+    UpdateBatcher update_batcher_{};
+    // Slots of removed points are reclaimed once these make given ratio of the map.
+    // Compaction is opt-in, disabled with zero period.
+    double compaction_period_{0.0};
+    float min_removed_ratio_{0.2};
+    // Points are reordered along a space-filling curve for memory locality.
+    double reorder_period_{0.0};
+    size_t reordered_size_{0};
 };
 
+typedef PlannerK<DEFAULT_K_NEIGHBORS> Planner;
+
+/**
+ * Create planner with neighborhood size from neighborhood_knn parameter,
+ * rounded up to the nearest available size.
+ */
+inline std::unique_ptr<PlannerBase> create_planner(ros::NodeHandle& nh, ros::NodeHandle& pnh)
+{
+    int k = DEFAULT_K_NEIGHBORS;
+    pnh.param("neighborhood_knn", k, k);
+    if (k <= 16)
+        k = 16;
+    else if (k <= 24)
+        k = 24;
+    else if (k <= 32)
+        k = 32;
+    else if (k <= 48)
+        k = 48;
+    else
+        k = 64;
+    ROS_INFO("Creating planner with %i neighbors.", k);
+    switch (k)
+    {
+        case 16: return std::unique_ptr<PlannerBase>(new PlannerK<16>(nh, pnh));
+        case 24: return std::unique_ptr<PlannerBase>(new PlannerK<24>(nh, pnh));
+        case 32: return std::unique_ptr<PlannerBase>(new PlannerK<32>(nh, pnh));
+        case 48: return std::unique_ptr<PlannerBase>(new PlannerK<48>(nh, pnh));
+        default: return std::unique_ptr<PlannerBase>(new PlannerK<64>(nh, pnh));
+    }
+}
+
 }  // namespace naex
 
 #endif  // NAEX_PLANNER_H
@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <naex/clouds.h>
+#include <naex/filter.h>
+#include <naex/timer.h>
+#include <ros/ros.h>
+#include <sensor_msgs/point_cloud2_iterator.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <string>
+#include <vector>
+
+namespace naex
+{
+
+/**
+ * Minimum squared range of kept points for each row or column index.
+ *
+ * Points at range r with angular step a are spaced r * a apart. Index i
+ * with k trailing zero bits is kept if r >= min_dist / (a * 2^(k + 1)),
+ * i.e., if points at stride 2^k are at least min_dist / 2 apart. Kept
+ * points are then spaced between min_dist / 2 and min_dist, the factor of
+ * 2 keeps the spacing from exceeding min_dist due to power-of-two strides.
+ * Index 0 is always kept. Strides nest, so that points kept at a range are
+ * kept at all larger ranges too.
+ */
+inline std::vector<float> range_step_thresholds(uint32_t n, float step, float min_dist)
+{
+    std::vector<float> thresholds(n, 0.f);
+    if (!(std::abs(step) > 0.f) || !(min_dist > 0.f))
+    {
+        return thresholds;
+    }
+    for (uint32_t i = 1; i < n; ++i)
+    {
+        int k = 0;
+        while (((i >> k) & 1u) == 0)
+        {
+            ++k;
+        }
+        const float r = min_dist / (std::abs(step) * float(2u << k));
+        thresholds[i] = r * r;
+    }
+    return thresholds;
+}
+
+/**
+ * Subsample organized cloud to spatial density given by minimum distance.
+ *
+ * Output keeps the input layout, dropped points have NaN position.
+ * @return Number of kept points.
+ */
+inline size_t range_step_subsample(const sensor_msgs::PointCloud2& input,
+                                   const std::string& field,
+                                   const SphericalProjection& model,
+                                   float min_dist,
+                                   sensor_msgs::PointCloud2& output)
+{
+    Timer t;
+    output = input;
+    output.is_dense = false;
+    const auto row_thresholds = range_step_thresholds(input.height, model.elevation_step_, min_dist);
+    const auto col_thresholds = range_step_thresholds(input.width, model.azimuth_step_, min_dist);
+    const float nan = std::numeric_limits<float>::quiet_NaN();
+    sensor_msgs::PointCloud2Iterator<float> x_it(output, field);
+    size_t n_kept = 0;
+    for (uint32_t r = 0; r < input.height; ++r)
+    {
+        const float row_threshold = row_thresholds[r];
+        for (uint32_t c = 0; c < input.width; ++c, ++x_it)
+        {
+            const float r2 = x_it[0] * x_it[0] + x_it[1] * x_it[1] + x_it[2] * x_it[2];
+            // Comparisons with NaN fail, invalid points are dropped as well.
+            const bool keep = r2 >= std::max(row_threshold, col_thresholds[c]);
+            n_kept += keep;
+            if (!keep)
+            {
+                x_it[0] = nan;
+                x_it[1] = nan;
+                x_it[2] = nan;
+            }
+        }
+    }
+    ROS_DEBUG_NAMED("filter", "Range-step subsample %u-by-%u cloud to %lu points (%.6f s).",
+                    input.height, input.width, n_kept, t.seconds_elapsed());
+    return n_kept;
+}
+
+/**
+ * Range-adaptive subsampling of organized clouds.
+ *
+ * Unlike StepFilter with fixed strides, near points are sparsified more than
+ * far points, so that all are roughly the minimum distance apart. Angular
+ * steps are taken from spherical projection models, clouds which cannot be
+ * modeled are passed unchanged.
+ */
+class RangeStepFilter: public Filter<sensor_msgs::PointCloud2>
+{
+public:
+    RangeStepFilter(const std::string& field, float min_dist, SphericalProjectionCache& projections):
+        Filter<sensor_msgs::PointCloud2>(),
+        field_(field),
+        min_dist_(min_dist),
+        projections_(projections)
+    {}
+    virtual ~RangeStepFilter() = default;
+
+    void filter(const sensor_msgs::PointCloud2& input, sensor_msgs::PointCloud2& output) override
+    {
+        const auto model = input.height > 1 && input.width > 1 ? projections_.get(input) : nullptr;
+        if (!model)
+        {
+            output = input;
+            return;
+        }
+        range_step_subsample(input, field_, *model, min_dist_, output);
+    }
+
+protected:
+    std::string field_;
+    float min_dist_{0.f};
+    SphericalProjectionCache& projections_;
+};
+
+}  // namespace naex
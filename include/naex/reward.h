@@ -1,13 +1,16 @@
 #pragma once
 
+#include <algorithm>
 #include <cstddef>
 #include <cmath>
 #include <mutex>
+#include <naex/convolution.h>
 #include <naex/flann.h>
 #include <naex/types.h>
 #include <ros/ros.h>
 #include <sensor_msgs/PointCloud2.h>
 //#include <set>
+#include <unordered_map>
 #include <unordered_set>
 #include <naex/voxel_filter.h>
 #include <vector>
@@ -22,15 +25,22 @@ T clamp(T x, T lo, T hi)
 }
 
 template<typename P>
-void suppress_reward(P& point)
+Value suppressed_reward(const P& point, Value reward)
 {
     if (point.position_[0] >= -60. && point.position_[0] <= 0.
         && point.position_[1] >= -30. && point.position_[1] <= 30.
         && point.position_[2] >= -30. && point.position_[2] <= 30.)
     {
         Value dist_from_origin = ConstVec3Map(point.position_).norm();
-        point.reward_ /= (1. + std::pow(dist_from_origin, 2.f));
+        reward /= (1. + std::pow(dist_from_origin, 2.f));
     }
+    return reward;
+}
+
+template<typename P>
+void suppress_reward(P& point)
+{
+    point.reward_ = suppressed_reward(point, point.reward_);
 }
 
 template<typename T>
@@ -114,6 +124,67 @@ void update_coverage(std::vector<P>& points,
              indices.size(), viewpoints.size(), t.seconds_elapsed());
 }
 
+/// Update point coverage from a batch of viewpoints, touching each point once.
+/// Neighbors and squared distances of points around each viewpoint are given,
+/// e.g., from a radius query, so that points far from all viewpoints are
+/// culled. Coverage from all viewpoints is combined as
+/// 1 - (1 - coverage) * prod_k (1 - c_k), which matches sequential updates.
+/// Indices of updated points are returned sorted.
+template<typename P>
+std::vector<Index> update_coverage(std::vector<P>& points,
+                                   const std::vector<std::vector<Index>>& nn,
+                                   const std::vector<std::vector<Value>>& dist,
+                                   const std::vector<bool>& self,
+                                   Value mean = 3.0,
+                                   Value std = 1.5,
+                                   Value max_update_dist = 10)
+{
+    assert(nn.size() == dist.size());
+    assert(nn.size() == self.size());
+    Timer t;
+    // Products of (1 - c_k), i.e., remaining coverage deficit and self deficit.
+    std::unordered_map<Index, std::pair<Value, Value>> remaining;
+    const Value max_update_dist_2 = max_update_dist * max_update_dist;
+    for (size_t k = 0; k < nn.size(); ++k)
+    {
+        for (size_t j = 0; j < nn[k].size(); ++j)
+        {
+            if (dist[k][j] > max_update_dist_2)
+            {
+                continue;
+            }
+            const Value c = distance_coverage(std::sqrt(dist[k][j]), mean, std);
+            auto it = remaining.find(nn[k][j]);
+            if (it == remaining.end())
+            {
+                it = remaining.emplace(nn[k][j], std::make_pair(Value(1), Value(1))).first;
+            }
+            it->second.first *= 1 - c;
+            if (self[k])
+            {
+                it->second.second *= 1 - c;
+            }
+        }
+    }
+    std::vector<Index> updated;
+    updated.reserve(remaining.size());
+    for (const auto& kv: remaining)
+    {
+        updated.push_back(kv.first);
+    }
+    std::sort(updated.begin(), updated.end());
+    for (const auto i: updated)
+    {
+        auto& p = points[i];
+        const auto& r = remaining[i];
+        p.coverage_ = clamp<Value>(1 - (1 - p.coverage_) * r.first, 0, 1);
+        p.self_coverage_ = clamp<Value>(1 - (1 - p.self_coverage_) * r.second, 0, 1);
+    }
+    ROS_INFO("Coverage mask updated for %lu points from %lu viewpoints (%.3f s).",
+             updated.size(), nn.size(), t.seconds_elapsed());
+    return updated;
+}
+
 /// Collect rewards at given indices using given neighborhood.
 template<typename P>
 //void collect_rewards(points, indices, neighborhood, float max_collect_dist = 10.0f)
@@ -241,6 +312,7 @@ void collect_rewards(std::vector<P>& points,
         index_to_point.push_back(r_ptr);
         // Accumulate coverage each voxel to compute mean.
         r_ptr->coverage_ += p.coverage_;
+        r_ptr->self_coverage_ += p.self_coverage_;
         r_ptr->support_ += 1;
     }
 
@@ -250,6 +322,7 @@ void collect_rewards(std::vector<P>& points,
         if (p.support_ > 0)
         {
             p.coverage_ /= p.support_;
+            p.self_coverage_ /= p.support_;
         }
     }
 
@@ -261,7 +334,7 @@ void collect_rewards(std::vector<P>& points,
     std::vector<Index> all;
     index_range(q.nn_.size(), all);
 
-    collect_rewards(reward_pts, all, q.nn_, mean, std, max_collect_dist);
+    collect_rewards(reward_pts, all, q.nn_, mean, std, max_collect_dist, self_factor);
 
     // Distribute rewards to original points.
     for (Index i = 0; i < indices.size(); ++i)
@@ -284,4 +357,290 @@ void collect_rewards(std::vector<P>& points,
              indices.size(), reward_pts.size(), bin_size, t.seconds_elapsed());
 }
 
+/// Coverage deficit of a voxel with given mean coverage and self coverage.
+/// Coverage gain from a viewpoint is proportional to the deficit, so that
+/// the self term max(reward, self_factor * self_reward) of the voxel-based
+/// collect_rewards becomes a per-voxel weight which can be convolved.
+inline Value coverage_deficit(Value coverage, Value self_coverage, Value self_factor)
+{
+    return std::max(1 - coverage, self_factor * (1 - self_coverage));
+}
+
+/// Collect rewards at given indices for voxel subsampled points, as in the
+/// voxel-based collect_rewards, using a vectorized and parallel kernel.
+/// Voxels are stored in SoA layout sorted by coarse cells of max collect
+/// distance, so that neighbors of each voxel are scanned as contiguous blocks
+/// from the adjacent cells. Squared voxel distances are integers, so the
+/// coverage kernel is looked up exactly from a table indexed by them.
+/// Each reward is summed by a single thread in fixed order, so the results
+/// are deterministic.
+template<typename P>
+void collect_rewards_lut(std::vector<P>& points,
+                         const std::vector<Index>& indices,
+                         Value mean = 3.0,
+                         Value std = 1.5,
+                         Value max_collect_dist = 10.0,
+                         Value self_factor = 0.0,
+                         bool suppress_base_reward = true,
+                         Value bin_size = 0.5)
+{
+    Timer t;
+    // Voxel keys of input points and reward voxel index for each of them.
+    std::vector<Index> index_to_voxel(indices.size(), INVALID_INDEX);
+    VoxelMap<int, Index> voxel_to_index;
+    std::vector<Voxel<int>> voxels;
+    std::vector<Value> coverage;
+    std::vector<Value> self_coverage;
+    std::vector<Index> support;
+    for (Index i = 0; i < indices.size(); ++i)
+    {
+        const auto& p = points[indices[i]];
+        Voxel<int> v;
+        if (!v.from<Value>(p.position_, bin_size))
+        {
+            continue;
+        }
+        auto it = voxel_to_index.find(v);
+        if (it == voxel_to_index.end())
+        {
+            it = voxel_to_index.emplace(v, Index(voxels.size())).first;
+            voxels.push_back(v);
+            coverage.push_back(0);
+            self_coverage.push_back(0);
+            support.push_back(0);
+        }
+        index_to_voxel[i] = it->second;
+        coverage[it->second] += p.coverage_;
+        self_coverage[it->second] += p.self_coverage_;
+        support[it->second] += 1;
+    }
+    const Index n = Index(voxels.size());
+
+    // Coverage kernel indexed by squared distance in voxels.
+    const int r = int(std::floor(max_collect_dist / bin_size));
+    const int r2 = int(std::floor(max_collect_dist * max_collect_dist / (bin_size * bin_size)));
+    std::vector<float> lut(r2 + 1);
+    for (int d2 = 0; d2 <= r2; ++d2)
+    {
+        lut[d2] = float(distance_coverage(bin_size * std::sqrt(Value(d2)), mean, std));
+    }
+
+    // Sort voxels by coarse cells of r voxels.
+    const int cell_size = std::max(r, 1);
+    const auto cell_of = [cell_size](const Voxel<int>& v)
+    {
+        const auto div = [cell_size](int x) { return x >= 0 ? x / cell_size : (x + 1) / cell_size - 1; };
+        return Voxel<int>(div(v.x_), div(v.y_), div(v.z_));
+    };
+    std::vector<Index> order;
+    index_range(n, order);
+    std::vector<Voxel<int>> cells(n);
+    for (Index i = 0; i < n; ++i)
+    {
+        cells[i] = cell_of(voxels[i]);
+    }
+    std::sort(order.begin(), order.end(), [&cells](Index a, Index b)
+    {
+        const auto& ca = cells[a];
+        const auto& cb = cells[b];
+        return ca.x_ != cb.x_ ? ca.x_ < cb.x_ : ca.y_ != cb.y_ ? ca.y_ < cb.y_ : ca.z_ != cb.z_ ? ca.z_ < cb.z_ : a < b;
+    });
+
+    // SoA buffers in cell order.
+    std::vector<int> xs(n), ys(n), zs(n);
+    std::vector<float> deficit(n);
+    VoxelMap<int, std::pair<Index, Index>> cell_ranges;
+    for (Index k = 0; k < n; ++k)
+    {
+        const auto i = order[k];
+        xs[k] = voxels[i].x_;
+        ys[k] = voxels[i].y_;
+        zs[k] = voxels[i].z_;
+        deficit[k] = float(coverage_deficit(coverage[i] / support[i], self_coverage[i] / support[i], self_factor));
+        auto it = cell_ranges.find(cells[i]);
+        if (it == cell_ranges.end())
+        {
+            cell_ranges.emplace(cells[i], std::make_pair(k, k + 1));
+        }
+        else
+        {
+            it->second.second = k + 1;
+        }
+    }
+
+    std::vector<float> reward(n, 0.f);
+    #pragma omp parallel for schedule(static)
+    for (Index k = 0; k < n; ++k)
+    {
+        const int x = xs[k];
+        const int y = ys[k];
+        const int z = zs[k];
+        const auto c = cell_of(Voxel<int>(x, y, z));
+        float sum = 0.f;
+        for (int dx = -1; dx <= 1; ++dx)
+        {
+            for (int dy = -1; dy <= 1; ++dy)
+            {
+                for (int dz = -1; dz <= 1; ++dz)
+                {
+                    const auto it = cell_ranges.find(Voxel<int>(c.x_ + dx, c.y_ + dy, c.z_ + dz));
+                    if (it == cell_ranges.end())
+                    {
+                        continue;
+                    }
+                    const Index begin = it->second.first;
+                    const Index end = it->second.second;
+                    #pragma omp simd reduction(+:sum)
+                    for (Index j = begin; j < end; ++j)
+                    {
+                        const int ex = xs[j] - x;
+                        const int ey = ys[j] - y;
+                        const int ez = zs[j] - z;
+                        const int d2 = ex * ex + ey * ey + ez * ez;
+                        sum += (d2 <= r2) ? lut[std::min(d2, r2)] * deficit[j] : 0.f;
+                    }
+                }
+            }
+        }
+        reward[k] = sum;
+    }
+
+    // Distribute rewards to original points.
+    std::vector<Index> rank(n);
+    for (Index k = 0; k < n; ++k)
+    {
+        rank[order[k]] = k;
+    }
+    for (Index i = 0; i < indices.size(); ++i)
+    {
+        if (index_to_voxel[i] == INVALID_INDEX)
+        {
+            continue;
+        }
+        const auto v = index_to_voxel[i];
+        auto& pt = points[indices[i]];
+        pt.reward_ = support[v] * reward[rank[v]];
+        if (suppress_base_reward)
+        {
+            suppress_reward(pt);
+        }
+    }
+
+    ROS_INFO("Collected rewards for %lu input points or %lu %.2f-m voxels using LUT kernel (%.3f s).",
+             indices.size(), size_t(n), bin_size, t.seconds_elapsed());
+}
+
+/// Collect rewards at given indices via dense 3D convolution of coverage
+/// deficit, see coverage_deficit, with the distance coverage kernel,
+/// approach (2) in the comments above. Deficit is rasterized into a local voxel grid
+/// covering the input points, with empty voxels not contributing.
+/// Sparse input spanning more than max_cells padded grid cells, e.g.,
+/// around distant robots, falls back to the LUT kernel.
+template<typename P>
+void collect_rewards_fft(std::vector<P>& points,
+                         const std::vector<Index>& indices,
+                         Value mean = 3.0,
+                         Value std = 1.5,
+                         Value max_collect_dist = 10.0,
+                         Value self_factor = 0.0,
+                         bool suppress_base_reward = true,
+                         Value bin_size = 0.5,
+                         size_t max_cells = size_t(1) << 22)
+{
+    Timer t;
+    if (indices.empty())
+    {
+        return;
+    }
+    std::vector<Voxel<int>> voxels(indices.size());
+    std::vector<bool> valid(indices.size(), false);
+    int lo[3] = {std::numeric_limits<int>::max(),
+                 std::numeric_limits<int>::max(),
+                 std::numeric_limits<int>::max()};
+    int hi[3] = {std::numeric_limits<int>::min(),
+                 std::numeric_limits<int>::min(),
+                 std::numeric_limits<int>::min()};
+    for (Index i = 0; i < indices.size(); ++i)
+    {
+        auto& v = voxels[i];
+        if (!v.from<Value>(points[indices[i]].position_, bin_size))
+        {
+            continue;
+        }
+        valid[i] = true;
+        lo[0] = std::min(lo[0], v.x_);
+        lo[1] = std::min(lo[1], v.y_);
+        lo[2] = std::min(lo[2], v.z_);
+        hi[0] = std::max(hi[0], v.x_);
+        hi[1] = std::max(hi[1], v.y_);
+        hi[2] = std::max(hi[2], v.z_);
+    }
+    if (lo[0] > hi[0])
+    {
+        return;
+    }
+    const int r = int(std::floor(max_collect_dist / bin_size));
+    const size_t n_cells = convolve_fft_cells(hi[0] - lo[0] + 1, hi[1] - lo[1] + 1, hi[2] - lo[2] + 1, r);
+    if (n_cells > max_cells)
+    {
+        ROS_INFO("FFT grid with %lu > %lu cells, using LUT kernel.", n_cells, max_cells);
+        collect_rewards_lut(points, indices, mean, std, max_collect_dist, self_factor, suppress_base_reward, bin_size);
+        return;
+    }
+
+    // Accumulate coverage, self coverage and support in voxels.
+    Grid3<float> deficit(hi[0] - lo[0] + 1, hi[1] - lo[1] + 1, hi[2] - lo[2] + 1);
+    Grid3<float> self_coverage(deficit.nx_, deficit.ny_, deficit.nz_);
+    Grid3<Index> support(deficit.nx_, deficit.ny_, deficit.nz_);
+    for (Index i = 0; i < indices.size(); ++i)
+    {
+        if (!valid[i])
+        {
+            continue;
+        }
+        const auto& v = voxels[i];
+        deficit(v.x_ - lo[0], v.y_ - lo[1], v.z_ - lo[2]) += points[indices[i]].coverage_;
+        self_coverage(v.x_ - lo[0], v.y_ - lo[1], v.z_ - lo[2]) += points[indices[i]].self_coverage_;
+        support(v.x_ - lo[0], v.y_ - lo[1], v.z_ - lo[2]) += 1;
+    }
+    for (size_t i = 0; i < deficit.size(); ++i)
+    {
+        if (support.data_[i] > 0)
+        {
+            deficit.data_[i] = float(coverage_deficit(deficit.data_[i] / support.data_[i],
+                                                      self_coverage.data_[i] / support.data_[i],
+                                                      self_factor));
+        }
+    }
+
+    // Radially symmetric kernel, truncated at max collect distance.
+    const auto kernel = [=](int dx, int dy, int dz)
+    {
+        const Value dist = bin_size * std::sqrt(Value(dx * dx + dy * dy + dz * dz));
+        return dist <= max_collect_dist ? float(distance_coverage(dist, mean, std)) : 0.f;
+    };
+    const auto reward = convolve_fft(deficit, kernel, r);
+
+    // Distribute rewards to original points.
+    for (Index i = 0; i < indices.size(); ++i)
+    {
+        if (!valid[i])
+        {
+            continue;
+        }
+        const auto& v = voxels[i];
+        const auto j = reward.index(v.x_ - lo[0], v.y_ - lo[1], v.z_ - lo[2]);
+        auto& pt = points[indices[i]];
+        // Round-off noise can make the rewards slightly negative.
+        pt.reward_ = support.data_[j] * std::max(reward.data_[j], 0.f);
+        if (suppress_base_reward)
+        {
+            suppress_reward(pt);
+        }
+    }
+
+    ROS_INFO("Collected rewards for %lu input points using FFT over %i x %i x %i %.2f-m voxels (%.3f s).",
+             indices.size(), deficit.nx_, deficit.ny_, deficit.nz_, bin_size, t.seconds_elapsed());
+}
+
 }  // namespace naex
@@ -0,0 +1,338 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <naex/reward.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <naex/voxel_filter.h>
+#include <ros/ros.h>
+#include <unordered_set>
+#include <vector>
+
+namespace naex
+{
+
+/**
+ * Incrementally maintained reward field over voxelized map points.
+ *
+ * Voxel reward is the sum of coverage deficits (1 - mean coverage) of other
+ * voxels within max collect distance, weighted by distance coverage, as in
+ * voxel-based collect_rewards. Rewards are kept as running sums: a change of
+ * voxel deficit by delta adds delta-weighted kernel to existing voxels
+ * around, while a new voxel gathers its reward from existing voxels once.
+ * The cost thus scales with the number of voxels whose coverage changed,
+ * not with the volume around the viewpoints.
+ *
+ * Not thread-safe, access is guarded by the map cloud mutex.
+ */
+class RewardField
+{
+public:
+    class Cell
+    {
+    public:
+        // Map points within the voxel.
+        std::vector<Index> indices_{};
+        // Coverage deficit already propagated to rewards.
+        Value deficit_{0.0};
+        // Running reward sum.
+        Value reward_{0.0};
+    };
+
+    RewardField()
+    {
+        init_kernel();
+    }
+    RewardField(Value bin_size, Value mean, Value std, Value max_collect_dist,
+                Value min_deficit_change = 1e-3, bool suppress_base_reward = true):
+        bin_size_(bin_size),
+        mean_(mean),
+        std_(std),
+        max_collect_dist_(max_collect_dist),
+        min_deficit_change_(min_deficit_change),
+        suppress_base_reward_(suppress_base_reward)
+    {
+        init_kernel();
+    }
+
+    void clear()
+    {
+        cells_.clear();
+        point_voxel_.clear();
+        tracked_.clear();
+        unseen_.clear();
+    }
+
+    size_t size() const
+    {
+        return cells_.size();
+    }
+
+    /// Add new static points and remove points which are no longer static.
+    /// Points not seen before are checked even if not among given indices.
+    template<typename P>
+    void update_points(std::vector<P>& points, std::vector<Index> indices)
+    {
+        Timer t;
+        if (points.size() < tracked_.size())
+        {
+            ROS_WARN("Map shrunk from %lu to %lu points, resetting reward field.",
+                     tracked_.size(), points.size());
+            clear();
+        }
+        for (Index i = Index(tracked_.size()); i < points.size(); ++i)
+        {
+            indices.push_back(i);
+        }
+        indices.insert(indices.end(), unseen_.begin(), unseen_.end());
+        unseen_.clear();
+        point_voxel_.resize(points.size());
+        tracked_.resize(points.size(), false);
+
+        std::unordered_set<Voxel<int>, Voxel<int>::Hash> changed;
+        for (const auto i: indices)
+        {
+            const bool keep = points[i].flags_ & STATIC;
+            if (keep && !tracked_[i])
+            {
+                Voxel<int> v;
+                if (!v.from<Value>(points[i].position_, bin_size_))
+                {
+                    continue;
+                }
+                auto it = cells_.find(v);
+                if (it == cells_.end())
+                {
+                    it = cells_.emplace(v, Cell()).first;
+                    it->second.reward_ = gather(v);
+                }
+                it->second.indices_.push_back(i);
+                point_voxel_[i] = v;
+                tracked_[i] = true;
+                changed.insert(v);
+            }
+            else if (!keep && tracked_[i])
+            {
+                const auto& v = point_voxel_[i];
+                auto& cell_indices = cells_[v].indices_;
+                const auto it = std::find(cell_indices.begin(), cell_indices.end(), i);
+                std::swap(*it, cell_indices.back());
+                cell_indices.pop_back();
+                tracked_[i] = false;
+                points[i].reward_ = 0;
+                changed.insert(v);
+            }
+        }
+        propagate(points, changed);
+        ROS_DEBUG("Reward field updated from %lu points, %lu voxels changed (%.3f s).",
+                  indices.size(), changed.size(), t.seconds_elapsed());
+    }
+
+    /// Add points not seen before, e.g., after map initialization.
+    template<typename P>
+    void add_new_points(std::vector<P>& points)
+    {
+        if (points.size() != tracked_.size() || !unseen_.empty())
+        {
+            update_points(points, std::vector<Index>());
+        }
+    }
+
+    /// Apply map index remap after compaction or reordering.
+    void remap(const std::vector<Index>& remap)
+    {
+        Index n = 0;
+        for (const auto i: remap)
+        {
+            if (!invalid_index(i))
+            {
+                ++n;
+            }
+        }
+        for (auto& kv: cells_)
+        {
+            auto& indices = kv.second.indices_;
+            for (auto& i: indices)
+            {
+                i = remap[i];
+            }
+            indices.erase(std::remove_if(indices.begin(), indices.end(),
+                                         [](Index i) { return invalid_index(i); }),
+                          indices.end());
+        }
+        std::vector<Voxel<int>> point_voxel(n);
+        std::vector<bool> tracked(n, false);
+        for (Index i = 0; i < Index(tracked_.size()) && i < Index(remap.size()); ++i)
+        {
+            if (!invalid_index(remap[i]))
+            {
+                point_voxel[remap[i]] = point_voxel_[i];
+                tracked[remap[i]] = tracked_[i];
+            }
+        }
+        // Points not seen yet are checked on the next update.
+        std::vector<Index> unseen;
+        for (const auto i: unseen_)
+        {
+            if (i < Index(remap.size()) && !invalid_index(remap[i]))
+            {
+                unseen.push_back(remap[i]);
+            }
+        }
+        for (Index i = Index(tracked_.size()); i < Index(remap.size()); ++i)
+        {
+            if (!invalid_index(remap[i]))
+            {
+                unseen.push_back(remap[i]);
+            }
+        }
+        unseen_.swap(unseen);
+        point_voxel_.swap(point_voxel);
+        tracked_.swap(tracked);
+    }
+
+    /// Update rewards after coverage of points at given indices changed.
+    template<typename P>
+    void update_coverage(std::vector<P>& points, const std::vector<Index>& indices)
+    {
+        Timer t;
+        std::unordered_set<Voxel<int>, Voxel<int>::Hash> changed;
+        for (const auto i: indices)
+        {
+            if (i < tracked_.size() && tracked_[i])
+            {
+                changed.insert(point_voxel_[i]);
+            }
+        }
+        const auto n_pushed = propagate(points, changed);
+        ROS_INFO("Reward field updated from %lu points, %lu / %lu voxels changed coverage (%.3f s).",
+                 indices.size(), n_pushed, changed.size(), t.seconds_elapsed());
+    }
+
+    Value bin_size_{0.5};
+    Value mean_{3.0};
+    Value std_{1.5};
+    Value max_collect_dist_{6.0};
+    // Deficit changes below this threshold are postponed until they accumulate.
+    Value min_deficit_change_{1e-3};
+    bool suppress_base_reward_{true};
+
+protected:
+    void init_kernel()
+    {
+        offsets_.clear();
+        weights_.clear();
+        const int r = int(std::floor(max_collect_dist_ / bin_size_));
+        for (int dx = -r; dx <= r; ++dx)
+        {
+            for (int dy = -r; dy <= r; ++dy)
+            {
+                for (int dz = -r; dz <= r; ++dz)
+                {
+                    const Value dist = bin_size_ * std::sqrt(Value(dx * dx + dy * dy + dz * dz));
+                    if (dist > max_collect_dist_)
+                    {
+                        continue;
+                    }
+                    offsets_.emplace_back(dx, dy, dz);
+                    weights_.push_back(distance_coverage(dist, mean_, std_));
+                }
+            }
+        }
+    }
+
+    /// Reward of a voxel from deficits of existing voxels around.
+    Value gather(const Voxel<int>& v) const
+    {
+        Value reward = 0;
+        for (size_t k = 0; k < offsets_.size(); ++k)
+        {
+            const Voxel<int> u(v.x_ + offsets_[k].x_, v.y_ + offsets_[k].y_, v.z_ + offsets_[k].z_);
+            const auto it = cells_.find(u);
+            if (it != cells_.end())
+            {
+                reward += weights_[k] * it->second.deficit_;
+            }
+        }
+        return reward;
+    }
+
+    /// Push deficit changes of given voxels to rewards of voxels around,
+    /// write rewards of affected voxels to their points.
+    template<typename P>
+    size_t propagate(std::vector<P>& points, std::unordered_set<Voxel<int>, Voxel<int>::Hash>& changed)
+    {
+        size_t n_pushed = 0;
+        for (const auto& v: changed)
+        {
+            auto& cell = cells_[v];
+            Value deficit = 0;
+            if (!cell.indices_.empty())
+            {
+                Value coverage = 0;
+                for (const auto i: cell.indices_)
+                {
+                    coverage += points[i].coverage_;
+                }
+                deficit = 1 - coverage / cell.indices_.size();
+            }
+            const Value delta = deficit - cell.deficit_;
+            if (std::abs(delta) < min_deficit_change_ && !cell.indices_.empty())
+            {
+                continue;
+            }
+            cell.deficit_ = deficit;
+            ++n_pushed;
+            for (size_t k = 0; k < offsets_.size(); ++k)
+            {
+                const Voxel<int> u(v.x_ + offsets_[k].x_, v.y_ + offsets_[k].y_, v.z_ + offsets_[k].z_);
+                const auto it = cells_.find(u);
+                if (it != cells_.end())
+                {
+                    it->second.reward_ += weights_[k] * delta;
+                    affected_.insert(u);
+                }
+            }
+        }
+        // Support changes affect rewards too.
+        affected_.insert(changed.begin(), changed.end());
+        for (const auto& v: affected_)
+        {
+            auto it = cells_.find(v);
+            if (it == cells_.end())
+            {
+                continue;
+            }
+            if (it->second.indices_.empty())
+            {
+                cells_.erase(it);
+                continue;
+            }
+            const auto& cell = it->second;
+            for (const auto i: cell.indices_)
+            {
+                auto& pt = points[i];
+                pt.reward_ = cell.indices_.size() * std::max(cell.reward_, Value(0));
+                if (suppress_base_reward_)
+                {
+                    suppress_reward(pt);
+                }
+            }
+        }
+        affected_.clear();
+        return n_pushed;
+    }
+
+    std::vector<Voxel<int>> offsets_{};
+    std::vector<Value> weights_{};
+    VoxelMap<int, Cell> cells_{};
+    // Voxels of tracked points.
+    std::vector<Voxel<int>> point_voxel_{};
+    std::vector<bool> tracked_{};
+    // Points moved by reordering before being seen.
+    std::vector<Index> unseen_{};
+    std::unordered_set<Voxel<int>, Voxel<int>::Hash> affected_{};
+};
+
+}  // namespace naex
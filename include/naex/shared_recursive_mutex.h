@@ -0,0 +1,111 @@
+#pragma once
+
+#include <atomic>
+#include <cassert>
+#include <shared_mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+
+namespace naex
+{
+
+/**
+ * Reader-writer mutex which can be locked recursively by its owner.
+ *
+ * Exclusive locks of the owning thread nest, as with std::recursive_mutex,
+ * and the owner may also take shared locks. Shared locks nest within each
+ * thread. Upgrading a shared lock to an exclusive one is not supported, it
+ * would deadlock, so lock() throws std::logic_error instead.
+ *
+ * Readers are not blocked by a waiting writer, so a writer may starve while
+ * shared locks overlap continuously. Shared locks should thus be held for
+ * bounded time, e.g., planning requests bound graph search by a deadline.
+ */
+class SharedRecursiveMutex
+{
+public:
+    SharedRecursiveMutex() = default;
+    SharedRecursiveMutex(const SharedRecursiveMutex&) = delete;
+    SharedRecursiveMutex& operator=(const SharedRecursiveMutex&) = delete;
+
+    void lock()
+    {
+        const auto id = std::this_thread::get_id();
+        if (owner_.load() == id)
+        {
+            ++depth_;
+            return;
+        }
+        if (holds_shared())
+        {
+            throw std::logic_error("Cannot upgrade shared lock to exclusive one.");
+        }
+        mutex_.lock();
+        owner_.store(id);
+        depth_ = 1;
+    }
+
+    void unlock()
+    {
+        assert(owner_.load() == std::this_thread::get_id());
+        if (--depth_ == 0)
+        {
+            owner_.store(std::thread::id());
+            mutex_.unlock();
+        }
+    }
+
+    void lock_shared()
+    {
+        if (owner_.load() == std::this_thread::get_id())
+        {
+            ++depth_;
+            return;
+        }
+        if (shared_depth()++ == 0)
+        {
+            mutex_.lock_shared();
+        }
+    }
+
+    void unlock_shared()
+    {
+        if (owner_.load() == std::this_thread::get_id())
+        {
+            --depth_;
+            return;
+        }
+        if (--shared_depth() == 0)
+        {
+            shared_depths().erase(this);
+            mutex_.unlock_shared();
+        }
+    }
+
+private:
+    static std::unordered_map<const SharedRecursiveMutex*, int>& shared_depths()
+    {
+        thread_local std::unordered_map<const SharedRecursiveMutex*, int> depths;
+        return depths;
+    }
+
+    int& shared_depth()
+    {
+        return shared_depths()[this];
+    }
+
+    bool holds_shared() const
+    {
+        const auto& depths = shared_depths();
+        const auto it = depths.find(this);
+        return it != depths.end() && it->second > 0;
+    }
+
+    std::shared_timed_mutex mutex_;
+    std::atomic<std::thread::id> owner_{};
+    // Depth of exclusive and nested shared locks of the owner.
+    int depth_{0};
+};
+
+}  // namespace naex
@@ -149,28 +149,77 @@ public:
     Value relative_cost_{std::numeric_limits<Value>::quiet_NaN()};
 };
 
-class Neighborhood
+/**
+ * Directed edge from a point to its neighbor, stored in the map adjacency.
+ */
+class Neighbor
 {
 public:
-    Neighborhood()
+    Vertex target_{INVALID_VERTEX};
+    Value distance_{std::numeric_limits<Value>::quiet_NaN()};
+    // Edge cost, NaN if not computed yet.
+    Value cost_{std::numeric_limits<Value>::quiet_NaN()};
+};
+
+/**
+ * Out-edge descriptor for graph search, an adjacency slot with its source.
+ * The source is not stored in the adjacency, it comes from the vertex whose
+ * out-edges are traversed.
+ */
+class OutEdge
+{
+public:
+    OutEdge()
+    {}
+    OutEdge(Vertex source, Edge edge):
+        source_(source),
+        edge_(edge)
+    {}
+    bool operator==(const OutEdge& other) const
+    {
+        return edge_ == other.edge_;
+    }
+    bool operator!=(const OutEdge& other) const
+    {
+        return edge_ != other.edge_;
+    }
+    Vertex source_{INVALID_VERTEX};
+    Edge edge_{0};
+};
+
+/**
+ * Nearest neighbors of a point, as a range of the map adjacency.
+ * @tparam K Maximum number of neighbors, including the point itself.
+ */
+template<Index K>
+class NeighborhoodK
+{
+public:
+    NeighborhoodK()
     {}
 
-    // TODO: Make K_NEIGHBORS a parameter.
-    static const Index K_NEIGHBORS = 48;
+    static const Index K_NEIGHBORS = K;
     Value position_[3] = {std::numeric_limits<Value>::quiet_NaN(),
                           std::numeric_limits<Value>::quiet_NaN(),
                           std::numeric_limits<Value>::quiet_NaN()};
     // NN Graph
-    // Number of valid entries in neighbors_ and distances_.
+    // Neighbors within search radius, sorted by distance, the first one
+    // being the point itself. Capacity is the number of reserved slots.
+    Index neighbor_offset_{0};
     Index neighbor_count_{0};
-    Index neighbors_[K_NEIGHBORS] = {0};
-    // Treat zero distance and cost as invalid.
-    Value distances_[K_NEIGHBORS] = {0};
-    Value costs_[K_NEIGHBORS] = {0};
+    Index neighbor_capacity_{0};
     // Index state from IndexState enum.
     // uint8_t index_state_;
 };
 
+template<Index K>
+const Index NeighborhoodK<K>::K_NEIGHBORS;
+
+// Neighborhood size of the default map, other sizes are selected at runtime
+// by neighborhood_knn parameter.
+static const Index DEFAULT_K_NEIGHBORS = 48;
+typedef NeighborhoodK<DEFAULT_K_NEIGHBORS> Neighborhood;
+
 }  // namespace naex
 
 #endif  // NAEX_TYPES_H
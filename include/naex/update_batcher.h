@@ -0,0 +1,110 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include <mutex>
+#include <ros/ros.h>
+
+namespace naex
+{
+
+/**
+ * Decides when to update dirty map points after merging input clouds.
+ *
+ * Several merged clouds share one update of neighborhoods, features,
+ * labels and edge costs over the union of dirty points. The batch size
+ * adapts to the measured update cost and input period so that updates
+ * take at most given share of time, limited by the maximum number of
+ * clouds, merged points and delay since the first pending cloud.
+ */
+class UpdateBatcher
+{
+public:
+    typedef std::mutex Mutex;
+    typedef std::lock_guard<Mutex> Lock;
+
+    /// Record merged clouds, return true if the update should run now.
+    bool add(double now, size_t num_clouds, size_t num_points)
+    {
+        Lock lock(mutex_);
+        if (std::isfinite(last_add_))
+        {
+            smooth(period_ema_, (now - last_add_) / std::max(num_clouds, size_t(1)));
+        }
+        last_add_ = now;
+        if (num_pending_ == 0)
+        {
+            first_pending_ = now;
+        }
+        num_pending_ += num_clouds;
+        num_pending_points_ += num_points;
+        return num_pending_ >= batch_size_
+            || num_pending_points_ >= max_batch_points_
+            || now - first_pending_ >= max_batch_delay_;
+    }
+
+    /// Check whether pending clouds waited long enough.
+    bool due(double now)
+    {
+        Lock lock(mutex_);
+        return num_pending_ > 0 && now - first_pending_ >= max_batch_delay_;
+    }
+
+    /// Record update of pending clouds and adapt the batch size.
+    void updated(double cost)
+    {
+        Lock lock(mutex_);
+        if (num_pending_ == 0)
+        {
+            return;
+        }
+        smooth(cost_ema_, cost);
+        num_pending_ = 0;
+        num_pending_points_ = 0;
+        const size_t prev_size = batch_size_;
+        if (std::isfinite(period_ema_) && period_ema_ > 0. && max_update_load_ > 0.)
+        {
+            const double size = std::ceil(cost_ema_ / (period_ema_ * max_update_load_));
+            batch_size_ = size_t(std::min(std::max(size, 1.), double(std::max(max_batch_clouds_, 1))));
+        }
+        if (batch_size_ != prev_size)
+        {
+            ROS_INFO("Update batch size changed from %lu to %lu clouds "
+                     "(update cost %.3f s, input period %.3f s).",
+                     prev_size, batch_size_, cost_ema_, period_ema_);
+        }
+    }
+
+    size_t batch_size() const
+    {
+        Lock lock(mutex_);
+        return batch_size_;
+    }
+
+    // Batching is disabled with a single cloud.
+    int max_batch_clouds_{1};
+    size_t max_batch_points_{std::numeric_limits<size_t>::max()};
+    double max_batch_delay_{0.5};
+    // Target share of time spent in updates.
+    double max_update_load_{0.5};
+    // Weight of new samples in moving averages.
+    double alpha_{0.2};
+
+protected:
+    void smooth(double& ema, double value) const
+    {
+        ema = std::isfinite(ema) ? (1. - alpha_) * ema + alpha_ * value : value;
+    }
+
+    mutable Mutex mutex_;
+    size_t batch_size_{1};
+    size_t num_pending_{0};
+    size_t num_pending_points_{0};
+    double first_pending_{std::numeric_limits<double>::quiet_NaN()};
+    double last_add_{std::numeric_limits<double>::quiet_NaN()};
+    double period_ema_{std::numeric_limits<double>::quiet_NaN()};
+    double cost_ema_{std::numeric_limits<double>::quiet_NaN()};
+};
+
+}  // namespace naex
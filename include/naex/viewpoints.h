@@ -0,0 +1,122 @@
+#pragma once
+
+#include <cmath>
+#include <deque>
+#include <flann/flann.hpp>
+#include <limits>
+#include <memory>
+#include <naex/buffer.h>
+#include <naex/clouds.h>
+#include <naex/nearest_neighbors.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <naex/voxel_filter.h>
+#include <ros/ros.h>
+#include <sensor_msgs/PointCloud2.h>
+#include <unordered_set>
+
+namespace naex
+{
+
+/**
+ * History of viewpoints compacted into voxels, with a persistent kNN index.
+ *
+ * A viewpoint is stored only if no other viewpoint falls into the same
+ * voxel, so the history grows with explored area instead of mission time.
+ * Stored viewpoints are added to the index incrementally, the index keeps
+ * pointers to their positions, which must not move.
+ *
+ * Not thread-safe.
+ */
+class ViewpointHistory
+{
+public:
+    ViewpointHistory(Value bin_size = 0.5):
+        bin_size_(bin_size)
+    {}
+
+    /// Add a viewpoint, return true if it has been stored.
+    bool add(const Vec3& position)
+    {
+        last_ = position;
+        has_last_ = true;
+        Voxel<int> v;
+        if (!v.from<Value>(position.data(), bin_size_) || voxels_.find(v) != voxels_.end())
+        {
+            return false;
+        }
+        voxels_.insert(v);
+        // Deque keeps elements in place on push_back.
+        positions_.push_back(position);
+        flann::Matrix<Value> mat(positions_.back().data(), 1, 3);
+        if (!index_)
+        {
+            index_ = std::make_shared<FlannIndex>(mat, flann::KDTreeSingleIndexParams());
+            index_->buildIndex();
+        }
+        else
+        {
+            // Rebuild once the index doubles in size.
+            index_->addPoints(mat, 2.f);
+        }
+        return true;
+    }
+
+    bool empty() const
+    {
+        return positions_.empty();
+    }
+
+    size_t size() const
+    {
+        return positions_.size();
+    }
+
+    /// Last added viewpoint, even if not stored.
+    bool last(Vec3& position) const
+    {
+        if (has_last_)
+        {
+            position = last_;
+        }
+        return has_last_;
+    }
+
+    /// Squared distances from points to the nearest stored viewpoint.
+    Buffer<Value> nearest_dist(const flann::Matrix<Value>& points) const
+    {
+        if (!index_)
+        {
+            Buffer<Value> dist(points.rows);
+            std::fill(dist.begin(), dist.end(), std::numeric_limits<Value>::infinity());
+            return dist;
+        }
+        Query<Value> q(*index_, points, 1);
+        return q.dist_buf_;
+    }
+
+    void create_cloud(sensor_msgs::PointCloud2& cloud) const
+    {
+        Buffer<Value> buf(3 * positions_.size());
+        auto it = buf.begin();
+        for (const auto& p: positions_)
+        {
+            *it++ = p.x();
+            *it++ = p.y();
+            *it++ = p.z();
+        }
+        flann::Matrix<Value> mat(buf.begin(), positions_.size(), 3);
+        create_xyz_cloud(mat, cloud);
+    }
+
+    Value bin_size_{0.5};
+
+protected:
+    std::deque<Vec3> positions_{};
+    std::unordered_set<Voxel<int>, Voxel<int>::Hash> voxels_{};
+    FlannIndexPtr index_{};
+    Vec3 last_{Vec3::Zero()};
+    bool has_last_{false};
+};
+
+}  // namespace naex
@@ -0,0 +1,155 @@
+#include <algorithm>
+#include <boost/graph/graph_concepts.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <naex/exceptions.h>
+#include <naex/map.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <random>
+#include <vector>
+// Graph traits need the map types.
+#include <naex/graph.h>
+// Compare eager and lazy edge costs on scan update and replanning cycles.
+// A robot drives along a wavy terrain with walls, points within scan range
+// are merged each cycle, and the graph is searched every few scans.
+// Usage: edge_cost_benchmark [point_spacing] [scans_per_plan] [num_cycles]
+
+using namespace naex;
+
+namespace
+{
+    std::vector<Value> create_terrain(Value length, Value width, Value spacing, std::mt19937& gen)
+    {
+        std::uniform_real_distribution<Value> noise(-0.25f * spacing, 0.25f * spacing);
+        std::vector<Value> points;
+        for (Value x = 0.f; x <= length; x += spacing)
+        {
+            for (Value y = -width / 2; y <= width / 2; y += spacing)
+            {
+                const Value z = 0.5f * std::sin(0.3f * x) * std::cos(0.2f * y);
+                points.insert(points.end(), {x + noise(gen), y + noise(gen), z});
+                // Walls along lines y = const and blocks along the way.
+                if (std::abs(std::abs(y) - width / 2) < spacing
+                    || (std::fmod(x, 10.f) < 1.f && std::abs(y) < 1.f))
+                {
+                    for (Value h = spacing; h <= 2.f; h += spacing)
+                    {
+                        points.insert(points.end(), {x, y, z + h});
+                    }
+                }
+            }
+        }
+        return points;
+    }
+
+    class CycleStats
+    {
+    public:
+        double update_time{0.};
+        double search_time{0.};
+        size_t num_plans{0};
+        std::vector<Value> path_costs{};
+    };
+
+    CycleStats run(const std::vector<Value>& terrain, Value spacing, bool lazy,
+                   int scans_per_plan, int num_cycles)
+    {
+        Map map;
+        map.points_min_dist_ = spacing;
+        map.neighborhood_radius_ = 3 * spacing;
+        map.clearance_radius_ = 3 * spacing;
+        map.min_dist_to_obstacle_ = 0.f;
+        map.lazy_edge_costs_ = lazy;
+
+        CycleStats stats;
+        const Value scan_range = 10.f;
+        std::vector<Value> scan;
+        for (int i = 0; i < num_cycles; ++i)
+        {
+            // Robot position and points within scan range.
+            Value origin[3] = {Value(i), 0.f, 1.f};
+            scan.clear();
+            for (size_t j = 0; j + 2 < terrain.size(); j += 3)
+            {
+                const Value dx = terrain[j] - origin[0];
+                const Value dy = terrain[j + 1] - origin[1];
+                if (dx * dx + dy * dy <= scan_range * scan_range)
+                {
+                    scan.insert(scan.end(), terrain.begin() + j, terrain.begin() + j + 3);
+                }
+            }
+            Timer t;
+            map.merge(flann::Matrix<Value>(scan.data(), scan.size() / 3, 3),
+                      flann::Matrix<Value>(origin, 1, 3));
+            map.update_dirty();
+            map.clear_dirty();
+            stats.update_time += t.seconds_elapsed();
+
+            if ((i + 1) % scans_per_plan != 0)
+            {
+                continue;
+            }
+            const auto nearby = map.nearby_indices(origin, 2.f);
+            if (nearby.empty())
+            {
+                continue;
+            }
+            t.reset();
+            Graph g(map);
+            std::vector<Vertex> predecessor(size_t(g.num_vertices()), INVALID_VERTEX);
+            stats.path_costs.assign(size_t(g.num_vertices()), std::numeric_limits<Value>::infinity());
+            EdgeCosts edge_costs(map);
+            boost::typed_identity_property_map<Vertex> index_map;
+            const auto v_start = Vertex(nearby.front());
+            boost::dijkstra_shortest_paths_no_color_map(g, v_start,
+                                                        predecessor.data(), stats.path_costs.data(), edge_costs,
+                                                        index_map,
+                                                        std::less<Value>(), boost::closed_plus<Value>(),
+                                                        std::numeric_limits<Value>::infinity(), Value(0.),
+                                                        boost::dijkstra_visitor<boost::null_visitor>());
+            stats.search_time += t.seconds_elapsed();
+            ++stats.num_plans;
+        }
+        return stats;
+    }
+
+    double max_difference(const std::vector<Value>& a, const std::vector<Value>& b)
+    {
+        double max_diff = 0.;
+        for (size_t i = 0; i < std::min(a.size(), b.size()); ++i)
+        {
+            if (std::isfinite(a[i]) != std::isfinite(b[i]))
+            {
+                return std::numeric_limits<double>::infinity();
+            }
+            if (std::isfinite(a[i]))
+            {
+                max_diff = std::max(max_diff, double(std::abs(a[i] - b[i])));
+            }
+        }
+        return max_diff;
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    const Value spacing = argc > 1 ? Value(std::atof(argv[1])) : 0.2f;
+    const int scans_per_plan = argc > 2 ? std::max(std::atoi(argv[2]), 1) : 5;
+    const int num_cycles = argc > 3 ? std::atoi(argv[3]) : 50;
+
+    std::mt19937 gen(0);
+    const auto terrain = create_terrain(Value(num_cycles) + 20.f, 30.f, spacing, gen);
+    const auto eager = run(terrain, spacing, false, scans_per_plan, num_cycles);
+    const auto lazy = run(terrain, spacing, true, scans_per_plan, num_cycles);
+    std::printf("%lu terrain points, %i cycles, %lu plans: "
+                "eager update %.3f s, search %.3f s, total %.3f s; "
+                "lazy update %.3f s, search %.3f s, total %.3f s; "
+                "max path cost difference %.3g.\n",
+                terrain.size() / 3, num_cycles, eager.num_plans,
+                eager.update_time, eager.search_time, eager.update_time + eager.search_time,
+                lazy.update_time, lazy.search_time, lazy.update_time + lazy.search_time,
+                max_difference(eager.path_costs, lazy.path_costs));
+    return 0;
+}
@@ -0,0 +1,32 @@
+#include <memory>
+#include <naex/grid/planner.h>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <ros/ros.h>
+
+namespace naex
+{
+
+/**
+ * Grid planner running within a nodelet manager, e.g., together with
+ * TraversabilityNodelet, so that traversability clouds are passed by pointer.
+ */
+class GridPlannerNodelet: public nodelet::Nodelet
+{
+protected:
+    ros::NodeHandle nh_;
+    ros::NodeHandle pnh_;
+    std::unique_ptr<grid::Planner> planner_;
+public:
+    ~GridPlannerNodelet() override = default;
+    void onInit() override
+    {
+        nh_ = getNodeHandle();
+        pnh_ = getPrivateNodeHandle();
+        planner_ = std::make_unique<grid::Planner>(nh_, pnh_);
+    }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(naex::GridPlannerNodelet, nodelet::Nodelet);
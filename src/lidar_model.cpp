@@ -12,6 +12,7 @@ public:
     LidarModel(ros::NodeHandle& nh, ros::NodeHandle& pnh):
             nh_(nh),
             pnh_(pnh),
+            models_(),
             model_(),
             check_model_(false)
     {
@@ -23,28 +24,36 @@ public:
     {
         Timer t;
         ROS_DEBUG("Cloud %u-by-%u received.", msg->height, msg->width);
-        print_cloud_summary(*msg);
-        if (!model_.fit(*msg))
+        // Cached model is refit only if it does not conform to the cloud.
+        const auto model = models_.get(*msg);
+        if (!model)
         {
             ROS_WARN("Fitting sensor model failed.");
             return;
         }
+        if (model == model_)
+        {
+            ROS_DEBUG("Cached sensor model used (%.6f s).", t.seconds_elapsed());
+            return;
+        }
+        model_ = model;
+        print_cloud_summary(*msg);
         ROS_INFO("Cloud %u-by-%u: "
                  "elevation [%.3g, %.3g], step %.3g, "
                  "azimuth [%.3g, %.3g], step %.3g [deg] "
                  "(%.3f s).",
-                 model_.height_, model_.width_,
-                 degrees(model_.elevation_start_),
-                 degrees(model_.elevation_start_ + (model_.height_ - 1) * model_.elevation_step_),
-                 degrees(model_.elevation_step_),
-                 degrees(model_.azimuth_start_),
-                 degrees(model_.azimuth_start_ + (model_.width_ - 1) * model_.azimuth_step_),
-                 degrees(model_.azimuth_step_),
+                 model_->height_, model_->width_,
+                 degrees(model_->elevation_start_),
+                 degrees(model_->elevation_start_ + (model_->height_ - 1) * model_->elevation_step_),
+                 degrees(model_->elevation_step_),
+                 degrees(model_->azimuth_start_),
+                 degrees(model_->azimuth_start_ + (model_->width_ - 1) * model_->azimuth_step_),
+                 degrees(model_->azimuth_step_),
                  t.seconds_elapsed());
-        model_.print_model_summary();
+        model_->print_model_summary();
         if (check_model_)
         {
-            model_.check(*msg);
+            model_->check(*msg, num_points(*msg));
         }
     }
 
@@ -52,7 +61,8 @@ private:
     ros::NodeHandle& nh_;
     ros::NodeHandle& pnh_;
     ros::Subscriber cloud_sub_;
-    SphericalProjection model_;
+    SphericalProjectionCache models_;
+    SphericalProjectionCache::ModelPtr model_;
     bool check_model_;
 };
 
@@ -9,7 +9,8 @@ int main (int argc, char *argv[])
 {
     ros::init(argc, argv, "planner");
     ros::NodeHandle nh, pnh("~");
-    naex::Planner planner(nh, pnh);
+    auto planner = naex::create_planner(nh, pnh);
+    planner->initialize();
 //    ros::spin();
     ros::MultiThreadedSpinner spinner(8);
     spinner.spin();
@@ -0,0 +1,73 @@
+#include <memory>
+#include <mutex>
+#include <naex/planner.h>
+#include <nodelet/nodelet.h>
+#include <pluginlib/class_list_macros.h>
+#include <ros/ros.h>
+#include <thread>
+
+namespace naex
+{
+
+/**
+ * Planner running within a nodelet manager, input clouds from nodelets in
+ * the same manager are received without serialization.
+ *
+ * Planner initialization waits for other robots and transforms, so it runs
+ * in a separate thread to keep onInit non-blocking. Unloading the nodelet
+ * cancels the waiting.
+ */
+class PlannerNodelet: public nodelet::Nodelet
+{
+protected:
+    ros::NodeHandle nh_;
+    ros::NodeHandle pnh_;
+    // Guards planner_ and canceled_ shared with the init thread.
+    std::mutex mutex_;
+    std::unique_ptr<PlannerBase> planner_;
+    bool canceled_{false};
+    std::thread init_thread_;
+public:
+    ~PlannerNodelet() override
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            canceled_ = true;
+            if (planner_)
+            {
+                planner_->cancel();
+            }
+        }
+        if (init_thread_.joinable())
+        {
+            init_thread_.join();
+        }
+    }
+    void onInit() override
+    {
+        // Callbacks are processed in parallel as with the multi-threaded spinner.
+        nh_ = getMTNodeHandle();
+        pnh_ = getMTPrivateNodeHandle();
+        init_thread_ = std::thread([this]()
+        {
+            auto planner = create_planner(nh_, pnh_);
+            PlannerBase* p = nullptr;
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                if (canceled_)
+                {
+                    return;
+                }
+                planner_ = std::move(planner);
+                p = planner_.get();
+            }
+            // Planner is destroyed only after this thread is joined.
+            p->initialize();
+            NODELET_INFO("Planner initialization finished.");
+        });
+    }
+};
+
+}
+
+PLUGINLIB_EXPORT_CLASS(naex::PlannerNodelet, nodelet::Nodelet);
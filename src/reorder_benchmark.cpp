@@ -0,0 +1,219 @@
+#include <algorithm>
+#include <boost/graph/graph_concepts.hpp>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <linux/perf_event.h>
+#include <naex/exceptions.h>
+#include <naex/map.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <numeric>
+#include <random>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <vector>
+// Graph traits need the map types.
+#include <naex/graph.h>
+// Compare memory locality of map updates and graph search before and after
+// reordering map points along Morton curve. Terrain points arrive in random
+// order, features, labels and edge costs of all points are recomputed and
+// the graph is searched, counting cache misses of the calling thread where
+// hardware counters are available.
+// Usage: reorder_benchmark [point_spacing] [terrain_size] [repeats]
+
+using namespace naex;
+
+namespace
+{
+    class CacheMissCounter
+    {
+    public:
+        CacheMissCounter()
+        {
+            perf_event_attr attr;
+            std::memset(&attr, 0, sizeof(attr));
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.size = sizeof(attr);
+            attr.config = PERF_COUNT_HW_CACHE_MISSES;
+            attr.disabled = 1;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            fd_ = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+        }
+        ~CacheMissCounter()
+        {
+            if (fd_ >= 0)
+            {
+                close(fd_);
+            }
+        }
+        void start()
+        {
+            if (fd_ >= 0)
+            {
+                ioctl(fd_, PERF_EVENT_IOC_RESET, 0);
+                ioctl(fd_, PERF_EVENT_IOC_ENABLE, 0);
+            }
+        }
+        /// Cache misses since start, negative if not available.
+        long long stop()
+        {
+            long long count = -1;
+            if (fd_ < 0)
+            {
+                return count;
+            }
+            ioctl(fd_, PERF_EVENT_IOC_DISABLE, 0);
+            if (read(fd_, &count, sizeof(count)) != sizeof(count))
+            {
+                return -1;
+            }
+            return count;
+        }
+    private:
+        int fd_{-1};
+    };
+
+    std::vector<Value> create_terrain(Value size, Value spacing, std::mt19937& gen)
+    {
+        std::uniform_real_distribution<Value> noise(-0.25f * spacing, 0.25f * spacing);
+        std::vector<std::vector<Value>> points;
+        for (Value x = 0.f; x <= size; x += spacing)
+        {
+            for (Value y = 0.f; y <= size; y += spacing)
+            {
+                const Value z = 0.5f * std::sin(0.3f * x) * std::cos(0.2f * y);
+                points.push_back({x + noise(gen), y + noise(gen), z});
+                // Blocks along the way.
+                if (std::fmod(x, 10.f) < 1.f && std::fmod(y, 10.f) < 1.f)
+                {
+                    for (Value h = spacing; h <= 2.f; h += spacing)
+                    {
+                        points.push_back({x, y, z + h});
+                    }
+                }
+            }
+        }
+        // Points arrive in random order.
+        std::shuffle(points.begin(), points.end(), gen);
+        std::vector<Value> flat;
+        for (const auto& p: points)
+        {
+            flat.insert(flat.end(), p.begin(), p.end());
+        }
+        return flat;
+    }
+
+    class Stats
+    {
+    public:
+        double update_time{0.};
+        long long update_misses{0};
+        double search_time{0.};
+        long long search_misses{0};
+        double path_cost_sum{0.};
+    };
+
+    Stats measure(Map& map, const Value* start, int repeats, CacheMissCounter& counter)
+    {
+        Stats stats;
+        std::vector<Index> all(map.size());
+        std::iota(all.begin(), all.end(), 0);
+        Timer t;
+        counter.start();
+        for (int i = 0; i < repeats; ++i)
+        {
+            map.compute_features(all.begin(), all.end());
+            map.compute_labels(all.begin(), all.end());
+            map.compute_edge_costs(all.begin(), all.end());
+        }
+        stats.update_misses = counter.stop();
+        stats.update_time = t.seconds_elapsed();
+
+        Vertex v_start = 0;
+        Value min_dist = std::numeric_limits<Value>::infinity();
+        for (Index v = 0; v < Index(map.size()); ++v)
+        {
+            const Value d = (ConstVec3Map(map.cloud_[v].position_) - ConstVec3Map(start)).norm();
+            if (d < min_dist)
+            {
+                min_dist = d;
+                v_start = v;
+            }
+        }
+        Graph g(map);
+        EdgeCosts edge_costs(map);
+        boost::typed_identity_property_map<Vertex> index_map;
+        std::vector<Vertex> predecessor(size_t(g.num_vertices()), INVALID_VERTEX);
+        std::vector<Value> path_costs(size_t(g.num_vertices()), std::numeric_limits<Value>::infinity());
+        t.reset();
+        counter.start();
+        for (int i = 0; i < repeats; ++i)
+        {
+            std::fill(path_costs.begin(), path_costs.end(), std::numeric_limits<Value>::infinity());
+            boost::dijkstra_shortest_paths_no_color_map(g, v_start,
+                                                        predecessor.data(), path_costs.data(), edge_costs,
+                                                        index_map,
+                                                        std::less<Value>(), boost::closed_plus<Value>(),
+                                                        std::numeric_limits<Value>::infinity(), Value(0.),
+                                                        boost::dijkstra_visitor<boost::null_visitor>());
+        }
+        stats.search_misses = counter.stop();
+        stats.search_time = t.seconds_elapsed();
+        for (const auto c: path_costs)
+        {
+            if (std::isfinite(c))
+            {
+                stats.path_cost_sum += c;
+            }
+        }
+        return stats;
+    }
+
+    void print(const char* name, const Stats& stats)
+    {
+        std::printf("%s: update %.3f s, %lld cache misses; search %.3f s, %lld cache misses; "
+                    "path cost sum %.1f.\n",
+                    name, stats.update_time, stats.update_misses, stats.search_time, stats.search_misses,
+                    stats.path_cost_sum);
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    const Value spacing = argc > 1 ? Value(std::atof(argv[1])) : 0.2f;
+    const Value size = argc > 2 ? Value(std::atof(argv[2])) : 100.f;
+    const int repeats = argc > 3 ? std::max(std::atoi(argv[3]), 1) : 3;
+
+    CacheMissCounter counter;
+    std::mt19937 gen(0);
+    const auto terrain = create_terrain(size, spacing, gen);
+    // Start between blocks.
+    Value origin[3] = {size / 2 + 5.f, size / 2 + 5.f, 0.f};
+
+    Map map;
+    map.points_min_dist_ = spacing / 2;
+    map.neighborhood_radius_ = 3 * spacing;
+    map.clearance_radius_ = 3 * spacing;
+    map.min_dist_to_obstacle_ = 0.f;
+    Timer t;
+    map.merge(flann::Matrix<Value>(const_cast<Value*>(terrain.data()), terrain.size() / 3, 3),
+              flann::Matrix<Value>(origin, 1, 3));
+    map.update_dirty();
+    map.clear_dirty();
+    std::printf("%lu points, %lu neighbors, map built in %.3f s.\n",
+                map.size(), map.adjacency_.size(), t.seconds_elapsed());
+
+    const auto arrival = measure(map, origin, repeats, counter);
+    t.reset();
+    map.reorder(map.points_min_dist_);
+    const double reorder_time = t.seconds_elapsed();
+    const auto reordered = measure(map, origin, repeats, counter);
+    print("Arrival order", arrival);
+    print("Morton order", reordered);
+    std::printf("Reordered in %.3f s.\n", reorder_time);
+    return 0;
+}
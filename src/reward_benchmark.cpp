@@ -0,0 +1,162 @@
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <naex/clouds.h>
+#include <naex/nearest_neighbors.h>
+#include <naex/reward.h>
+#include <naex/timer.h>
+#include <naex/types.h>
+#include <random>
+#include <vector>
+// Compare reward collection methods on synthetic terrain.
+// Points are sampled from a wavy ground surface with a few walls, within
+// 2 * max_vp_distance from the origin, as in Planner::gather_viewpoints.
+// Usage: reward_benchmark [point_spacing] [repeats]
+// Methods are compared without and with self coverage rewards, the program
+// fails if FFT or LUT rewards differ from voxel ones by more than 0.1 %
+// of the maximum reward.
+// Second part compares the LUT kernel on 50k to 200k reward voxels.
+
+using namespace naex;
+
+namespace
+{
+    std::vector<RewardPoint> create_terrain(Value radius, Value spacing, std::mt19937& gen)
+    {
+        std::uniform_real_distribution<Value> noise(-0.25f * spacing, 0.25f * spacing);
+        std::uniform_real_distribution<Value> coverage(0.f, 1.f);
+        std::vector<RewardPoint> points;
+        for (Value x = -radius; x <= radius; x += spacing)
+        {
+            for (Value y = -radius; y <= radius; y += spacing)
+            {
+                if (x * x + y * y > radius * radius)
+                {
+                    continue;
+                }
+                RewardPoint p;
+                p.position_[0] = x + noise(gen);
+                p.position_[1] = y + noise(gen);
+                p.position_[2] = 0.5f * std::sin(0.3f * x) * std::cos(0.2f * y);
+                // Parts of the map seen already, by any robot or by self.
+                p.coverage_ = (x < 0.f) ? coverage(gen) : 0.f;
+                p.self_coverage_ = (x < 0.f && y < 0.f) ? p.coverage_ : 0.f;
+                points.push_back(p);
+                // Walls along lines x = const.
+                if (std::fmod(std::abs(x), 8.f) < spacing)
+                {
+                    for (Value z = spacing; z <= 2.f; z += spacing)
+                    {
+                        RewardPoint w = p;
+                        w.position_[2] += z;
+                        points.push_back(w);
+                    }
+                }
+            }
+        }
+        return points;
+    }
+
+    template<typename F>
+    double time_method(const std::vector<RewardPoint>& input, std::vector<RewardPoint>& output,
+                       int repeats, F method)
+    {
+        std::vector<Index> indices;
+        index_range(input.size(), indices);
+        output = input;
+        Timer t;
+        for (int i = 0; i < repeats; ++i)
+        {
+            method(output, indices);
+        }
+        return t.seconds_elapsed() / repeats;
+    }
+
+    double max_difference(const std::vector<RewardPoint>& a, const std::vector<RewardPoint>& b)
+    {
+        double max_diff = 0.;
+        for (size_t i = 0; i < a.size(); ++i)
+        {
+            max_diff = std::max(max_diff, double(std::abs(a[i].reward_ - b[i].reward_)));
+        }
+        return max_diff;
+    }
+
+    double max_reward(const std::vector<RewardPoint>& a)
+    {
+        double max_reward = 0.;
+        for (const auto& p: a)
+        {
+            max_reward = std::max(max_reward, double(p.reward_));
+        }
+        return max_reward;
+    }
+}
+
+int main (int argc, char *argv[])
+{
+    const Value spacing = argc > 1 ? Value(std::atof(argv[1])) : 0.2f;
+    const int repeats = argc > 2 ? std::atoi(argv[2]) : 3;
+    const Value mean = 3.0;
+    const Value std = 1.5;
+    const Value bin_size = 0.5;
+
+    const double tolerance = 1e-3;
+    bool ok = true;
+
+    // Methods at viewpoint distances and self factors used by the planner.
+    for (const Value max_vp_distance: {5.f, 10.f, 20.f})
+    {
+        for (const Value self_factor: {0.f, 0.25f})
+        {
+            std::mt19937 gen(0);
+            const auto input = create_terrain(2 * max_vp_distance, spacing, gen);
+            std::vector<RewardPoint> voxel_pts, fft_pts, lut_pts;
+            const double voxel_time = time_method(input, voxel_pts, repeats,
+                [=](std::vector<RewardPoint>& pts, const std::vector<Index>& indices)
+                { collect_rewards(pts, indices, mean, std, max_vp_distance, self_factor, false); });
+            const double fft_time = time_method(input, fft_pts, repeats,
+                [=](std::vector<RewardPoint>& pts, const std::vector<Index>& indices)
+                { collect_rewards_fft(pts, indices, mean, std, max_vp_distance, self_factor, false, bin_size); });
+            const double lut_time = time_method(input, lut_pts, repeats,
+                [=](std::vector<RewardPoint>& pts, const std::vector<Index>& indices)
+                { collect_rewards_lut(pts, indices, mean, std, max_vp_distance, self_factor, false, bin_size); });
+            const double fft_diff = max_difference(voxel_pts, fft_pts);
+            const double lut_diff = max_difference(voxel_pts, lut_pts);
+            std::printf("max_vp_distance %.1f m, self_factor %.2f, %lu points: voxel %.3f s, fft %.3f s, lut %.3f s, "
+                        "max reward difference fft %.3g, lut %.3g (max reward %.3g).\n",
+                        max_vp_distance, self_factor, input.size(), voxel_time, fft_time, lut_time,
+                        fft_diff, lut_diff, max_reward(voxel_pts));
+            if (std::max(fft_diff, lut_diff) > tolerance * max_reward(voxel_pts))
+            {
+                std::printf("Rewards differ from voxel ones by more than %.3g %%.\n", 100 * tolerance);
+                ok = false;
+            }
+        }
+    }
+
+    // LUT kernel with large numbers of reward voxels, one point per voxel.
+    const Value max_collect_dist = 10.f;
+    for (const size_t n_voxels: {50000, 100000, 200000})
+    {
+        std::mt19937 gen(0);
+        const Value radius = std::sqrt(n_voxels * bin_size * bin_size / Value(M_PI));
+        const auto input = create_terrain(radius, bin_size, gen);
+        std::vector<RewardPoint> voxel_pts, lut_pts, lut_pts_2;
+        const double voxel_time = time_method(input, voxel_pts, 1,
+            [=](std::vector<RewardPoint>& pts, const std::vector<Index>& indices)
+            { collect_rewards(pts, indices, mean, std, max_collect_dist, 0.f, false); });
+        const double lut_time = time_method(input, lut_pts, repeats,
+            [=](std::vector<RewardPoint>& pts, const std::vector<Index>& indices)
+            { collect_rewards_lut(pts, indices, mean, std, max_collect_dist, 0.f, false, bin_size); });
+        time_method(input, lut_pts_2, 1,
+            [=](std::vector<RewardPoint>& pts, const std::vector<Index>& indices)
+            { collect_rewards_lut(pts, indices, mean, std, max_collect_dist, 0.f, false, bin_size); });
+        std::printf("max_collect_dist %.1f m, %lu points: voxel %.3f s, lut %.3f s, "
+                    "max reward difference %.3g (max reward %.3g), lut deterministic: %s.\n",
+                    max_collect_dist, input.size(), voxel_time, lut_time,
+                    max_difference(voxel_pts, lut_pts), max_reward(voxel_pts),
+                    max_difference(lut_pts, lut_pts_2) == 0. ? "yes" : "no");
+    }
+    return ok ? 0 : 1;
+}